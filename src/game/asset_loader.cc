@@ -0,0 +1,238 @@
+#include "game/asset_loader.h"
+#include <GLFW/glfw3.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "geo/mesh_cache.h"
+#include "util/toytga.h"
+
+namespace quarke {
+namespace game {
+
+// Two workers keep disk reads overlapped without contending much with the
+// parser's own threads.
+static const unsigned DEFAULT_WORKER_THREADS = 2;
+
+// Maximum number of bytes of texture data streamed through the staging
+// buffer per upload step.
+static const GLsizeiptr STAGING_BUFFER_SIZE = 4 * 1024 * 1024;
+
+struct AssetLoader::Job {
+  enum Type {
+    MESH,
+    TEXTURE,
+  } type;
+  std::string path;
+  bool failed;
+
+  // Meshes are either mapped from the mesh cache, or prepared from source.
+  bool packed;
+  std::unique_ptr<geo::MeshCache> cache;
+  geo::MeshData mesh_data;
+  MeshCallback on_ready;
+
+  GLuint texture;
+  util::TGA::Descriptor image;
+  int rows_uploaded;
+
+  Job() : failed(false), packed(false), texture(0), image(), rows_uploaded(0) {}
+  ~Job() { free(image.data); }
+};
+
+/* static */
+std::unique_ptr<AssetLoader> AssetLoader::Create(unsigned num_threads) {
+  GLuint staging_buffer;
+  glGenBuffers(1, &staging_buffer);
+
+  if (num_threads == 0) {
+    num_threads = DEFAULT_WORKER_THREADS;
+  }
+  return std::unique_ptr<AssetLoader>(
+      new AssetLoader(staging_buffer, num_threads));
+}
+
+AssetLoader::AssetLoader(GLuint staging_buffer, unsigned num_threads)
+  : staging_buffer_(staging_buffer), stopping_(false), pending_(0) {
+  for (unsigned i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&AssetLoader::WorkerMain, this);
+  }
+}
+
+AssetLoader::~AssetLoader() {
+  {
+    std::lock_guard<std::mutex> lock(work_mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+
+  glDeleteBuffers(1, &staging_buffer_);
+  glDeleteTextures((GLsizei) textures_.size(), textures_.data());
+}
+
+void AssetLoader::LoadMesh(const std::string& path, MeshCallback on_ready,
+                           bool packed) {
+  auto job = std::make_unique<Job>();
+  job->type = Job::MESH;
+  job->path = path;
+  job->packed = packed;
+  job->on_ready = std::move(on_ready);
+
+  pending_++;
+  {
+    std::lock_guard<std::mutex> lock(work_mutex_);
+    work_.push_back(std::move(job));
+  }
+  work_cv_.notify_one();
+}
+
+GLuint AssetLoader::LoadTexture(const std::string& path) {
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  const GLubyte placeholder[] = { 0xFF, 0xFF, 0xFF, 0xFF };
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+               placeholder);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  textures_.push_back(texture);
+
+  auto job = std::make_unique<Job>();
+  job->type = Job::TEXTURE;
+  job->path = path;
+  job->texture = texture;
+
+  pending_++;
+  {
+    std::lock_guard<std::mutex> lock(work_mutex_);
+    work_.push_back(std::move(job));
+  }
+  work_cv_.notify_one();
+  return texture;
+}
+
+void AssetLoader::Update(double budget) {
+  const double deadline = glfwGetTime() + budget;
+  do {
+    if (!current_ && !ready_.Pop(current_))
+      break;
+    if (UploadStep(*current_)) {
+      current_ = nullptr;
+      pending_--;
+    }
+  } while (glfwGetTime() < deadline);
+}
+
+void AssetLoader::WorkerMain() {
+  while (true) {
+    std::unique_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock(work_mutex_);
+      work_cv_.wait(lock, [this] { return stopping_ || !work_.empty(); });
+      if (stopping_)
+        return;
+      job = std::move(work_.front());
+      work_.pop_front();
+    }
+    Decode(*job);
+    ready_.Push(std::move(job));
+  }
+}
+
+void AssetLoader::Decode(Job& job) {
+  switch (job.type) {
+    case Job::MESH:
+      job.cache = geo::MeshCache::Open(job.path);
+      if (job.cache && geo::IsPackedFormat(job.cache->format()) == job.packed)
+        break;
+      job.cache = nullptr;
+      job.failed = !geo::Mesh::PrepareOBJ(job.path, job.packed, job.mesh_data);
+      break;
+    case Job::TEXTURE:
+      job.failed = !util::TGA::LoadTGA(job.path.c_str(), job.image);
+      break;
+  }
+}
+
+bool AssetLoader::UploadStep(Job& job) {
+  if (job.failed) {
+    std::cerr << "[assets] Failed to load " << job.path << std::endl;
+    return true;
+  }
+
+  switch (job.type) {
+    case Job::MESH: {
+      auto mesh = job.cache ? geo::Mesh::FromCache(*job.cache)
+                            : geo::Mesh::FromData(job.mesh_data);
+      if (!mesh) {
+        std::cerr << "[assets] Failed to upload " << job.path << std::endl;
+        return true;
+      }
+      job.on_ready(std::move(mesh));
+      return true;
+    }
+    case Job::TEXTURE:
+      return UploadTextureRows(job);
+  }
+  return true;
+}
+
+bool AssetLoader::UploadTextureRows(Job& job) {
+  const util::TGA::Descriptor& image = job.image;
+  const bool rgba = image.format == util::TGA::Descriptor::TGA_RGBA32;
+  // TGA pixel data is stored in BGR(A) order.
+  const GLenum format = rgba ? GL_BGRA : GL_BGR;
+  const GLsizeiptr row_size = image.width * (rgba ? 4 : 3);
+
+  glBindTexture(GL_TEXTURE_2D, job.texture);
+  if (job.rows_uploaded == 0) {
+    glTexImage2D(GL_TEXTURE_2D, 0, rgba ? GL_RGBA : GL_RGB, image.width,
+                 image.height, 0, format, GL_UNSIGNED_BYTE, nullptr);
+    // Restrict sampling to the base level until mipmaps are generated, so
+    // the texture remains complete while partially uploaded.
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+  }
+
+  const int rows = std::min<int>(image.height - job.rows_uploaded,
+      std::max<GLsizeiptr>(STAGING_BUFFER_SIZE / row_size, 1));
+  const GLsizeiptr size = rows * row_size;
+
+  // Orphan the previous contents of the staging buffer, so that we never
+  // wait on a prior transfer still in flight.
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging_buffer_);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+  void* staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                   GL_MAP_WRITE_BIT |
+                                   GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (staging) {
+    memcpy(staging, image.data + job.rows_uploaded * row_size, size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, job.rows_uploaded, image.width, rows,
+                    format, GL_UNSIGNED_BYTE, nullptr);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  } else {
+    // Fall back to a synchronous upload from client memory.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, job.rows_uploaded, image.width, rows,
+                    format, GL_UNSIGNED_BYTE,
+                    image.data + job.rows_uploaded * row_size);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  job.rows_uploaded += rows;
+
+  const bool done = job.rows_uploaded == image.height;
+  if (done) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+    glGenerateMipmap(GL_TEXTURE_2D);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return done;
+}
+
+}  // namespace game
+}  // namespace quarke
@@ -0,0 +1,82 @@
+#ifndef QUARKE_SRC_GAME_ASSET_LOADER_H_
+#define QUARKE_SRC_GAME_ASSET_LOADER_H_
+
+#include <glad/glad.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "geo/mesh.h"
+#include "util/mpsc_queue.h"
+
+namespace quarke {
+namespace game {
+
+// Streams meshes and textures in the background.
+// Files are read and decoded on worker threads, then handed to the GL thread
+// through a lock-free queue, where they are uploaded by Update() under a
+// per-frame time budget. All public methods must be called on the GL thread.
+class AssetLoader {
+ public:
+  typedef std::function<void(std::unique_ptr<geo::Mesh>)> MeshCallback;
+
+  // Starts `num_threads` worker threads, or a default number if zero.
+  static std::unique_ptr<AssetLoader> Create(unsigned num_threads = 0);
+
+  ~AssetLoader();
+
+  // Queues the OBJ file at `path` for loading (see geo::Mesh::FromOBJ).
+  // Once uploaded, the mesh is passed to `on_ready` from within Update().
+  // Meshes that fail to load are logged and dropped.
+  void LoadMesh(const std::string& path, MeshCallback on_ready,
+                bool packed = true);
+
+  // Queues the TGA file at `path` for loading, returning a GL_TEXTURE_2D
+  // name that is immediately usable. The texture holds a single white texel
+  // until its contents have been uploaded. Textures are owned by the loader.
+  GLuint LoadTexture(const std::string& path);
+
+  // Uploads decoded assets until `budget` seconds have elapsed. At least one
+  // step of work is performed if any is available, so that progress is made
+  // regardless of budget. Large textures are uploaded across multiple steps.
+  void Update(double budget);
+
+  // Returns the number of requested assets that have not finished uploading.
+  size_t pending() const { return pending_; }
+
+ private:
+  struct Job;
+
+  AssetLoader(GLuint staging_buffer, unsigned num_threads);
+
+  // Runs on worker threads, decoding jobs from the work queue.
+  void WorkerMain();
+  void Decode(Job& job);
+
+  // Performs a single step of uploading `job` on the GL thread.
+  // Returns true once the job is complete.
+  bool UploadStep(Job& job);
+  bool UploadTextureRows(Job& job);
+
+  GLuint staging_buffer_; // GL_PIXEL_UNPACK_BUFFER used to stream textures
+  std::vector<GLuint> textures_;
+
+  std::vector<std::thread> workers_;
+  std::mutex work_mutex_;
+  std::condition_variable work_cv_;
+  std::deque<std::unique_ptr<Job>> work_; // guarded by work_mutex_
+  bool stopping_; // guarded by work_mutex_
+
+  util::MPSCQueue<std::unique_ptr<Job>> ready_;
+  std::unique_ptr<Job> current_; // partially uploaded job, if any
+  size_t pending_;
+};
+
+}  // namespace game
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GAME_ASSET_LOADER_H_
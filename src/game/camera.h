@@ -36,10 +36,17 @@ class Camera {
   glm::mat4 ComputeProjection() const;
   // Computes a view transformation matrix.
   glm::mat4 ComputeView() const;
+  // Gets the view-to-clip perspective projection alone.
+  const glm::mat4& projection_matrix() const { return projection_; }
 
   // Gets the camera eye point in world space.
   glm::vec3 Position() const;
 
+  // Gets the vertical field of view, in radians.
+  float fov() const { return fov_; }
+  // Gets the distances to the near and far clipping planes.
+  float z_near() const { return near_; }
+  float z_far() const { return far_; }
   int viewport_width() const { return viewport_width_; }
   int viewport_height() const { return viewport_height_; }
  private:
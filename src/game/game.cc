@@ -1,4 +1,8 @@
 #include "game/game.h"
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "util/toytga.h"
 
 // XXX: temporary includes for testing
 #include "game/scene.h"
@@ -12,10 +16,19 @@ static Scene* todo_remove_scene; // TODO: the name says it all
 
 // Maximum time step is 100ms.
 static const float MAX_TIME_STEP = 0.1;
+// Frames rendered once assets have loaded before capturing, letting culling
+// against previous frames and cached shadow maps catch up.
+static const int CAPTURE_SETTLE_FRAMES = 8;
 
 /* static */
 int Game::Run(int* argc, char** argv[]) {
   assert(!current_game);
+  std::string capture_path;
+  for (int i = 1; i < *argc; i++) {
+    if (strcmp((*argv)[i], "--capture") == 0 && i + 1 < *argc)
+      capture_path = (*argv)[++i];
+  }
+
   if (!glfwInit())
     return -1;
 
@@ -34,16 +47,16 @@ int Game::Run(int* argc, char** argv[]) {
     return -1;
   }
 
-  Game game(window);
+  Game game(window, capture_path);
   current_game = &game;
-  game.Loop();
+  const int status = game.Loop();
 
   current_game = nullptr;
   glfwTerminate();
-  return 0;
+  return status;
 }
 
-void Game::Loop() {
+int Game::Loop() {
   glfwMakeContextCurrent(window_);
   gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
 
@@ -65,19 +78,53 @@ void Game::Loop() {
       todo_remove_scene->OnKeyEvent(key, scancode, action, mods);
   });
 
-  last_delta_ = 1.f/60.f;
+  // Time stands still while capturing, so that the frame only depends on
+  // the build.
+  const bool capture = !capture_path_.empty();
+  int status = 0;
+  int settled_frames = 0;
+  last_delta_ = capture ? 0.f : 1.f/60.f;
   while (!glfwWindowShouldClose(window_)) {
     float start = glfwGetTime();
 
     scene.Update(last_delta_);
     scene.Render();
+    if (capture && !scene.loading() &&
+        ++settled_frames == CAPTURE_SETTLE_FRAMES) {
+      status = Capture() ? 0 : -1;
+      glfwSetWindowShouldClose(window_, GLFW_TRUE);
+    }
     glfwSwapBuffers(window_);
     glfwPollEvents();
 
-    last_delta_ = fmin(glfwGetTime() - start, MAX_TIME_STEP);
+    if (!capture)
+      last_delta_ = fmin(glfwGetTime() - start, MAX_TIME_STEP);
   }
 
   todo_remove_scene = nullptr;
+  return status;
+}
+
+bool Game::Capture() const {
+  int width, height;
+  glfwGetFramebufferSize(window_, &width, &height);
+  std::vector<char> pixels(width * height * 3);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  glReadBuffer(GL_BACK);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_BGR, GL_UNSIGNED_BYTE, pixels.data());
+
+  util::TGA::Descriptor frame;
+  frame.data = pixels.data();
+  frame.length = pixels.size();
+  frame.width = width;
+  frame.height = height;
+  frame.format = util::TGA::Descriptor::TGA_RGB24;
+  if (!util::TGA::WriteTGA(capture_path_.c_str(), frame))
+    return false;
+  std::cout << "[game] captured " << width << "x" << height << " frame to "
+            << capture_path_ << std::endl;
+  return true;
 }
 
 
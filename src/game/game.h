@@ -3,6 +3,7 @@
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <string>
 
 namespace quarke {
 namespace game {
@@ -11,18 +12,27 @@ class Game {
  public:
   // Instantiates a game instance.
   // Called only once from the program's entry point.
+  // With `--capture path`, renders a fixed view of the scene once it has
+  // loaded, writes the frame to `path` as a TGA and exits, so that the
+  // output of two builds can be compared (see tools/framediff.cc).
   static int Run(int* argc, char** argv[]);
 
-  void Loop();
+  // Returns the program's exit status.
+  int Loop();
 
   // Returns the last frame delta in seconds.
   double DeltaTime() const { return last_delta_; }
 
   GLFWwindow* window() const { return window_; }
  private:
-  Game(GLFWwindow* window) : window_(window) {}
+  Game(GLFWwindow* window, const std::string& capture_path)
+    : window_(window), capture_path_(capture_path) {}
+
+  // Writes the back buffer to capture_path_. Returns false on failure.
+  bool Capture() const;
 
   GLFWwindow* window_;
+  const std::string capture_path_; // empty unless capturing
   double last_delta_;
 };
 
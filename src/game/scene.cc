@@ -1,13 +1,14 @@
 #include "game/scene.h"
+#include "game/asset_loader.h"
 #include "game/fps_input_controller.h"
 #include "game/game.h"
 #include "mat/solid_material.h"
 #include "mat/textured_material.h"
-#include "util/toytga.h"
 #include <glm/gtc/constants.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/rotate_vector.hpp>
 #include <iostream>
+#include <string>
 
 namespace quarke {
 namespace game {
@@ -17,54 +18,52 @@ Scene::Scene(const Game& game, int width, int height)
   , camera_(width, height)
   , manual_control_(false)
   , rot(0)
+  , graph_(targets_)
   , active_stage_(COMPOSITE) {
 
   solid_material_ = std::make_unique<mat::SolidMaterial>();
 
-  util::TGA::Descriptor pepper;
-  assert(util::TGA::LoadTGA("tex/ad.tga", pepper));
-  // XXX: assume power of two texture size and rgb.
-  assert(pepper.format == util::TGA::Descriptor::TGA_RGB24);
-  GLuint pepper_tex;
-  glGenTextures(1, &pepper_tex);
-  glBindTexture(GL_TEXTURE_2D, pepper_tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, pepper.width, pepper.height, 0,
-      GL_RGB, GL_UNSIGNED_BYTE, pepper.data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
-  glGenerateMipmap(GL_TEXTURE_2D);
-  pepper_tex_ = pepper_tex;
-  free(pepper.data);
+  assets_ = AssetLoader::Create();
+  assert(assets_);
+
+  graph_.set_profiler(&profiler_);
+
+  pepper_tex_ = assets_->LoadTexture("tex/ad.tga");
   textured_material_ = std::make_unique<mat::TexturedMaterial>(GL_TEXTURE_2D, pepper_tex_);
 
   // XXX: Load some demo data.
-  auto armadillo = geo::Mesh::FromOBJ("model/armadillo.obj");
-  armadillo->set_color(glm::vec4(0.2, 0.6, 0.2, 1.0));
-  armadillo->set_transform(glm::translate(glm::mat4(), glm::vec3(0.f, 1.f, 0.f)));
-  meshes_.AddMesh(solid_material_.get(), std::move(armadillo));
-
-  auto terrain = geo::Mesh::FromOBJ("model/huge_box.obj");
-  terrain->set_color(glm::vec4(0.8, 0.8, 0.8, 1.0));
-  terrain->set_transform(
-      glm::translate(glm::mat4(), glm::vec3(0.f, 0.7f, 0.f)) *
-      glm::scale(glm::mat4(), glm::vec3(4.0, 4.0, 4.0)));
-  meshes_.AddMesh(solid_material_.get(), std::move(terrain));
-
-  auto bunny = geo::Mesh::FromOBJ("model/bunny.obj");
-  bunny->set_color(glm::vec4(1.0, 1.0, 1.0, 1.0));
-  bunny->set_transform(
-      glm::translate(glm::mat4(), glm::vec3(2.5, 0.0, 0.0)) *
-      glm::rotate(glm::mat4(), 180.f, glm::vec3(0.0, 1.0, 0.0)) *
-      glm::scale(glm::mat4(), glm::vec3(0.25, 0.25, 0.25))
-  );
-  meshes_.AddMesh(solid_material_.get(), std::move(bunny));
-
-  auto wall = geo::Mesh::FromOBJ("model/wall.obj");
-  wall->set_transform(
-      glm::translate(glm::mat4(), glm::vec3(0.0, 2.5, 2.5)) *
-      glm::scale(glm::mat4(), glm::vec3(3.0, 3.0, 3.0)) *
-      glm::rotate(glm::mat4(), glm::pi<float>(), glm::vec3(0.f, 1.f, 0.f)));
-  meshes_.AddMesh(textured_material_.get(), std::move(wall));
+  // Meshes are added to the scene as they finish streaming in.
+  assets_->LoadMesh("model/armadillo.obj", [this](std::unique_ptr<geo::Mesh> armadillo) {
+    armadillo->set_color(glm::vec4(0.2, 0.6, 0.2, 1.0));
+    armadillo->set_transform(glm::translate(glm::mat4(), glm::vec3(0.f, 1.f, 0.f)));
+    meshes_.AddMesh(solid_material_.get(), std::move(armadillo));
+  });
+
+  assets_->LoadMesh("model/huge_box.obj", [this](std::unique_ptr<geo::Mesh> terrain) {
+    terrain->set_color(glm::vec4(0.8, 0.8, 0.8, 1.0));
+    terrain->set_transform(
+        glm::translate(glm::mat4(), glm::vec3(0.f, 0.7f, 0.f)) *
+        glm::scale(glm::mat4(), glm::vec3(4.0, 4.0, 4.0)));
+    meshes_.AddMesh(solid_material_.get(), std::move(terrain));
+  });
+
+  assets_->LoadMesh("model/bunny.obj", [this](std::unique_ptr<geo::Mesh> bunny) {
+    bunny->set_color(glm::vec4(1.0, 1.0, 1.0, 1.0));
+    bunny->set_transform(
+        glm::translate(glm::mat4(), glm::vec3(2.5, 0.0, 0.0)) *
+        glm::rotate(glm::mat4(), 180.f, glm::vec3(0.0, 1.0, 0.0)) *
+        glm::scale(glm::mat4(), glm::vec3(0.25, 0.25, 0.25))
+    );
+    meshes_.AddMesh(solid_material_.get(), std::move(bunny));
+  });
+
+  assets_->LoadMesh("model/wall.obj", [this](std::unique_ptr<geo::Mesh> wall) {
+    wall->set_transform(
+        glm::translate(glm::mat4(), glm::vec3(0.0, 2.5, 2.5)) *
+        glm::scale(glm::mat4(), glm::vec3(3.0, 3.0, 3.0)) *
+        glm::rotate(glm::mat4(), glm::pi<float>(), glm::vec3(0.f, 1.f, 0.f)));
+    meshes_.AddMesh(textured_material_.get(), std::move(wall));
+  });
 
   point_lights_.push_back({1.0f, 30.0f, glm::vec3(0.f, 7.f, -5.f), glm::vec4(1.0f, 1.0f, 1.0f, 1.0f)});
 
@@ -128,105 +127,211 @@ void Scene::Update(float dt) {
 }
 
 void Scene::Render() {
+  profiler_.BeginFrame();
+
   if (!geom_) {
     // TODO: instantiate this elsewhere where we can handle failures.
     //       in addition, make the mesh interface somewhat exposed.
-    geom_ = pipe::GeometryStage::Create(camera_.viewport_width(),
+    geom_ = pipe::GeometryStage::Create(targets_, camera_.viewport_width(),
                                         camera_.viewport_height());
     assert(geom_);
   }
 
-  if (!ambient_) {
-    ambient_ = pipe::AmbientStage::Create(camera_.viewport_width(),
-                                          camera_.viewport_height(),
-                                          glm::vec4(0.2, 0.2, 0.2, 1.0));
-    assert(ambient_);
-  }
-
   if (!lighting_) {
-    lighting_ = pipe::PhongStage::Create(camera_.viewport_width(),
+    lighting_ = pipe::PhongStage::Create(targets_, camera_.viewport_width(),
                                          camera_.viewport_height(),
                                          geom_->color_tex(),
                                          geom_->normal_tex(),
                                          geom_->position_tex(),
-                                         geom_->depth_tex());
+                                         geom_->depth_tex(),
+                                         geom_->layout());
     assert(lighting_);
   }
 
   if (!omni_shadow_) {
-    const GLsizei TEXTURE_RESOLUTION = 2048;
-    omni_shadow_ = pipe::OmniShadowStage::Create(TEXTURE_RESOLUTION);
+    const GLsizei ATLAS_RESOLUTION = 4096;
+    omni_shadow_ = pipe::OmniShadowStage::Create(targets_, ATLAS_RESOLUTION);
     assert(omni_shadow_);
   }
 
+  if (!hiz_) {
+    hiz_ = pipe::HiZStage::Create(targets_, camera_.viewport_width(),
+                                  camera_.viewport_height());
+    assert(hiz_);
+    occlusion_ = std::make_unique<pipe::OcclusionCuller>(*hiz_);
+    geom_->set_occlusion_culler(occlusion_.get());
+  }
+
   if (!ssao_) {
-    ssao_ = pipe::SSAOStage::Create(camera_.viewport_width(),
-                                    camera_.viewport_height());
+    ssao_ = pipe::SSAOStage::Create(targets_, camera_.viewport_width(),
+                                    camera_.viewport_height(),
+                                    geom_->layout(),
+                                    glm::vec4(0.2, 0.2, 0.2, 1.0));
     assert(ssao_);
   }
 
-  auto mesh_iter = meshes_.Iterator();
-  geom_->Clear();
-  geom_->Render(camera_, mesh_iter);
-
-  ambient_->Clear();
-  ambient_->Render(geom_->color_tex());
-
-  lighting_->Clear();
-
-  int width = camera_.viewport_width();
-  int height = camera_.viewport_height();
-
-  // XXX: share a light buffer between the ambient and phong stages.
-  glBindFramebuffer(GL_READ_FRAMEBUFFER, ambient_->ambient_fbo());
-  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, lighting_->fbo());
-  glReadBuffer(ambient_->ambient_buffer());
-  const GLenum dbuffers[] = { lighting_->buffer() };
-  glDrawBuffers(1, dbuffers);
-  glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-
-  mesh_iter.Reset();
-  for (auto it = point_lights_.begin(); it != point_lights_.end(); it++) {
-    omni_shadow_->BuildShadowMap(camera_, it->position, mesh_iter);
-    lighting_->Illuminate(camera_, *it, omni_shadow_->cube_texture());
+  // Publish any assets that have finished loading before drawing.
+  const double ASSET_UPLOAD_BUDGET = 0.004; // in seconds
+  assets_->Update(ASSET_UPLOAD_BUDGET);
+  meshes_.UpdateBounds();
+
+  const int width = camera_.viewport_width();
+  const int height = camera_.viewport_height();
+
+  // Declare the frame's passes, leaving the graph to run those that
+  // contribute to the active view.
+  typedef pipe::RenderGraph::Resource Resource;
+  graph_.Reset();
+  const Resource color = graph_.ImportTexture("gbuffer_color",
+                                              geom_->color_tex());
+  const Resource normal = graph_.ImportTexture("gbuffer_normal",
+                                               geom_->normal_tex());
+  const Resource depth = graph_.ImportTexture("gbuffer_depth",
+                                              geom_->depth_tex());
+  std::vector<Resource> gbuffer = { color, normal, depth };
+  Resource position = color; // compact G-buffers don't store positions
+  if (geom_->position_tex()) {
+    position = graph_.ImportTexture("gbuffer_position",
+                                    geom_->position_tex());
+    gbuffer.push_back(position);
+  }
+  const Resource hiz = graph_.ImportTexture("hiz", hiz_->tex(0));
+  const Resource atlas = graph_.ImportTexture("shadow_atlas",
+                                              omni_shadow_->atlas_texture());
+  const Resource light_buffer = graph_.ImportTexture("light",
+                                                     lighting_->tex());
+
+  graph_.AddPass("geometry", {}, gbuffer,
+                 [this](const pipe::RenderGraph&) {
+    // Narrow down the pass to the meshes within reach hierarchically,
+    // leaving the stage to cull the remainder individually.
+    meshes_.QueryFrustum(geo::Frustum(camera_.ComputeProjection()),
+                         visible_meshes_);
+    // Cull against the depth of the last frame, read back since.
+    occlusion_->Update();
+    geom_->Clear();
+    geom_->Render(camera_, visible_meshes_);
+  });
+
+  // Always built, as the next frame is culled against it.
+  graph_.AddPass("hiz", { depth }, { hiz },
+                 [this](const pipe::RenderGraph&) {
+    hiz_->Build(geom_->depth_tex());
+    occlusion_->Capture(camera_);
+  }, true);
+
+  // Occlusion is evaluated into transients at half resolution, which only
+  // live until the ambient pass has upsampled them.
+  const pipe::RenderTargetDesc ao_desc =
+      pipe::SSAOStage::occlusion_desc(width, height);
+  const Resource occlusion = graph_.CreateTexture("ssao", ao_desc);
+  const Resource blurred = graph_.CreateTexture("ssao_blurred", ao_desc);
+  graph_.AddPass("ssao", { depth, normal, hiz }, { occlusion },
+                 [this, occlusion](const pipe::RenderGraph& graph) {
+    ssao_->Occlude(camera_, geom_->depth_tex(), geom_->normal_tex(), *hiz_,
+                   graph.texture(occlusion));
+  });
+  graph_.AddPass("ssao_blur", { occlusion }, { blurred },
+                 [this, occlusion, blurred](const pipe::RenderGraph& graph) {
+    ssao_->Blur(camera_, graph.texture(occlusion), graph.texture(blurred));
+  });
+
+  // Initializes the light buffer with the occluded ambient light, leaving
+  // the occlusion for lighting to apply.
+  graph_.AddPass("ambient", { blurred, color, depth }, { light_buffer },
+                 [this, blurred](const pipe::RenderGraph& graph) {
+    ssao_->Resolve(camera_, graph.texture(blurred), geom_->color_tex(),
+                   geom_->depth_tex(), lighting_->tex());
+  });
+
+  // Bring all shadow maps up to date first, so that lighting isn't
+  // interleaved with shadow passes. Lights are culled against the occlusion
+  // the geometry pass updated, hence the dependency on depth.
+  graph_.AddPass("shadows", { depth }, { atlas },
+                 [this](const pipe::RenderGraph&) {
+    omni_shadow_->Allocate(camera_, point_lights_);
+    for (size_t i : omni_shadow_->update_order()) {
+      const pipe::PointLight& light = point_lights_[i];
+      // A light whose whole reach was hidden can't shadow anything visible,
+      // so an existing map may go stale until it's seen again.
+      const glm::vec3 reach(light.max_distance);
+      if (omni_shadow_->has_shadow_map(i) &&
+          occlusion_->IsOccluded({ light.position - reach,
+                                   light.position + reach })) {
+        continue;
+      }
+      meshes_.QuerySphere(glm::vec4(light.position, light.max_distance),
+                          light_meshes_);
+      // Timed per light, as their costs differ with their reach.
+      pipe::Profiler::Scope scope(&profiler_,
+                                  "shadow_map_" + std::to_string(i));
+      omni_shadow_->BuildShadowMap(camera_, i, light.position, light_meshes_);
+    }
+    shadow_tiles_.resize(point_lights_.size());
+    for (size_t i = 0; i < point_lights_.size(); i++) {
+      shadow_tiles_[i] = omni_shadow_->tile(i);
+    }
+  });
+
+  // Viewing the ambient term alone leaves out lighting, and with it the
+  // shadow pass feeding it.
+  if (active_stage_ != AMBIENT) {
+    std::vector<Resource> lighting_inputs = gbuffer;
+    lighting_inputs.push_back(atlas);
+    lighting_inputs.push_back(light_buffer);
+    graph_.AddPass("lighting", lighting_inputs, { light_buffer },
+                   [this](const pipe::RenderGraph&) {
+      lighting_->Illuminate(camera_, point_lights_,
+                            omni_shadow_->atlas_texture(), shadow_tiles_);
+    });
   }
 
-  ssao_->Clear();
-  ssao_->Render(camera_, lighting_->tex(), geom_->depth_tex());
-
-  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-
+  Resource view = light_buffer;
   switch (active_stage_) {
     case COMPOSITE:
-      // TODO: have an actual composite output. for now, just blit SSAO.
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, lighting_->fbo());
-      glReadBuffer(lighting_->buffer());
+      view = light_buffer;
       break;
     case ALBEDO:
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, geom_->fbo());
-      glReadBuffer(geom_->color_buffer());
+      view = color;
       break;
     case NORMAL:
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, geom_->fbo());
-      glReadBuffer(geom_->normal_buffer());
+      view = normal;
       break;
     case POSITION:
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, geom_->fbo());
-      glReadBuffer(geom_->position_buffer());
+      view = position;
       break;
     case AMBIENT:
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, ambient_->ambient_fbo());
-      glReadBuffer(ambient_->ambient_buffer());
+      view = light_buffer;
       break;
   }
-
-  glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  graph_.AddPass("present", { view }, {},
+                 [this, view, width, height](const pipe::RenderGraph& graph) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER,
+                      targets_.Framebuffer(graph.texture(view)));
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }, true);
+
+  if (graph_.Compile())
+    graph_.Execute();
+
+  profiler_.EndFrame();
+  targets_.EndFrame();
 }
 
 void Scene::OnResize(int width, int height) {
   camera_.SetViewport(width, height);
-  if (lighting_)
-    lighting_->Resize(width, height);
+
+  // Stages sized to the screen are recreated on the next frame. Their
+  // targets return to the pool, and are picked up again if the window
+  // returns to a previous size before they expire.
+  geom_.reset(); // before occlusion_, which it refers to
+  lighting_.reset();
+  ssao_.reset();
+  occlusion_.reset();
+  hiz_.reset();
 }
 
 void Scene::OnKeyEvent(int key, int scancode, int action, int mods) {
@@ -238,6 +343,24 @@ void Scene::OnKeyEvent(int key, int scancode, int action, int mods) {
     active_stage_ = (enum ActiveStage) (key - GLFW_KEY_1);
   }
 
+  if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+    // Dump frame timings, and a trace for chrome://tracing.
+    std::cout << "[scene] timings in ms (cpu, gpu) over min/avg/p99, "
+              << profiler_.dropped_frames() << " frames dropped" << std::endl;
+    for (const pipe::Profiler::ScopeStats& stats : profiler_.ComputeStats()) {
+      std::cout << "  " << stats.name << " (" << stats.samples << "): "
+                << stats.cpu.min << "/" << stats.cpu.avg << "/" << stats.cpu.p99
+                << ", "
+                << stats.gpu.min << "/" << stats.gpu.avg << "/" << stats.gpu.p99
+                << std::endl;
+    }
+    std::cout << "[scene] " << graph_.culled_passes() << " passes culled, "
+              << graph_.pooled_bytes() << " bytes held for "
+              << graph_.transient_bytes() << " bytes of transients"
+              << std::endl;
+    profiler_.WriteChromeTrace("quarke_trace.json");
+  }
+
   // Iterate through inputs until a controller captures the event.
   for (auto it = input_controllers_.rbegin(); it != input_controllers_.rend(); it++) {
     if ((*it)->OnKeyEvent(key, action, mods)) {
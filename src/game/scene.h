@@ -5,14 +5,19 @@
 #include <memory>
 #include <list>
 #include <vector>
+#include "game/asset_loader.h"
 #include "game/camera.h"
 #include "game/input_controller.h"
 #include "geo/mesh.h"
 #include "mat/solid_material.h"
 #include "mat/textured_material.h"
-#include "pipe/ambient_stage.h"
 #include "pipe/geometry_stage.h"
+#include "pipe/hiz_stage.h"
+#include "pipe/occlusion_culler.h"
 #include "pipe/phong_stage.h"
+#include "pipe/profiler.h"
+#include "pipe/render_graph.h"
+#include "pipe/render_target_pool.h"
 #include "pipe/omni_shadow_stage.h"
 #include "pipe/ssao_stage.h"
 #include "geo/linked_mesh_collection.h"
@@ -32,6 +37,9 @@ class Scene {
   void Update(float dt);
   void Render();
 
+  // Returns true while assets requested by the scene are still loading.
+  bool loading() const { return assets_->pending() > 0; }
+
   // Called when the engine has resized the scene.
   // The dimensions provided are in device pixel units.
   void OnResize(int width, int height);
@@ -52,14 +60,28 @@ class Scene {
   std::vector<std::unique_ptr<InputController>> input_controllers_;
   FPSInputController* fps_input_controller_;
 
+  // Streams in scene content while rendering; declared before its consumers
+  // so that it is destroyed after them.
+  std::unique_ptr<AssetLoader> assets_;
+
+  // Backs the render targets of the stages below, which return them on
+  // destruction.
+  pipe::RenderTargetPool targets_;
+
   // TODO: should we put the pipeline here?
   //       or move into separate pipeline class?
   std::unique_ptr<pipe::GeometryStage> geom_;
-  std::unique_ptr<pipe::AmbientStage> ambient_;
   std::unique_ptr<pipe::PhongStage> lighting_;
   std::unique_ptr<pipe::OmniShadowStage> omni_shadow_;
+  std::unique_ptr<pipe::HiZStage> hiz_;
+  std::unique_ptr<pipe::OcclusionCuller> occlusion_;
   std::unique_ptr<pipe::SSAOStage> ssao_;
 
+  // Rebuilt each frame from the stages above.
+  pipe::RenderGraph graph_;
+  // Times the passes of the graph, and the shadow map built for each light.
+  pipe::Profiler profiler_;
+
   // The primary stage to display.
   // Each option corresponds to an offset from GLFW_KEY_1.
   enum ActiveStage {
@@ -72,6 +94,10 @@ class Scene {
   } active_stage_;
 
   geo::LinkedMeshCollection meshes_;
+  // Per-frame query results, kept to reuse their storage.
+  geo::LinkedMeshCollection::MeshQuery visible_meshes_;
+  geo::LinkedMeshCollection::MeshQuery light_meshes_;
+  std::vector<glm::vec4> shadow_tiles_; // by light index
 
   // TODO: move these to a global material cache.
   std::unique_ptr<mat::SolidMaterial> solid_material_;
@@ -0,0 +1,67 @@
+#ifndef QUARKE_SRC_GEO_BOUNDS_H_
+#define QUARKE_SRC_GEO_BOUNDS_H_
+
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+
+namespace quarke {
+namespace geo {
+
+// An axis-aligned bounding box.
+struct AABB {
+  glm::vec3 min;
+  glm::vec3 max;
+
+  glm::vec3 center() const { return (min + max) * 0.5f; }
+  glm::vec3 extents() const { return (max - min) * 0.5f; }
+
+  float SurfaceArea() const {
+    glm::vec3 d = max - min;
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  bool operator==(const AABB& other) const {
+    return min == other.min && max == other.max;
+  }
+};
+
+// Returns the smallest box enclosing both `a` and `b`.
+inline AABB Union(const AABB& a, const AABB& b) {
+  return { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+}
+
+// Returns the axis-aligned box enclosing `box` after an affine transform
+// (Arvo, "Transforming Axis-Aligned Bounding Boxes", 1990).
+inline AABB TransformAABB(const glm::mat4& transform, const AABB& box) {
+  glm::vec3 center(transform * glm::vec4(box.center(), 1.f));
+  glm::vec3 e = box.extents();
+  glm::vec3 extents;
+  for (int i = 0; i < 3; i++) {
+    extents[i] = std::abs(transform[0][i]) * e.x +
+                 std::abs(transform[1][i]) * e.y +
+                 std::abs(transform[2][i]) * e.z;
+  }
+  return { center - extents, center + extents };
+}
+
+// Returns the sphere circumscribing `box`, packed as (center, radius).
+inline glm::vec4 BoundingSphere(const AABB& box) {
+  return glm::vec4(box.center(), glm::length(box.extents()));
+}
+
+// Transforms a (center, radius) sphere by an affine transform, scaling the
+// radius conservatively by the largest axis scale.
+inline glm::vec4 TransformSphere(const glm::mat4& transform,
+                                 const glm::vec4& sphere) {
+  glm::vec3 center(transform * glm::vec4(glm::vec3(sphere), 1.f));
+  float scale = std::max(glm::length(glm::vec3(transform[0])),
+                std::max(glm::length(glm::vec3(transform[1])),
+                         glm::length(glm::vec3(transform[2]))));
+  return glm::vec4(center, sphere.w * scale);
+}
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_BOUNDS_H_
@@ -0,0 +1,362 @@
+#include "geo/bvh.h"
+#include <algorithm>
+#include <limits>
+
+namespace quarke {
+namespace geo {
+
+static_assert(sizeof(BVH::Node) == 32, "BVH nodes should fill half a line");
+
+const uint32_t BVH::INVALID_NODE;
+
+namespace {
+
+// Number of centroid bins evaluated per axis when choosing a split.
+const int NUM_BINS = 12;
+
+// Leaves are always created at or below this many items.
+const uint32_t MIN_LEAF_SIZE = 2;
+
+// Leaves are never created above this many items, unless their centroids
+// are inseparable.
+const uint32_t MAX_LEAF_SIZE = 8;
+
+// Upper bound on tree depth. Nodes at this depth become leaves regardless
+// of size, bounding the traversal stack.
+const uint32_t MAX_DEPTH = 64;
+
+struct Bin {
+  AABB bounds;
+  uint32_t count;
+};
+
+const AABB EMPTY_BOUNDS = {
+  glm::vec3(std::numeric_limits<float>::max()),
+  glm::vec3(-std::numeric_limits<float>::max()),
+};
+
+float SquaredDistance(const AABB& box, const glm::vec3& point) {
+  glm::vec3 d = glm::max(glm::max(box.min - point, point - box.max),
+                         glm::vec3(0.f));
+  return glm::dot(d, d);
+}
+
+bool IntersectsSphere(const AABB& box, const glm::vec4& sphere) {
+  return SquaredDistance(box, glm::vec3(sphere)) <= sphere.w * sphere.w;
+}
+
+// Slab test; returns the entry distance along the ray, or a negative value
+// on a miss.
+float IntersectRay(const glm::vec3& min, const glm::vec3& max,
+                   const glm::vec3& origin, const glm::vec3& inv_direction,
+                   float max_distance) {
+  glm::vec3 t0 = (min - origin) * inv_direction;
+  glm::vec3 t1 = (max - origin) * inv_direction;
+  glm::vec3 near = glm::min(t0, t1);
+  glm::vec3 far = glm::max(t0, t1);
+  float enter = std::max(std::max(near.x, near.y), std::max(near.z, 0.f));
+  float exit = std::min(std::min(far.x, far.y), std::min(far.z, max_distance));
+  return enter <= exit ? enter : -1.f;
+}
+
+}  // namespace
+
+void BVH::Build(const std::vector<AABB>& bounds) {
+  bounds_ = bounds;
+  nodes_.clear();
+  parents_.clear();
+  const uint32_t num_items = bounds_.size();
+  items_.resize(num_items);
+  leaves_.resize(num_items);
+  if (num_items == 0)
+    return;
+
+  std::vector<glm::vec3> centroids(num_items);
+  for (uint32_t i = 0; i < num_items; i++) {
+    items_[i] = i;
+    centroids[i] = bounds_[i].center();
+  }
+
+  nodes_.reserve(2 * num_items);
+  parents_.reserve(2 * num_items);
+  nodes_.push_back(Node());
+  parents_.push_back(INVALID_NODE);
+  Subdivide(0, 0, num_items, 0, centroids);
+}
+
+void BVH::Subdivide(uint32_t node, uint32_t begin, uint32_t end,
+                    uint32_t depth,
+                    const std::vector<glm::vec3>& centroids) {
+  AABB bounds = EMPTY_BOUNDS;
+  AABB centroid_bounds = EMPTY_BOUNDS;
+  for (uint32_t i = begin; i < end; i++) {
+    bounds = Union(bounds, bounds_[items_[i]]);
+    const glm::vec3& c = centroids[items_[i]];
+    centroid_bounds = Union(centroid_bounds, { c, c });
+  }
+  SetBounds(node, bounds);
+
+  const uint32_t count = end - begin;
+  auto make_leaf = [&]() {
+    nodes_[node].first = begin;
+    nodes_[node].count = count;
+    for (uint32_t i = begin; i < end; i++) {
+      leaves_[items_[i]] = node;
+    }
+  };
+  if (count <= MIN_LEAF_SIZE || depth + 1 >= MAX_DEPTH) {
+    make_leaf();
+    return;
+  }
+
+  // Evaluate the SAH cost of splitting at each bin boundary on each axis.
+  float best_cost = std::numeric_limits<float>::max();
+  int best_axis = -1;
+  int best_split = 0;
+  const glm::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+  for (int axis = 0; axis < 3; axis++) {
+    if (extent[axis] <= 0.f)
+      continue;
+    const float scale = NUM_BINS / extent[axis];
+
+    Bin bins[NUM_BINS];
+    for (Bin& bin : bins) {
+      bin.bounds = EMPTY_BOUNDS;
+      bin.count = 0;
+    }
+    for (uint32_t i = begin; i < end; i++) {
+      const uint32_t id = items_[i];
+      int b = (int) ((centroids[id][axis] - centroid_bounds.min[axis]) * scale);
+      b = std::min(b, NUM_BINS - 1);
+      bins[b].bounds = Union(bins[b].bounds, bounds_[id]);
+      bins[b].count++;
+    }
+
+    // Sweep from the right to accumulate the cost of each right-hand side.
+    float right_cost[NUM_BINS];
+    AABB right = EMPTY_BOUNDS;
+    uint32_t right_count = 0;
+    for (int b = NUM_BINS - 1; b > 0; b--) {
+      right = Union(right, bins[b].bounds);
+      right_count += bins[b].count;
+      right_cost[b] = right_count ? right_count * right.SurfaceArea() : 0.f;
+    }
+    AABB left = EMPTY_BOUNDS;
+    uint32_t left_count = 0;
+    for (int b = 1; b < NUM_BINS; b++) {
+      left = Union(left, bins[b - 1].bounds);
+      left_count += bins[b - 1].count;
+      if (left_count == 0 || left_count == count)
+        continue;
+      float cost = left_count * left.SurfaceArea() + right_cost[b];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_split = b;
+      }
+    }
+  }
+
+  uint32_t mid;
+  if (best_axis >= 0) {
+    // Stop if splitting doesn't beat testing every item in a leaf.
+    if (count <= MAX_LEAF_SIZE && best_cost >= count * bounds.SurfaceArea()) {
+      make_leaf();
+      return;
+    }
+    const float min = centroid_bounds.min[best_axis];
+    const float scale = NUM_BINS / extent[best_axis];
+    uint32_t* middle = std::partition(
+        items_.data() + begin, items_.data() + end, [&](uint32_t id) {
+          int b = (int) ((centroids[id][best_axis] - min) * scale);
+          return std::min(b, NUM_BINS - 1) < best_split;
+        });
+    mid = middle - items_.data();
+  } else if (count <= MAX_LEAF_SIZE) {
+    make_leaf();
+    return;
+  } else {
+    // All centroids coincide; split evenly to bound leaf size.
+    mid = begin + count / 2;
+  }
+
+  const uint32_t left = nodes_.size();
+  nodes_.push_back(Node());
+  nodes_.push_back(Node());
+  parents_.push_back(node);
+  parents_.push_back(node);
+  nodes_[node].first = left;
+  nodes_[node].count = 0;
+  Subdivide(left, begin, mid, depth + 1, centroids);
+  Subdivide(left + 1, mid, end, depth + 1, centroids);
+}
+
+void BVH::SetBounds(uint32_t node, const AABB& bounds) {
+  nodes_[node].min = bounds.min;
+  nodes_[node].max = bounds.max;
+}
+
+AABB BVH::NodeBounds(uint32_t node) const {
+  return { nodes_[node].min, nodes_[node].max };
+}
+
+void BVH::Refit(uint32_t id, const AABB& bounds) {
+  bounds_[id] = bounds;
+
+  uint32_t node = leaves_[id];
+  const Node& leaf = nodes_[node];
+  AABB leaf_bounds = EMPTY_BOUNDS;
+  for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+    leaf_bounds = Union(leaf_bounds, bounds_[items_[i]]);
+  }
+  if (leaf_bounds == NodeBounds(node))
+    return;
+  SetBounds(node, leaf_bounds);
+
+  // Walk towards the root until a node's bounds are unaffected.
+  while ((node = parents_[node]) != INVALID_NODE) {
+    const uint32_t left = nodes_[node].first;
+    AABB node_bounds = Union(NodeBounds(left), NodeBounds(left + 1));
+    if (node_bounds == NodeBounds(node))
+      return;
+    SetBounds(node, node_bounds);
+  }
+}
+
+void BVH::CollectSubtree(uint32_t node, std::vector<uint32_t>& out_ids) const {
+  uint32_t stack[MAX_DEPTH + 1];
+  int depth = 0;
+  stack[depth++] = node;
+  while (depth > 0) {
+    const Node& n = nodes_[stack[--depth]];
+    if (n.count) {
+      out_ids.insert(out_ids.end(), items_.begin() + n.first,
+                     items_.begin() + n.first + n.count);
+    } else {
+      stack[depth++] = n.first;
+      stack[depth++] = n.first + 1;
+    }
+  }
+}
+
+void BVH::QueryFrustum(const Frustum& frustum,
+                       std::vector<uint32_t>& out_ids) const {
+  if (nodes_.empty())
+    return;
+
+  uint32_t stack[MAX_DEPTH + 1];
+  int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    const uint32_t node = stack[--depth];
+    switch (frustum.Classify(NodeBounds(node))) {
+      case Frustum::OUTSIDE:
+        continue;
+      case Frustum::INSIDE:
+        CollectSubtree(node, out_ids);
+        continue;
+      case Frustum::INTERSECTING:
+        break;
+    }
+
+    const Node& n = nodes_[node];
+    if (n.count) {
+      for (uint32_t i = n.first; i < n.first + n.count; i++) {
+        if (frustum.Classify(bounds_[items_[i]]) != Frustum::OUTSIDE)
+          out_ids.push_back(items_[i]);
+      }
+    } else {
+      stack[depth++] = n.first;
+      stack[depth++] = n.first + 1;
+    }
+  }
+}
+
+void BVH::QuerySphere(const glm::vec4& sphere,
+                      std::vector<uint32_t>& out_ids) const {
+  if (nodes_.empty())
+    return;
+
+  uint32_t stack[MAX_DEPTH + 1];
+  int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    const Node& n = nodes_[stack[--depth]];
+    if (!IntersectsSphere({ n.min, n.max }, sphere))
+      continue;
+    if (n.count) {
+      for (uint32_t i = n.first; i < n.first + n.count; i++) {
+        if (IntersectsSphere(bounds_[items_[i]], sphere))
+          out_ids.push_back(items_[i]);
+      }
+    } else {
+      stack[depth++] = n.first;
+      stack[depth++] = n.first + 1;
+    }
+  }
+}
+
+bool BVH::Raycast(const glm::vec3& origin, const glm::vec3& direction,
+                  float max_distance, uint32_t* out_id,
+                  float* out_distance) const {
+  if (nodes_.empty())
+    return false;
+
+  const glm::vec3 inv_direction = 1.f / direction;
+  float nearest = max_distance;
+  uint32_t nearest_id = 0;
+  bool hit = false;
+
+  uint32_t stack[MAX_DEPTH + 1];
+  int depth = 0;
+  stack[depth++] = 0;
+  while (depth > 0) {
+    const Node& n = nodes_[stack[--depth]];
+    if (IntersectRay(n.min, n.max, origin, inv_direction, nearest) < 0.f)
+      continue;
+    if (n.count) {
+      for (uint32_t i = n.first; i < n.first + n.count; i++) {
+        const AABB& box = bounds_[items_[i]];
+        float t = IntersectRay(box.min, box.max, origin, inv_direction,
+                               nearest);
+        if (t >= 0.f && (!hit || t < nearest)) {
+          nearest = t;
+          nearest_id = items_[i];
+          hit = true;
+        }
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, so that the farther is more likely to
+    // be rejected by the current nearest hit.
+    const Node& left = nodes_[n.first];
+    const Node& right = nodes_[n.first + 1];
+    float t_left = IntersectRay(left.min, left.max, origin, inv_direction,
+                                nearest);
+    float t_right = IntersectRay(right.min, right.max, origin, inv_direction,
+                                 nearest);
+    const bool left_first = t_left >= 0.f &&
+                            (t_right < 0.f || t_left <= t_right);
+    if (left_first) {
+      if (t_right >= 0.f)
+        stack[depth++] = n.first + 1;
+      stack[depth++] = n.first;
+    } else {
+      if (t_left >= 0.f)
+        stack[depth++] = n.first;
+      if (t_right >= 0.f)
+        stack[depth++] = n.first + 1;
+    }
+  }
+
+  if (hit) {
+    *out_id = nearest_id;
+    if (out_distance)
+      *out_distance = nearest;
+  }
+  return hit;
+}
+
+}  // namespace geo
+}  // namespace quarke
@@ -0,0 +1,77 @@
+#ifndef QUARKE_SRC_GEO_BVH_H_
+#define QUARKE_SRC_GEO_BVH_H_
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "geo/bounds.h"
+#include "geo/frustum.h"
+
+namespace quarke {
+namespace geo {
+
+// A bounding volume hierarchy over a set of axis-aligned boxes, identified
+// by their index at build time.
+//
+// The tree is built top-down using the binned surface area heuristic, and
+// stored depth-first in a flat array of 32-byte nodes with siblings
+// adjacent. Moving items are handled by refitting the path to the root,
+// which keeps the tree valid but lets its quality degrade; rebuild when the
+// set of items changes or after large movements.
+class BVH {
+ public:
+  struct Node {
+    glm::vec3 min;
+    uint32_t first; // first item offset if a leaf, else the left child index
+    glm::vec3 max;
+    uint32_t count; // number of items if a leaf, else 0
+  };
+
+  BVH() {}
+
+  // Builds the hierarchy over `bounds`, replacing any existing tree.
+  void Build(const std::vector<AABB>& bounds);
+
+  // Replaces the bounds of item `id`, refitting its ancestors.
+  void Refit(uint32_t id, const AABB& bounds);
+
+  // Appends the ids of all items whose bounds intersect `frustum`.
+  void QueryFrustum(const Frustum& frustum,
+                    std::vector<uint32_t>& out_ids) const;
+
+  // Appends the ids of all items whose bounds intersect the sphere (xyz
+  // center, w radius).
+  void QuerySphere(const glm::vec4& sphere,
+                   std::vector<uint32_t>& out_ids) const;
+
+  // Finds the item whose bounds are first hit by the ray from `origin` along
+  // `direction`, within `max_distance` (in units of `direction`).
+  // Returns false if no bounds are hit.
+  bool Raycast(const glm::vec3& origin, const glm::vec3& direction,
+               float max_distance, uint32_t* out_id,
+               float* out_distance) const;
+
+  size_t size() const { return bounds_.size(); }
+  const std::vector<Node>& nodes() const { return nodes_; }
+ private:
+  static const uint32_t INVALID_NODE = 0xFFFFFFFF;
+
+  void Subdivide(uint32_t node, uint32_t begin, uint32_t end, uint32_t depth,
+                 const std::vector<glm::vec3>& centroids);
+  void SetBounds(uint32_t node, const AABB& bounds);
+  AABB NodeBounds(uint32_t node) const;
+
+  // Appends every item beneath `node` without testing.
+  void CollectSubtree(uint32_t node, std::vector<uint32_t>& out_ids) const;
+
+  std::vector<Node> nodes_;
+  std::vector<uint32_t> parents_; // parent node index, by node
+  std::vector<uint32_t> items_; // item ids, in leaf order
+  std::vector<uint32_t> leaves_; // leaf node index, by item id
+  std::vector<AABB> bounds_; // item bounds, by item id
+};
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_BVH_H_
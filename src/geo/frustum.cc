@@ -0,0 +1,98 @@
+#include "geo/frustum.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define QUARKE_FRUSTUM_SSE
+#endif
+
+namespace quarke {
+namespace geo {
+
+Frustum::Frustum(const glm::mat4& m) {
+  // Gribb & Hartmann: each plane is the sum or difference of the fourth row
+  // of the matrix with one of the first three.
+  glm::vec4 rows[4];
+  for (int i = 0; i < 4; i++) {
+    rows[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+  }
+  for (int i = 0; i < 3; i++) {
+    planes_[i * 2] = rows[3] + rows[i];
+    planes_[i * 2 + 1] = rows[3] - rows[i];
+  }
+  for (glm::vec4& plane : planes_) {
+    plane *= 1.f / glm::length(glm::vec3(plane));
+  }
+}
+
+bool Frustum::Intersects(const glm::vec4& sphere) const {
+  for (const glm::vec4& plane : planes_) {
+    if (glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w < -sphere.w)
+      return false;
+  }
+  return true;
+}
+
+Frustum::Containment Frustum::Classify(const AABB& box) const {
+  const glm::vec3 center = box.center();
+  const glm::vec3 extents = box.extents();
+  Containment result = INSIDE;
+  for (const glm::vec4& plane : planes_) {
+    const glm::vec3 normal(plane);
+    // Distance of the box center, and the box's projected radius.
+    const float d = glm::dot(normal, center) + plane.w;
+    const float r = glm::dot(glm::abs(normal), extents);
+    if (d + r < 0.f)
+      return OUTSIDE;
+    if (d - r < 0.f)
+      result = INTERSECTING;
+  }
+  return result;
+}
+
+size_t Frustum::CullSpheres(const glm::vec4* spheres, size_t count,
+                            uint8_t* out_visible) const {
+  size_t visible = 0;
+  size_t i = 0;
+#ifdef QUARKE_FRUSTUM_SSE
+  __m128 px[6], py[6], pz[6], pw[6];
+  for (int p = 0; p < 6; p++) {
+    px[p] = _mm_set1_ps(planes_[p].x);
+    py[p] = _mm_set1_ps(planes_[p].y);
+    pz[p] = _mm_set1_ps(planes_[p].z);
+    pw[p] = _mm_set1_ps(planes_[p].w);
+  }
+
+  for (; i + 4 <= count; i += 4) {
+    // Transpose four (x, y, z, r) spheres into x, y, z and r lanes.
+    __m128 x = _mm_loadu_ps(&spheres[i].x);
+    __m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+    __m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+    __m128 r = _mm_loadu_ps(&spheres[i + 3].x);
+    _MM_TRANSPOSE4_PS(x, y, z, r);
+    const __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), r);
+
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+      __m128 d = _mm_add_ps(_mm_mul_ps(px[p], x), pw[p]);
+      d = _mm_add_ps(d, _mm_mul_ps(py[p], y));
+      d = _mm_add_ps(d, _mm_mul_ps(pz[p], z));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(d, neg_r));
+    }
+
+    const int mask = _mm_movemask_ps(inside);
+    for (int k = 0; k < 4; k++) {
+      out_visible[i + k] = (mask >> k) & 1;
+      visible += out_visible[i + k];
+    }
+  }
+#endif  // QUARKE_FRUSTUM_SSE
+
+  for (; i < count; i++) {
+    out_visible[i] = Intersects(spheres[i]) ? 1 : 0;
+    visible += out_visible[i];
+  }
+  return visible;
+}
+
+}  // namespace geo
+}  // namespace quarke
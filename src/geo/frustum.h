@@ -0,0 +1,56 @@
+#ifndef QUARKE_SRC_GEO_FRUSTUM_H_
+#define QUARKE_SRC_GEO_FRUSTUM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "geo/bounds.h"
+
+namespace quarke {
+namespace geo {
+
+// Visibility counts of a culled pass.
+struct CullStats {
+  size_t drawn;
+  size_t culled;
+  // Left to an occlusion query on the GPU, and only drawn if it passes.
+  size_t tested;
+};
+
+// A convex volume bounded by the six clipping planes of a projection.
+class Frustum {
+ public:
+  enum Containment {
+    OUTSIDE,
+    INTERSECTING,
+    INSIDE,
+  };
+
+  // Extracts the frustum planes from a world-to-clip matrix, such as
+  // game::Camera::ComputeProjection().
+  explicit Frustum(const glm::mat4& view_projection);
+
+  // Returns true if the sphere (xyz center, w radius) intersects the frustum.
+  bool Intersects(const glm::vec4& sphere) const;
+
+  // Classifies `box` as outside, intersecting or entirely inside the frustum.
+  // Conservative; boxes near the frustum's corners may be reported as
+  // intersecting.
+  Containment Classify(const AABB& box) const;
+
+  // Tests `count` spheres against the frustum four at a time, writing 1 to
+  // `out_visible[i]` for each sphere intersecting it and 0 otherwise.
+  // Returns the number of visible spheres.
+  size_t CullSpheres(const glm::vec4* spheres, size_t count,
+                     uint8_t* out_visible) const;
+
+  // Normalized planes (xyz normal, w distance), facing inwards.
+  const glm::vec4& plane(int i) const { return planes_[i]; }
+ private:
+  glm::vec4 planes_[6];
+};
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_FRUSTUM_H_
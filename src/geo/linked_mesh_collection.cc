@@ -1,10 +1,12 @@
 #include "geo/linked_mesh_collection.h"
+#include <algorithm>
 
 namespace quarke {
 namespace geo {
 
 void LinkedMeshCollection::AddMesh(mat::Material* mat,
                                    std::unique_ptr<Mesh> mesh) {
+  bvh_dirty_ = true;
   auto mat_node = GetOrCreateMaterial(mat);
   auto mesh_node = std::make_unique<LinkedMeshCollection::MeshNode>();
   mesh_node->mesh = std::move(mesh);
@@ -12,7 +14,9 @@ void LinkedMeshCollection::AddMesh(mat::Material* mat,
 
   if (mat_node->end) {
     assert(mat_node->start);
-    mesh_node->next = nullptr;
+    // Splice in after the material's last mesh, keeping any meshes of other
+    // materials that follow it.
+    mesh_node->next = std::move(mat_node->end->next);
     mat_node->end->next = std::move(mesh_node);
     mat_node->end = mat_node->end->next.get();
   } else {
@@ -30,6 +34,83 @@ LinkedMeshCollection::Iterator() {
   return MaterialIterator(materials_.get());
 }
 
+void LinkedMeshCollection::UpdateBounds() {
+  if (bvh_dirty_) {
+    nodes_by_id_.clear();
+    versions_.clear();
+    std::vector<AABB> bounds;
+    for (const MeshNode* node = meshes_.get(); node; node = node->next.get()) {
+      nodes_by_id_.push_back(node);
+      versions_.push_back(node->mesh->transform_version());
+      bounds.push_back(node->mesh->world_bounds());
+    }
+    bvh_.Build(bounds);
+    bvh_dirty_ = false;
+    return;
+  }
+
+  for (uint32_t id = 0; id < nodes_by_id_.size(); id++) {
+    const Mesh& mesh = *nodes_by_id_[id]->mesh;
+    if (mesh.transform_version() != versions_[id]) {
+      versions_[id] = mesh.transform_version();
+      bvh_.Refit(id, mesh.world_bounds());
+    }
+  }
+}
+
+void LinkedMeshCollection::QueryFrustum(const Frustum& frustum,
+                                        MeshQuery& query) const {
+  assert(!bvh_dirty_);
+  query.ids_.clear();
+  bvh_.QueryFrustum(frustum, query.ids_);
+  FillQuery(query);
+}
+
+void LinkedMeshCollection::QuerySphere(const glm::vec4& sphere,
+                                       MeshQuery& query) const {
+  assert(!bvh_dirty_);
+  query.ids_.clear();
+  bvh_.QuerySphere(sphere, query.ids_);
+  FillQuery(query);
+}
+
+const Mesh* LinkedMeshCollection::Raycast(const glm::vec3& origin,
+                                          const glm::vec3& direction,
+                                          float max_distance,
+                                          float* out_distance) const {
+  assert(!bvh_dirty_);
+  uint32_t id;
+  if (!bvh_.Raycast(origin, direction, max_distance, &id, out_distance))
+    return nullptr;
+  return nodes_by_id_[id]->mesh.get();
+}
+
+void LinkedMeshCollection::FillQuery(MeshQuery& query) const {
+  query.Clear();
+  std::sort(query.ids_.begin(), query.ids_.end());
+  for (uint32_t id : query.ids_) {
+    query.Add(*nodes_by_id_[id]);
+  }
+}
+
+void LinkedMeshCollection::MeshQuery::Clear() {
+  for (size_t i = 0; i < num_groups_; i++) {
+    groups_[i].meshes.clear();
+  }
+  num_groups_ = 0;
+  next_ = 0;
+}
+
+void LinkedMeshCollection::MeshQuery::Add(const MeshNode& node) {
+  mat::Material* material = node.material->material;
+  if (num_groups_ == 0 || groups_[num_groups_ - 1].material != material) {
+    if (num_groups_ == groups_.size())
+      groups_.emplace_back();
+    groups_[num_groups_++].material = material;
+  }
+  groups_[num_groups_ - 1].meshes.push_back(node.mesh.get());
+}
+
 LinkedMeshCollection::MaterialNode*
 LinkedMeshCollection::GetOrCreateMaterial(mat::Material* mat) {
   MaterialNode* node = materials_.get();
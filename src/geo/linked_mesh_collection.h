@@ -2,7 +2,10 @@
 #define QUARKE_SRC_GEO_LINKED_MESH_COLLECTION_H_
 
 #include <cassert>
+#include <vector>
 #include "pipe/geometry_stage.h"
+#include "geo/bvh.h"
+#include "geo/frustum.h"
 #include "geo/mesh.h"
 
 namespace quarke {
@@ -72,12 +75,88 @@ class LinkedMeshCollection {
     MaterialMeshIterator cur_iter_;
   };
 
-  LinkedMeshCollection() : meshes_(nullptr), materials_(nullptr) {}
+  // The meshes matched by a spatial query, grouped by material in collection
+  // order. Owned by the caller and reused across queries to avoid
+  // reallocation.
+  class MeshQuery : public pipe::MaterialIterator {
+   public:
+    MeshQuery() : num_groups_(0), next_(0), cur_iter_(nullptr) {}
+
+    pipe::MaterialMeshIterator* NextMaterial() override {
+      if (next_ >= num_groups_)
+        return nullptr;
+      cur_iter_ = GroupIterator(&groups_[next_++]);
+      return &cur_iter_;
+    }
+
+    void Reset() override {
+      next_ = 0;
+    }
+   private:
+    friend class LinkedMeshCollection;
+
+    struct Group {
+      mat::Material* material;
+      std::vector<const Mesh*> meshes;
+    };
+
+    class GroupIterator : public pipe::MaterialMeshIterator {
+     public:
+      GroupIterator(Group* group) : group_(group), next_(0) {}
+
+      const Mesh* Next() override {
+        if (next_ >= group_->meshes.size())
+          return nullptr;
+        return group_->meshes[next_++];
+      }
+
+      mat::Material* Material() override {
+        return group_->material;
+      }
+     private:
+      Group* group_;
+      size_t next_;
+    };
+
+    // Clears the results, keeping group storage for reuse.
+    void Clear();
+    void Add(const MeshNode& node);
+
+    std::vector<Group> groups_;
+    size_t num_groups_; // number of groups in use, <= groups_.size()
+    size_t next_;
+    GroupIterator cur_iter_;
+    std::vector<uint32_t> ids_; // scratch space for the BVH query
+  };
+
+  LinkedMeshCollection()
+    : meshes_(nullptr), materials_(nullptr), bvh_dirty_(false) {}
 
   void AddMesh(mat::Material* mat, std::unique_ptr<Mesh> mesh);
 
   MaterialIterator Iterator();
+
+  // Brings the bounding volume hierarchy up to date with the collection,
+  // rebuilding it if meshes were added, or refitting meshes whose transforms
+  // have changed. Must be called before querying after any modification.
+  void UpdateBounds();
+
+  // Replaces the contents of `query` with the meshes whose world bounds
+  // intersect `frustum`.
+  void QueryFrustum(const Frustum& frustum, MeshQuery& query) const;
+
+  // Replaces the contents of `query` with the meshes whose world bounds
+  // intersect the given sphere (xyz center, w radius).
+  void QuerySphere(const glm::vec4& sphere, MeshQuery& query) const;
+
+  // Returns the mesh whose world bounds are first hit by the given ray within
+  // `max_distance`, or nullptr if there is none. The distance to the hit is
+  // written to `out_distance` if non-null.
+  const Mesh* Raycast(const glm::vec3& origin, const glm::vec3& direction,
+                      float max_distance, float* out_distance = nullptr) const;
  private:
+  // Fills `query` with the meshes identified by the BVH ids within it.
+  void FillQuery(MeshQuery& query) const;
 
   // Gets the material node for the given material, or inserts a new material
   // node to the beginning of the material node list.
@@ -85,6 +164,13 @@ class LinkedMeshCollection {
 
   std::unique_ptr<MeshNode> meshes_;
   std::unique_ptr<MaterialNode> materials_;
+
+  // Mesh ids in the BVH are their position in the mesh list at build time,
+  // so that ordering by id groups meshes by material.
+  BVH bvh_;
+  std::vector<const MeshNode*> nodes_by_id_;
+  std::vector<uint32_t> versions_; // last seen transform version, by id
+  bool bvh_dirty_; // true if meshes were added since the last build
 };
 
 }  // namespace geo
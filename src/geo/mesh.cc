@@ -1,95 +1,217 @@
 #include "geo/mesh.h"
+#include "geo/mesh_cache.h"
+#include "geo/mesh_optimizer.h"
+#include "geo/obj_parser.h"
+#include "geo/vertex_packing.h"
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
-
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tiny_obj_loader.h"
+#include <limits>
+#include <unordered_map>
 
 namespace quarke {
 namespace geo {
 
+namespace {
+
+// A unique combination of obj attribute indices, forming a single vertex.
+struct IndexKey {
+  int vertex_index;
+  int normal_index;
+  int texcoord_index;
+
+  bool operator==(const IndexKey& other) const {
+    return vertex_index == other.vertex_index &&
+           normal_index == other.normal_index &&
+           texcoord_index == other.texcoord_index;
+  }
+};
+
+struct IndexKeyHash {
+  size_t operator()(const IndexKey& key) const {
+    // FNV-1a style mixing over the three indices.
+    size_t hash = 2166136261u;
+    hash = (hash ^ (uint32_t) key.vertex_index) * 16777619u;
+    hash = (hash ^ (uint32_t) key.normal_index) * 16777619u;
+    hash = (hash ^ (uint32_t) key.texcoord_index) * 16777619u;
+    return hash;
+  }
+};
+
+}  // namespace
+
+GLsizei VertexSize(VertexFormat format) {
+  if (IsPackedFormat(format)) {
+    return sizeof(GLushort) * 4 +
+           (HasNormals(format) ? sizeof(GLuint) : 0) +
+           (HasTexCoords(format) ? sizeof(GLushort) * 2 : 0);
+  }
+  return sizeof(GLfloat) * 3 +
+         (HasNormals(format) ? sizeof(GLfloat) * 3 : 0) +
+         (HasTexCoords(format) ? sizeof(GLfloat) * 2 : 0);
+}
+
+bool IsPackedFormat(VertexFormat format) {
+  return format >= P3N3T2_PACKED;
+}
+
+bool HasNormals(VertexFormat format) {
+  return format == P3N3T2 || format == P3N3 ||
+         format == P3N3T2_PACKED || format == P3N3_PACKED;
+}
+
+bool HasTexCoords(VertexFormat format) {
+  return format == P3N3T2 || format == P3T2 ||
+         format == P3N3T2_PACKED || format == P3T2_PACKED;
+}
+
+GLenum IndexTypeFor(size_t num_vertices) {
+  return num_vertices <= 0x10000 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
+
+std::vector<GLushort> NarrowIndices(const std::vector<GLuint>& indices) {
+  return std::vector<GLushort>(indices.begin(), indices.end());
+}
+
 /* static */
-std::shared_ptr<VertexBuffer> VertexBuffer::Create(VertexFormat format) {
-  GLuint buffer, vao;
+std::shared_ptr<VertexBuffer> VertexBuffer::Create(VertexFormat format,
+                                                   GLenum index_type) {
+  assert(index_type == GL_UNSIGNED_SHORT || index_type == GL_UNSIGNED_INT);
+
+  GLuint buffer, index_buffer, vao;
   glGenBuffers(1, &buffer);
+  glGenBuffers(1, &index_buffer);
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
-  switch (format) {
-    case VertexFormat::P3N3T2:
-      glEnableVertexAttribArray(VS_ATTRIB_POSITION);
-      glEnableVertexAttribArray(VS_ATTRIB_NORMAL);
-      glEnableVertexAttribArray(VS_ATTRIB_TEXCOORD);
+  const bool packed = IsPackedFormat(format);
+  const GLsizei stride = VertexSize(format);
+  size_t offset = 0;
+
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+  glEnableVertexAttribArray(VS_ATTRIB_POSITION);
+  if (packed) {
+    // The fourth component is padding to keep attributes 4-byte aligned.
+    glVertexAttribPointer(VS_ATTRIB_POSITION, 3,
+        GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offset);
+    offset += sizeof(GLushort) * 4;
+  } else {
+    glVertexAttribPointer(VS_ATTRIB_POSITION, 3,
+        GL_FLOAT, GL_FALSE, stride, (void*)offset);
+    offset += sizeof(GLfloat) * 3;
+  }
 
-      glBindBuffer(GL_ARRAY_BUFFER, buffer);
-      glVertexAttribPointer(VS_ATTRIB_POSITION, 3,
-          GL_FLOAT, GL_FALSE, sizeof(GLfloat) * (3 + 3 + 2),
-          (void*)0);
+  if (HasNormals(format)) {
+    glEnableVertexAttribArray(VS_ATTRIB_NORMAL);
+    if (packed) {
+      glVertexAttribPointer(VS_ATTRIB_NORMAL, 4,
+          GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offset);
+      offset += sizeof(GLuint);
+    } else {
       glVertexAttribPointer(VS_ATTRIB_NORMAL, 3,
-          GL_FLOAT, GL_FALSE, sizeof(GLfloat) * (3 + 3 + 2),
-          (void*)(sizeof(GLfloat) * 3));
+          GL_FLOAT, GL_FALSE, stride, (void*)offset);
+      offset += sizeof(GLfloat) * 3;
+    }
+  }
+
+  if (HasTexCoords(format)) {
+    glEnableVertexAttribArray(VS_ATTRIB_TEXCOORD);
+    if (packed) {
       glVertexAttribPointer(VS_ATTRIB_TEXCOORD, 2,
-          GL_FLOAT, GL_FALSE, sizeof(GLfloat) * (3 + 3 + 2),
-          (void*)(sizeof(GLfloat) * (3 + 3)));
-      break;
-    case VertexFormat::P3N3:
-      glEnableVertexAttribArray(VS_ATTRIB_POSITION);
-      glEnableVertexAttribArray(VS_ATTRIB_NORMAL);
-
-      glBindBuffer(GL_ARRAY_BUFFER, buffer);
-      glVertexAttribPointer(VS_ATTRIB_POSITION, 3,
-          GL_FLOAT, GL_FALSE, sizeof(GLfloat) * (3 + 3),
-          (void*)0);
-      glVertexAttribPointer(VS_ATTRIB_NORMAL, 3,
-          GL_FLOAT, GL_FALSE, sizeof(GLfloat) * (3 + 3),
-          (void*)(sizeof(GLfloat) * 3));
-      break;
-    case VertexFormat::P3T2:
-      glEnableVertexAttribArray(VS_ATTRIB_POSITION);
-      glEnableVertexAttribArray(VS_ATTRIB_NORMAL);
-      assert(false); // TODO
-      break;
+          GL_HALF_FLOAT, GL_FALSE, stride, (void*)offset);
+      offset += sizeof(GLushort) * 2;
+    } else {
+      glVertexAttribPointer(VS_ATTRIB_TEXCOORD, 2,
+          GL_FLOAT, GL_FALSE, stride, (void*)offset);
+      offset += sizeof(GLfloat) * 2;
+    }
   }
+  assert(offset == (size_t) stride);
+
+  // The element array binding is part of VAO state.
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+  glBindVertexArray(0);
 
-  return std::make_shared<VertexBuffer>(format, buffer, vao);
+  return std::make_shared<VertexBuffer>(format, buffer, index_buffer,
+                                        index_type, vao);
 }
 
-VertexBuffer::VertexBuffer(VertexFormat format, GLuint buffer, GLuint vao)
-  : format_(format), buffer_(buffer), vao_(vao) {
+VertexBuffer::VertexBuffer(VertexFormat format, GLuint buffer,
+                           GLuint index_buffer, GLenum index_type, GLuint vao)
+  : format_(format), buffer_(buffer), index_buffer_(index_buffer)
+  , index_type_(index_type), vao_(vao) {
 }
 
 VertexBuffer::~VertexBuffer() {
   glDeleteBuffers(1, &buffer_);
+  glDeleteBuffers(1, &index_buffer_);
   glDeleteVertexArrays(1, &vao_);
 }
 
-std::unique_ptr<Mesh> Mesh::FromOBJ(const std::string& path) {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t> shapes;
-  std::vector<tinyobj::material_t> materials;
+std::unique_ptr<Mesh> Mesh::FromOBJ(const std::string& path, bool packed) {
+  // Skip parsing entirely if we have an up-to-date binary copy of the mesh.
+  auto cache = MeshCache::Open(path);
+  if (cache && IsPackedFormat(cache->format()) == packed) {
+    return FromCache(*cache);
+  }
+  cache = nullptr;
+
+  MeshData data;
+  if (!PrepareOBJ(path, packed, data)) {
+    return nullptr;
+  }
+  return FromData(data);
+}
+
+bool Mesh::PrepareOBJ(const std::string& path, bool packed,
+                      MeshData& out_data) {
+  if (!LoadOBJ(path, out_data)) {
+    return false;
+  }
+
+#ifdef QUARKE_DEBUG
+  VertexCacheStats before, after;
+  OptimizeMesh(out_data, &before, &after);
+  std::cout << "[mesh] optimized " << path << ": ACMR " << before.acmr
+            << " -> " << after.acmr << ", ATVR " << before.atvr << " -> "
+            << after.atvr << std::endl;
+#else
+  OptimizeMesh(out_data);
+#endif  // QUARKE_DEBUG
 
-  const bool triangulate = true;
-  std::string err;
-  bool result = tinyobj::LoadObj(&attrib, &shapes, &materials, &err,
-                                 path.c_str(), nullptr, triangulate);
-  if (!err.empty()) {
-    std::cerr << err << std::endl;
+  if (packed) {
+    PackMeshData(out_data);
   }
-  if (!result) {
+
+  if (!MeshCache::Write(path, out_data)) {
+    std::cerr << "[mesh] Failed to write mesh cache for " << path << std::endl;
+  }
+  return true;
+}
+
+std::unique_ptr<Mesh> Mesh::FromCache(const MeshCache& cache) {
+  return Create(cache.format(), cache.vertices(), cache.vertices_size(),
+                cache.indices(), cache.index_type(), cache.num_indices(),
+                cache.bounds_min(), cache.bounds_max());
+}
+
+bool Mesh::LoadOBJ(const std::string& path, MeshData& out_data) {
+  ObjData obj;
+  if (!ParseOBJ(path, obj)) {
     std::cerr << "Failed to load OBJ " << path << std::endl;
-    return nullptr;
+    return false;
   }
 
-  std::vector<GLfloat> data; // interleaved vertex data.
-  bool hasNormals = attrib.normals.size() > 0;
-  bool hasTexCoords = attrib.texcoords.size() > 0;
+  bool hasNormals = obj.normals.size() > 0;
+  bool hasTexCoords = obj.texcoords.size() > 0;
 
-  // XXX: a peek into tinyobjloader would suggest that we can always expect 3
-  //      component position and normal data, and 2 component texture coords.
-  //      our triangulate parameter guarantees us GL_TRIANGLES as well.
+  // ParseOBJ always provides 3 component position and normal data, 2
+  // component texture coords and GL_TRIANGLES.
   VertexFormat format = P3;
   if (hasNormals && hasTexCoords) {
     format = P3N3T2;
@@ -101,49 +223,154 @@ std::unique_ptr<Mesh> Mesh::FromOBJ(const std::string& path) {
   const int num_position_components = 3;
   const int num_normal_components = 3;
   const int num_uv_components = 2;
-  assert(attrib.vertices.size() % num_position_components == 0);
-  assert(attrib.normals.size() % num_normal_components == 0);
-  assert(attrib.texcoords.size() % num_uv_components == 0);
-
-  int num_vertices = 0;
-  // TODO: Perhaps construct a element buffers ourselves later.
-  //       We don't have to worry about quads.
-  for (tinyobj::shape_t& shape : shapes) {
-    num_vertices += shape.mesh.indices.size();
-    for (tinyobj::index_t& i : shape.mesh.indices) {
-      // TODO: handle per-face textures (supported by obj)
-      for (int c = 0; c < num_position_components; c++) {
-        data.push_back(attrib.vertices[i.vertex_index * num_position_components + c]);
-      }
+  const int num_positions = obj.positions.size() / num_position_components;
+  const int num_normals = obj.normals.size() / num_normal_components;
+  const int num_texcoords = obj.texcoords.size() / num_uv_components;
+
+  const size_t num_indices = obj.indices.size();
+  std::vector<GLfloat> data; // interleaved vertex data.
+  std::vector<GLuint>& indices = out_data.indices;
+  indices.clear();
+  indices.reserve(num_indices);
+
+  // Maps each distinct (position, normal, texcoord) triple to its slot in the
+  // unique vertex table.
+  std::unordered_map<IndexKey, GLuint, IndexKeyHash> unique_vertices;
+  unique_vertices.reserve(num_indices / 2);
+
+  glm::vec3 bounds_min(std::numeric_limits<float>::max());
+  glm::vec3 bounds_max(-std::numeric_limits<float>::max());
 
-      if (hasNormals) {
-        for (int c = 0; c < num_normal_components; c++) {
-          data.push_back(attrib.normals[i.normal_index * num_normal_components + c]);
-        }
-      } else {
-        // TODO: calculate face normal here, index modulo 3?
+  GLuint num_vertices = 0;
+  for (const ObjIndex& i : obj.indices) {
+    if (i.position < 0 || i.position >= num_positions) {
+      std::cerr << "Invalid vertex index in OBJ " << path << std::endl;
+      return false;
+    }
+    // Faces may omit attributes present elsewhere in the file, and thus
+    // reference -1; such attributes are zeroed.
+    const int normal_index = i.normal < num_normals ? i.normal : -1;
+    const int texcoord_index = i.texcoord < num_texcoords ? i.texcoord : -1;
+
+    // Attributes that aren't part of the vertex format mustn't split
+    // vertices, so ignore their indices for the purposes of hashing.
+    IndexKey key = {
+      i.position,
+      hasNormals ? normal_index : -1,
+      hasTexCoords ? texcoord_index : -1,
+    };
+    auto inserted = unique_vertices.emplace(key, num_vertices);
+    indices.push_back(inserted.first->second);
+    if (!inserted.second) {
+      continue;
+    }
+    num_vertices++;
+
+    // TODO: handle per-face textures (supported by obj)
+    for (int c = 0; c < num_position_components; c++) {
+      GLfloat value = obj.positions[i.position * num_position_components + c];
+      bounds_min[c] = std::min(bounds_min[c], value);
+      bounds_max[c] = std::max(bounds_max[c], value);
+      data.push_back(value);
+    }
+
+    if (hasNormals) {
+      for (int c = 0; c < num_normal_components; c++) {
+        data.push_back(normal_index < 0 ? 0.f :
+            obj.normals[normal_index * num_normal_components + c]);
       }
+    } else {
+      // TODO: calculate face normal here, index modulo 3?
+    }
 
-      if (hasTexCoords) {
-        for (int c = 0; c < num_uv_components; c++) {
-          data.push_back(attrib.texcoords[num_uv_components * i.texcoord_index + c]);
-        }
+    if (hasTexCoords) {
+      for (int c = 0; c < num_uv_components; c++) {
+        data.push_back(texcoord_index < 0 ? 0.f :
+            obj.texcoords[num_uv_components * texcoord_index + c]);
       }
     }
   }
 
-  auto vb = VertexBuffer::Create(format);
-  GLuint buffer = vb->buffer();
-  glBindBuffer(GL_ARRAY_BUFFER, buffer);
-  glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(GLfloat),
-               (const void*) data.data(), GL_STATIC_DRAW);
+  if (num_vertices == 0) {
+    bounds_min = bounds_max = glm::vec3(0.f);
+  }
+
+  out_data.format = format;
+  out_data.vertices.resize(data.size() * sizeof(GLfloat));
+  memcpy(out_data.vertices.data(), data.data(), out_data.vertices.size());
+  out_data.bounds_min = bounds_min;
+  out_data.bounds_max = bounds_max;
+  return true;
+}
+
+std::unique_ptr<Mesh> Mesh::FromData(const MeshData& data) {
+  const GLenum index_type = IndexTypeFor(data.num_vertices());
+  const GLsizeiptr vertices_size = data.vertices.size();
 
-  return std::make_unique<Mesh>(vb, num_vertices);
+  if (index_type == GL_UNSIGNED_SHORT) {
+    std::vector<GLushort> short_indices = NarrowIndices(data.indices);
+    return Create(data.format, data.vertices.data(), vertices_size,
+                  short_indices.data(), index_type, short_indices.size(),
+                  data.bounds_min, data.bounds_max);
+  }
+  return Create(data.format, data.vertices.data(), vertices_size,
+                data.indices.data(), index_type, data.indices.size(),
+                data.bounds_min, data.bounds_max);
 }
 
-Mesh::Mesh(std::shared_ptr<VertexBuffer> array_buffer, GLuint num_vertices)
-  : array_buffer_(array_buffer), num_vertices_(num_vertices)
-  , color_(glm::vec4(1.f, 1.f, 1.f, 1.f)) {
+std::unique_ptr<Mesh> Mesh::Create(VertexFormat format, const void* vertices,
+                                   GLsizeiptr vertices_size,
+                                   const void* indices, GLenum index_type,
+                                   GLsizei num_indices,
+                                   const glm::vec3& bounds_min,
+                                   const glm::vec3& bounds_max) {
+  const GLsizeiptr index_size = index_type == GL_UNSIGNED_SHORT
+                                ? sizeof(GLushort) : sizeof(GLuint);
+
+  auto vb = VertexBuffer::Create(format, index_type);
+  glBindBuffer(GL_ARRAY_BUFFER, vb->buffer());
+  glBufferData(GL_ARRAY_BUFFER, vertices_size, vertices, GL_STATIC_DRAW);
+
+  // Bind the VAO so that we don't clobber another VAO's element buffer.
+  glBindVertexArray(vb->vertex_array());
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices * index_size, indices,
+               GL_STATIC_DRAW);
+  glBindVertexArray(0);
+
+  glm::mat4 dequantize;
+  if (IsPackedFormat(format)) {
+    dequantize = DequantizeTransform(bounds_min, bounds_max);
+  }
+  const AABB bounds = { bounds_min, bounds_max };
+  return std::make_unique<Mesh>(vb, num_indices, bounds, dequantize);
+}
+
+Mesh::Mesh(std::shared_ptr<VertexBuffer> array_buffer, GLuint num_indices,
+           const AABB& bounds, const glm::mat4& dequantize)
+  : bounds_(bounds), bounding_sphere_(BoundingSphere(bounds))
+  , world_bounding_sphere_(bounding_sphere_), world_bounds_(bounds)
+  , transform_version_(0)
+  , dequantize_(dequantize), model_matrix_(dequantize)
+  , normal_matrix_dirty_(true)
+  , color_(glm::vec4(1.f, 1.f, 1.f, 1.f))
+  , array_buffer_(array_buffer), num_indices_(num_indices) {
+}
+
+void Mesh::set_transform(const glm::mat4& transform) {
+  transform_ = transform;
+  model_matrix_ = transform_ * dequantize_;
+  normal_matrix_dirty_ = true;
+  world_bounding_sphere_ = TransformSphere(transform_, bounding_sphere_);
+  world_bounds_ = TransformAABB(transform_, bounds_);
+  transform_version_++;
+}
+
+const glm::mat4& Mesh::normal_matrix() const {
+  if (normal_matrix_dirty_) {
+    normal_matrix_ = glm::transpose(glm::inverse(transform_));
+    normal_matrix_dirty_ = false;
+  }
+  return normal_matrix_;
 }
 
 }  // namespace geo
@@ -4,15 +4,20 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
+#include "geo/bounds.h"
 
 namespace quarke {
 namespace geo {
 
 struct Material;
+class MeshCache;
 
 // Format of the array buffer in memory. Currently, only interleaved vertex
-// data is supported with floating point values.
+// data is supported.
 //
 // Legend:
 // Pn: position
@@ -20,41 +25,94 @@ struct Material;
 // Tn: uv coords
 //
 // where n is the number of 32-bit floating point components.
+//
+// The _PACKED variants store the same attributes quantized:
+// - positions as normalized 16-bit unsigned integers relative to the mesh
+//   bounds, padded to 8 bytes. Meshes apply the inverse transform as part of
+//   their model matrix.
+// - normals as normalized GL_INT_2_10_10_10_REV.
+// - uv coords as half floats.
 enum VertexFormat {
   P3N3T2,
   P3N3,
   P3T2,
   P3,
+  P3N3T2_PACKED,
+  P3N3_PACKED,
+  P3T2_PACKED,
+  P3_PACKED,
 };
 
 // A lightweight wrapper around a GL vertex data buffer to be used for sharing
 // immutable buffers between meshes. It stores a VAO with attributes bound
-// according to the standard mesh attribute format.
+// according to the standard mesh attribute format, as well as an element
+// buffer indexing into the vertex data.
 class VertexBuffer {
  public:
   const static int VS_ATTRIB_POSITION = 0; // vs index of position vec3
   const static int VS_ATTRIB_NORMAL   = 1; // vs index of normal vec3
   const static int VS_ATTRIB_TEXCOORD = 2; // vs index of texcoord vec2
 
-  // Creates a new GL buffer owned by this VertexBuffer.
-  static std::shared_ptr<VertexBuffer> Create(VertexFormat format);
+  // Creates a new GL vertex buffer and element buffer owned by this
+  // VertexBuffer. `index_type` must be one of GL_UNSIGNED_SHORT or
+  // GL_UNSIGNED_INT.
+  static std::shared_ptr<VertexBuffer> Create(VertexFormat format,
+                                              GLenum index_type);
 
-  // Wraps a vertex buffer, assuming ownership.
-  VertexBuffer(VertexFormat format, GLuint buffer, GLuint vao);
+  // Wraps a vertex buffer and element buffer, assuming ownership.
+  VertexBuffer(VertexFormat format, GLuint buffer, GLuint index_buffer,
+               GLenum index_type, GLuint vao);
   VertexBuffer(const VertexBuffer& buffer) = delete;
   VertexBuffer(VertexBuffer&& buffer) = delete;
   ~VertexBuffer();
 
   VertexFormat format() const { return format_; }
   GLuint buffer() const { return buffer_; }
+  GLuint index_buffer() const { return index_buffer_; }
+  // The type of each element in the index buffer, for glDrawElements.
+  GLenum index_type() const { return index_type_; }
   GLuint vertex_array() const { return vao_; }
  private:
 
   VertexFormat format_;
   GLuint buffer_;
+  GLuint index_buffer_;
+  GLenum index_type_;
   GLuint vao_;
 };
 
+// Returns the size of a single vertex in `format`, in bytes.
+GLsizei VertexSize(VertexFormat format);
+
+// Returns true if `format` is one of the quantized _PACKED formats.
+bool IsPackedFormat(VertexFormat format);
+
+// Returns true if vertices in `format` have a normal attribute.
+bool HasNormals(VertexFormat format);
+
+// Returns true if vertices in `format` have a uv coordinate attribute.
+bool HasTexCoords(VertexFormat format);
+
+// CPU-side mesh data prior to upload, as produced by the OBJ loader.
+// Vertices are unique and interleaved according to `format`; each triple of
+// indices forms a triangle.
+struct MeshData {
+  VertexFormat format;
+  std::vector<GLubyte> vertices;
+  std::vector<GLuint> indices;
+  // Axis-aligned bounds of vertex positions in model space.
+  glm::vec3 bounds_min;
+  glm::vec3 bounds_max;
+
+  size_t num_vertices() const { return vertices.size() / VertexSize(format); }
+};
+
+// Returns the narrowest index type able to address `num_vertices` vertices.
+GLenum IndexTypeFor(size_t num_vertices);
+
+// Narrows 32-bit indices to 16-bit, assuming that all indices fit.
+std::vector<GLushort> NarrowIndices(const std::vector<GLuint>& indices);
+
 // A mesh is simply an aggregation of triangle faces.
 // XXX: idea
 // - split rendering passes batched by texture
@@ -66,34 +124,107 @@ class VertexBuffer {
 // One texture per mesh would be simplest, for now. We can do most of what we want with uv-mapping.
 class Mesh {
  public:
-  // Loads a mesh given a path to an obj file.
+  // Loads a mesh given a path to an obj file. If `packed` is set, vertex data
+  // is quantized to the equivalent _PACKED format.
   // TODO: support mtl. should this output a single, or multiple meshes?
   // Returns nullptr on failure.
-  static std::unique_ptr<Mesh> FromOBJ(const std::string& path);
-
-  // Creates a new mesh using the default material and vertex data.
-  Mesh(std::shared_ptr<VertexBuffer> array_buffer, GLuint num_vertices);
+  static std::unique_ptr<Mesh> FromOBJ(const std::string& path,
+                                       bool packed = true);
+
+  // Parses the obj file at `path` into deduplicated, indexed vertex data
+  // without touching the GL. The resulting format is never packed.
+  // Returns false on failure.
+  static bool LoadOBJ(const std::string& path, MeshData& out_data);
+
+  // Performs the GL-free portion of FromOBJ on a cache miss: loads,
+  // optimizes and (if `packed` is set) packs the mesh, then writes the
+  // result to the mesh cache. Safe to call from any thread.
+  // Returns false on failure.
+  static bool PrepareOBJ(const std::string& path, bool packed,
+                         MeshData& out_data);
+
+  // Uploads the contents of a mesh cache to a new vertex buffer.
+  static std::unique_ptr<Mesh> FromCache(const MeshCache& cache);
+
+  // Uploads the given mesh data to a new vertex buffer. 16-bit indices are
+  // used if the vertex count permits.
+  static std::unique_ptr<Mesh> FromData(const MeshData& data);
+
+  // Uploads interleaved vertex data and indices of type `index_type` directly
+  // to a new vertex buffer, without any intermediate copies.
+  // `bounds_min` and `bounds_max` are the model-space bounds of the mesh, used
+  // to dequantize packed vertex formats.
+  static std::unique_ptr<Mesh> Create(VertexFormat format,
+                                      const void* vertices,
+                                      GLsizeiptr vertices_size,
+                                      const void* indices,
+                                      GLenum index_type,
+                                      GLsizei num_indices,
+                                      const glm::vec3& bounds_min,
+                                      const glm::vec3& bounds_max);
+
+  // Creates a new mesh using the default material and indexed vertex data.
+  // Copies of a mesh share its vertex buffer, and are drawn as instances
+  // where the material permits.
+  // `bounds` encloses the mesh in model space. `dequantize` maps vertex
+  // positions as stored in the array buffer to model space.
+  Mesh(std::shared_ptr<VertexBuffer> array_buffer, GLuint num_indices,
+       const AABB& bounds, const glm::mat4& dequantize = glm::mat4());
 
   // Replaces the model's current transform with the given one.
   // Coordinates are defined in world-space.
-  void set_transform(const glm::mat4& transform) { transform_ = transform; }
-  glm::mat4 transform() const { return transform_; }
+  void set_transform(const glm::mat4& transform);
+  const glm::mat4& transform() const { return transform_; }
+
+  // Returns the transform from stored vertex positions to world space,
+  // including any dequantization of packed positions. Normals should be
+  // transformed with respect to transform() instead.
+  const glm::mat4& model_matrix() const { return model_matrix_; }
+
+  // Model-space bounding volumes of the mesh. The sphere circumscribes the
+  // box, packed as (center, radius).
+  const AABB& bounds() const { return bounds_; }
+  const glm::vec4& bounding_sphere() const { return bounding_sphere_; }
+  // The bounding sphere in world space, updated with the transform.
+  const glm::vec4& world_bounding_sphere() const {
+    return world_bounding_sphere_;
+  }
+  // The world-space box enclosing the transformed model-space bounds.
+  const AABB& world_bounds() const { return world_bounds_; }
+
+  // Incremented on every call to set_transform(), so that spatial structures
+  // can detect moved meshes.
+  uint32_t transform_version() const { return transform_version_; }
+
+  // Returns the inverse transpose of transform(), used to transform normals.
+  // Computed lazily and cached until the transform next changes.
+  const glm::mat4& normal_matrix() const;
 
   // TODO: remove me, and replace by generic typed maps
-  glm::vec4 set_color(const glm::vec4 color) { color_ = color; }
+  void set_color(const glm::vec4 color) { color_ = color; }
   // Gets the mesh's inherent color, used by some material implementations.
   glm::vec4 color() const { return color_; }
 
   VertexBuffer& array_buffer() const { return *array_buffer_; }
-  GLuint num_vertices() const { return num_vertices_; }
+  // The number of indices to draw from the array buffer's element buffer.
+  GLuint num_indices() const { return num_indices_; }
  private:
   // TODO. simple material ownership might not cut it.
   //Material& material_;
+  AABB bounds_;
+  glm::vec4 bounding_sphere_;
+  glm::vec4 world_bounding_sphere_;
+  AABB world_bounds_;
+  uint32_t transform_version_;
   glm::mat4 transform_;
+  glm::mat4 dequantize_;
+  glm::mat4 model_matrix_; // transform_ * dequantize_
+  mutable glm::mat4 normal_matrix_;
+  mutable bool normal_matrix_dirty_;
   glm::vec4 color_;
 
   std::shared_ptr<VertexBuffer> array_buffer_;
-  GLuint num_vertices_;
+  GLuint num_indices_;
 };
 
 }  // namespace geo
@@ -0,0 +1,253 @@
+#include "geo/mesh_cache.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace quarke {
+namespace geo {
+
+static const char MAGIC[4] = { 'Q', 'M', 'S', 'H' };
+// Bump whenever the layout, loader or optimizer output changes.
+static const uint32_t VERSION = 2;
+static const size_t BLOB_ALIGNMENT = 16;
+static const char* CACHE_EXTENSION = ".qmesh";
+
+#pragma pack(push,1)
+struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t vertex_format; // geo::VertexFormat
+  uint32_t index_type; // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+  uint64_t source_size;
+  int64_t source_mtime; // in nanoseconds, if supported
+  uint64_t source_hash;
+  uint64_t vertices_offset;
+  uint64_t vertices_size;
+  uint64_t indices_offset;
+  uint64_t num_indices;
+  float bounds_min[3];
+  float bounds_max[3];
+};
+#pragma pack(pop)
+
+static uint64_t Align(uint64_t offset) {
+  return (offset + BLOB_ALIGNMENT - 1) & ~(uint64_t) (BLOB_ALIGNMENT - 1);
+}
+
+// 64-bit FNV-1a.
+static uint64_t HashBytes(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+static bool StatSource(const std::string& path, uint64_t& out_size,
+                       int64_t& out_mtime) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+  out_size = st.st_size;
+  // Use nanosecond precision where available, so that edits within the same
+  // second are still caught.
+#if defined(__APPLE__)
+  out_mtime = st.st_mtimespec.tv_sec * 1000000000ll + st.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+  out_mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+#else
+  out_mtime = st.st_mtime;
+#endif
+  return true;
+}
+
+static bool HashSource(const std::string& path, uint64_t& out_hash) {
+  auto source = util::MappedFile::Open(path);
+  if (!source)
+    return false;
+  out_hash = HashBytes(source->data(), source->size());
+  return true;
+}
+
+// Records `mtime` in the header of the cache at `path`, once its source was
+// found unchanged by hash, so that later opens can skip hashing.
+static void UpdateSourceMtime(const std::string& path, int64_t mtime) {
+  std::fstream file(path, std::fstream::in | std::fstream::out |
+                          std::fstream::binary);
+  if (!file)
+    return;
+  file.seekp(offsetof(Header, source_mtime));
+  file.write((const char*) &mtime, sizeof(mtime));
+}
+
+/* static */
+std::string MeshCache::PathFor(const std::string& source_path) {
+  return source_path + CACHE_EXTENSION;
+}
+
+/* static */
+std::unique_ptr<MeshCache> MeshCache::Open(const std::string& source_path) {
+  uint64_t source_size;
+  int64_t source_mtime;
+  if (!StatSource(source_path, source_size, source_mtime))
+    return nullptr;
+
+  auto file = util::MappedFile::Open(PathFor(source_path));
+  if (!file || file->size() < sizeof(Header))
+    return nullptr;
+
+  Header header;
+  memcpy(&header, file->data(), sizeof(header));
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION) {
+    return nullptr;
+  }
+
+  if (header.vertex_format > P3_PACKED ||
+      (header.index_type != GL_UNSIGNED_SHORT &&
+       header.index_type != GL_UNSIGNED_INT)) {
+    std::cerr << "[mesh cache] Malformed cache for " << source_path
+              << std::endl;
+    return nullptr;
+  }
+
+  const uint64_t index_size = header.index_type == GL_UNSIGNED_SHORT
+                              ? sizeof(GLushort) : sizeof(GLuint);
+  if (header.vertices_offset + header.vertices_size > file->size() ||
+      header.indices_offset + header.num_indices * index_size > file->size()) {
+    std::cerr << "[mesh cache] Truncated cache for " << source_path
+              << std::endl;
+    return nullptr;
+  }
+
+  if (header.source_size != source_size)
+    return nullptr;
+  // A changed mtime alone (e.g. after a fresh checkout) doesn't invalidate the
+  // cache if the source contents are the same; only then pay for hashing.
+  if (header.source_mtime != source_mtime) {
+    uint64_t source_hash;
+    if (!HashSource(source_path, source_hash) ||
+        source_hash != header.source_hash) {
+      return nullptr;
+    }
+    UpdateSourceMtime(PathFor(source_path), source_mtime);
+  }
+
+  return std::make_unique<MeshCache>(std::move(file));
+}
+
+/* static */
+bool MeshCache::Write(const std::string& source_path, const MeshData& data) {
+  Header header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.vertex_format = data.format;
+
+  if (!StatSource(source_path, header.source_size, header.source_mtime) ||
+      !HashSource(source_path, header.source_hash)) {
+    return false;
+  }
+
+  header.index_type = IndexTypeFor(data.num_vertices());
+  std::vector<GLushort> short_indices;
+  const void* indices = data.indices.data();
+  uint64_t indices_size = data.indices.size() * sizeof(GLuint);
+  if (header.index_type == GL_UNSIGNED_SHORT) {
+    short_indices = NarrowIndices(data.indices);
+    indices = short_indices.data();
+    indices_size = short_indices.size() * sizeof(GLushort);
+  }
+
+  header.vertices_offset = Align(sizeof(Header));
+  header.vertices_size = data.vertices.size();
+  header.indices_offset = Align(header.vertices_offset + header.vertices_size);
+  header.num_indices = data.indices.size();
+  for (int c = 0; c < 3; c++) {
+    header.bounds_min[c] = data.bounds_min[c];
+    header.bounds_max[c] = data.bounds_max[c];
+  }
+
+  // Write to a temporary file first, so that a partially written cache is
+  // never observed by a concurrent reader. Its name is unique to each write,
+  // as other loader threads or processes may be writing the same cache.
+  static std::atomic<uint32_t> num_writes(0);
+  const std::string path = PathFor(source_path);
+  std::ostringstream temp_name;
+  temp_name << path << "." << getpid() << "." << num_writes++ << ".tmp";
+  const std::string temp_path = temp_name.str();
+  std::ofstream file(temp_path, std::ofstream::binary | std::ofstream::trunc);
+  if (!file)
+    return false;
+
+  const char padding[BLOB_ALIGNMENT] = {};
+  file.write((const char*) &header, sizeof(header));
+  file.write(padding, header.vertices_offset - sizeof(header));
+  file.write((const char*) data.vertices.data(), header.vertices_size);
+  file.write(padding, header.indices_offset -
+                      (header.vertices_offset + header.vertices_size));
+  file.write((const char*) indices, indices_size);
+  file.close();
+
+  if (!file || rename(temp_path.c_str(), path.c_str()) != 0) {
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+MeshCache::MeshCache(std::unique_ptr<util::MappedFile> file)
+  : file_(std::move(file)) {
+}
+
+// The header is at the start of a page-aligned mapping, so we can read it in
+// place despite its packing.
+static const Header& GetHeader(const util::MappedFile& file) {
+  return *static_cast<const Header*>(file.data());
+}
+
+VertexFormat MeshCache::format() const {
+  return (VertexFormat) GetHeader(*file_).vertex_format;
+}
+
+const void* MeshCache::vertices() const {
+  return static_cast<const char*>(file_->data()) +
+         GetHeader(*file_).vertices_offset;
+}
+
+GLsizeiptr MeshCache::vertices_size() const {
+  return GetHeader(*file_).vertices_size;
+}
+
+const void* MeshCache::indices() const {
+  return static_cast<const char*>(file_->data()) +
+         GetHeader(*file_).indices_offset;
+}
+
+GLenum MeshCache::index_type() const {
+  return GetHeader(*file_).index_type;
+}
+
+GLsizei MeshCache::num_indices() const {
+  return GetHeader(*file_).num_indices;
+}
+
+glm::vec3 MeshCache::bounds_min() const {
+  const float* b = GetHeader(*file_).bounds_min;
+  return glm::vec3(b[0], b[1], b[2]);
+}
+
+glm::vec3 MeshCache::bounds_max() const {
+  const float* b = GetHeader(*file_).bounds_max;
+  return glm::vec3(b[0], b[1], b[2]);
+}
+
+}  // namespace geo
+}  // namespace quarke
@@ -0,0 +1,55 @@
+#ifndef QUARKE_SRC_GEO_MESH_CACHE_H_
+#define QUARKE_SRC_GEO_MESH_CACHE_H_
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <memory>
+#include <string>
+#include "geo/mesh.h"
+#include "util/mapped_file.h"
+
+namespace quarke {
+namespace geo {
+
+// A versioned binary copy of a loaded and optimized mesh, stored alongside
+// its source file. The cache is memory-mapped when opened so that vertex and
+// index data may be handed directly to the GL without parsing.
+//
+// Layout (native endianness):
+// - header (see mesh_cache.cc), including the source file's size, mtime and
+//   hash for invalidation
+// - interleaved vertex data, as laid out in the mesh's VertexFormat
+// - index data, 16-bit or 32-bit
+// Both blobs are 16-byte aligned.
+class MeshCache {
+ public:
+  // Opens the cache for the mesh at `source_path`. Returns nullptr if there is
+  // no cache, if it is malformed, or if the source has changed since the
+  // cache was written.
+  static std::unique_ptr<MeshCache> Open(const std::string& source_path);
+
+  // Writes `data` as the cache for the mesh at `source_path`.
+  // Returns false on failure.
+  static bool Write(const std::string& source_path, const MeshData& data);
+
+  // Returns the path of the cache file for the given source file.
+  static std::string PathFor(const std::string& source_path);
+
+  explicit MeshCache(std::unique_ptr<util::MappedFile> file);
+
+  VertexFormat format() const;
+  const void* vertices() const;
+  GLsizeiptr vertices_size() const;
+  const void* indices() const;
+  GLenum index_type() const;
+  GLsizei num_indices() const;
+  glm::vec3 bounds_min() const;
+  glm::vec3 bounds_max() const;
+ private:
+  std::unique_ptr<util::MappedFile> file_;
+};
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_MESH_CACHE_H_
@@ -0,0 +1,350 @@
+#include "geo/mesh_optimizer.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <glm/glm.hpp>
+
+namespace quarke {
+namespace geo {
+
+namespace {
+
+// Triangles adjacent to each vertex, stored as compressed rows.
+struct Adjacency {
+  std::vector<GLuint> counts;
+  std::vector<GLuint> offsets;
+  std::vector<GLuint> triangles;
+};
+
+void BuildAdjacency(const GLuint* indices, size_t num_indices,
+                    size_t num_vertices, Adjacency& adj) {
+  adj.counts.assign(num_vertices, 0);
+  for (size_t i = 0; i < num_indices; i++) {
+    assert(indices[i] < num_vertices);
+    adj.counts[indices[i]]++;
+  }
+
+  adj.offsets.resize(num_vertices);
+  GLuint offset = 0;
+  for (size_t v = 0; v < num_vertices; v++) {
+    adj.offsets[v] = offset;
+    offset += adj.counts[v];
+  }
+
+  adj.triangles.resize(num_indices);
+  std::vector<GLuint> fill(adj.offsets);
+  for (size_t i = 0; i < num_indices; i++) {
+    adj.triangles[fill[indices[i]]++] = i / 3;
+  }
+}
+
+// A FIFO post-transform cache, simulated using insertion timestamps.
+class CacheSimulator {
+ public:
+  CacheSimulator(size_t num_vertices, size_t cache_size)
+    : timestamps_(num_vertices, 0), time_(cache_size + 1)
+    , cache_size_(cache_size) {}
+
+  bool Contains(GLuint v) const {
+    return time_ - timestamps_[v] <= cache_size_;
+  }
+
+  // Returns true if `v` was a cache miss, inserting it.
+  bool Access(GLuint v) {
+    if (Contains(v))
+      return false;
+    timestamps_[v] = time_++;
+    return true;
+  }
+
+  // Evicts all entries.
+  void Flush() { time_ += cache_size_ + 1; }
+
+  // The number of insertions since `v` was last inserted.
+  size_t Age(GLuint v) const { return time_ - timestamps_[v]; }
+ private:
+  std::vector<size_t> timestamps_;
+  size_t time_;
+  size_t cache_size_;
+};
+
+}  // namespace
+
+VertexCacheStats AnalyzeVertexCache(const GLuint* indices, size_t num_indices,
+                                    size_t num_vertices, size_t cache_size) {
+  CacheSimulator cache(num_vertices, cache_size);
+  std::vector<bool> referenced(num_vertices, false);
+  size_t num_referenced = 0;
+  size_t transformed = 0;
+  for (size_t i = 0; i < num_indices; i++) {
+    GLuint v = indices[i];
+    if (cache.Access(v))
+      transformed++;
+    if (!referenced[v]) {
+      referenced[v] = true;
+      num_referenced++;
+    }
+  }
+
+  VertexCacheStats stats;
+  stats.transformed = transformed;
+  stats.acmr = num_indices >= 3 ? (float) transformed / (num_indices / 3) : 0.f;
+  stats.atvr = num_referenced ? (float) transformed / num_referenced : 0.f;
+  return stats;
+}
+
+void OptimizeVertexCache(GLuint* indices, size_t num_indices,
+                         size_t num_vertices, size_t cache_size,
+                         std::vector<size_t>* out_clusters) {
+  if (out_clusters)
+    out_clusters->clear();
+  if (num_indices < 3)
+    return;
+
+  const size_t num_triangles = num_indices / 3;
+  Adjacency adj;
+  BuildAdjacency(indices, num_indices, num_vertices, adj);
+
+  // Number of unemitted triangles referencing each vertex.
+  std::vector<GLuint> live(adj.counts);
+  std::vector<bool> emitted(num_triangles, false);
+  CacheSimulator cache(num_vertices, cache_size);
+
+  std::vector<GLuint> output;
+  output.reserve(num_triangles * 3);
+  std::vector<GLuint> dead_end;
+  std::vector<GLuint> candidates;
+
+  size_t cursor = 0; // next vertex in input order to resume from
+  bool new_cluster = true;
+  int64_t fan = indices[0];
+  while (fan >= 0) {
+    candidates.clear();
+    GLuint begin = adj.offsets[fan];
+    GLuint end = begin + adj.counts[fan];
+    for (GLuint k = begin; k < end; k++) {
+      GLuint t = adj.triangles[k];
+      if (emitted[t])
+        continue;
+      if (new_cluster && out_clusters) {
+        out_clusters->push_back(output.size() / 3);
+      }
+      new_cluster = false;
+
+      for (int c = 0; c < 3; c++) {
+        GLuint v = indices[t * 3 + c];
+        output.push_back(v);
+        dead_end.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+        cache.Access(v);
+      }
+      emitted[t] = true;
+    }
+
+    // Prefer the candidate that will still be cached after fanning around
+    // it, and is the oldest such entry.
+    fan = -1;
+    size_t best_priority = 0;
+    for (GLuint v : candidates) {
+      if (live[v] == 0)
+        continue;
+      size_t priority = 0;
+      if (cache.Age(v) + 2 * live[v] <= cache_size)
+        priority = cache.Age(v);
+      if (fan < 0 || priority > best_priority) {
+        fan = v;
+        best_priority = priority;
+      }
+    }
+    if (fan >= 0)
+      continue;
+
+    // Dead end. Try recently used vertices first, then scan for the next
+    // vertex with remaining triangles in input order.
+    while (!dead_end.empty()) {
+      GLuint v = dead_end.back();
+      dead_end.pop_back();
+      if (live[v] > 0) {
+        fan = v;
+        break;
+      }
+    }
+    while (fan < 0 && cursor < num_vertices) {
+      if (live[cursor] > 0)
+        fan = cursor;
+      cursor++;
+    }
+    // We've lost cache locality if the new fan isn't resident.
+    if (fan >= 0 && !cache.Contains(fan))
+      new_cluster = true;
+  }
+
+  assert(output.size() == num_triangles * 3);
+  std::copy(output.begin(), output.end(), indices);
+}
+
+void OptimizeOverdraw(GLuint* indices, size_t num_indices,
+                      const void* positions, size_t stride,
+                      size_t num_vertices, const std::vector<size_t>& clusters,
+                      size_t cache_size, float threshold) {
+  const size_t num_triangles = num_indices / 3;
+  if (num_triangles == 0)
+    return;
+
+  // Split each hard cluster wherever its running ACMR drops to within
+  // `threshold` of the cluster's overall ACMR. Since each split is cold to the
+  // cache, this bounds the cost of reordering the resulting clusters.
+  std::vector<size_t> hard(clusters);
+  if (hard.empty() || hard[0] != 0)
+    hard.insert(hard.begin(), 0);
+  hard.push_back(num_triangles);
+
+  CacheSimulator cache(num_vertices, cache_size);
+  std::vector<size_t> soft;
+  for (size_t h = 0; h + 1 < hard.size(); h++) {
+    size_t start = hard[h];
+    size_t end = hard[h + 1];
+    if (start >= end)
+      continue;
+
+    cache.Flush();
+    size_t cluster_misses = 0;
+    for (size_t i = start * 3; i < end * 3; i++) {
+      cluster_misses += cache.Access(indices[i]);
+    }
+    float cluster_acmr = (float) cluster_misses / (end - start);
+
+    cache.Flush();
+    soft.push_back(start);
+    size_t soft_start = start;
+    size_t misses = 0;
+    for (size_t t = start; t < end; t++) {
+      for (int c = 0; c < 3; c++) {
+        misses += cache.Access(indices[t * 3 + c]);
+      }
+      float acmr = (float) misses / (t + 1 - soft_start);
+      if (t + 1 < end && acmr <= threshold * cluster_acmr) {
+        soft_start = t + 1;
+        soft.push_back(soft_start);
+        misses = 0;
+        cache.Flush();
+      }
+    }
+  }
+  soft.push_back(num_triangles);
+
+  // Compute area-weighted centroids and normals for the mesh and each cluster.
+  const size_t num_clusters = soft.size() - 1;
+  std::vector<glm::vec3> centroids(num_clusters);
+  std::vector<glm::vec3> normals(num_clusters);
+  auto position = [&](GLuint v) {
+    GLfloat p[3];
+    memcpy(p, static_cast<const GLubyte*>(positions) + v * stride, sizeof(p));
+    return glm::vec3(p[0], p[1], p[2]);
+  };
+
+  glm::vec3 mesh_centroid(0.f);
+  float mesh_area = 0.f;
+  for (size_t k = 0; k < num_clusters; k++) {
+    glm::vec3 centroid(0.f);
+    glm::vec3 normal(0.f);
+    float area = 0.f;
+    for (size_t t = soft[k]; t < soft[k + 1]; t++) {
+      glm::vec3 p0 = position(indices[t * 3 + 0]);
+      glm::vec3 p1 = position(indices[t * 3 + 1]);
+      glm::vec3 p2 = position(indices[t * 3 + 2]);
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      float tri_area = glm::length(n);
+      centroid += (p0 + p1 + p2) * (tri_area / 3.f);
+      normal += n;
+      area += tri_area;
+    }
+    mesh_centroid += centroid;
+    mesh_area += area;
+    centroids[k] = area > 0.f ? centroid / area : centroid;
+    normals[k] = normal;
+  }
+  if (mesh_area > 0.f)
+    mesh_centroid /= mesh_area;
+
+  // Clusters facing away from the centroid are likely to occlude others.
+  std::vector<float> sort_keys(num_clusters);
+  for (size_t k = 0; k < num_clusters; k++) {
+    float length = glm::length(normals[k]);
+    sort_keys[k] = length > 0.f
+      ? glm::dot(centroids[k] - mesh_centroid, normals[k] / length)
+      : 0.f;
+  }
+
+  std::vector<size_t> order(num_clusters);
+  for (size_t k = 0; k < num_clusters; k++)
+    order[k] = k;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return sort_keys[a] > sort_keys[b];
+  });
+
+  std::vector<GLuint> output;
+  output.reserve(num_triangles * 3);
+  for (size_t k : order) {
+    output.insert(output.end(), indices + soft[k] * 3,
+                  indices + soft[k + 1] * 3);
+  }
+  std::copy(output.begin(), output.end(), indices);
+}
+
+size_t OptimizeVertexFetch(void* vertices, size_t vertex_size,
+                           GLuint* indices, size_t num_indices,
+                           size_t num_vertices) {
+  const GLuint UNUSED = ~0u;
+  std::vector<GLuint> remap(num_vertices, UNUSED);
+  GLuint next = 0;
+  for (size_t i = 0; i < num_indices; i++) {
+    GLuint& v = remap[indices[i]];
+    if (v == UNUSED)
+      v = next++;
+    indices[i] = v;
+  }
+
+  GLubyte* bytes = static_cast<GLubyte*>(vertices);
+  std::vector<GLubyte> source(bytes, bytes + num_vertices * vertex_size);
+  for (size_t v = 0; v < num_vertices; v++) {
+    if (remap[v] == UNUSED)
+      continue;
+    memcpy(bytes + remap[v] * vertex_size, &source[v * vertex_size],
+           vertex_size);
+  }
+  return next;
+}
+
+void OptimizeMesh(MeshData& data, VertexCacheStats* out_before,
+                  VertexCacheStats* out_after, size_t cache_size) {
+  assert(!IsPackedFormat(data.format));
+  const size_t vertex_size = VertexSize(data.format);
+  const size_t num_vertices = data.num_vertices();
+  GLuint* indices = data.indices.data();
+  const size_t num_indices = data.indices.size();
+
+  if (out_before) {
+    *out_before = AnalyzeVertexCache(indices, num_indices, num_vertices,
+                                     cache_size);
+  }
+
+  std::vector<size_t> clusters;
+  OptimizeVertexCache(indices, num_indices, num_vertices, cache_size,
+                      &clusters);
+  // Positions are always the leading attribute.
+  OptimizeOverdraw(indices, num_indices, data.vertices.data(), vertex_size,
+                   num_vertices, clusters, cache_size);
+  size_t remaining = OptimizeVertexFetch(data.vertices.data(), vertex_size,
+                                         indices, num_indices, num_vertices);
+  data.vertices.resize(remaining * vertex_size);
+
+  if (out_after) {
+    *out_after = AnalyzeVertexCache(indices, num_indices, remaining,
+                                    cache_size);
+  }
+}
+
+}  // namespace geo
+}  // namespace quarke
@@ -0,0 +1,68 @@
+#ifndef QUARKE_SRC_GEO_MESH_OPTIMIZER_H_
+#define QUARKE_SRC_GEO_MESH_OPTIMIZER_H_
+
+#include <glad/glad.h>
+#include <vector>
+#include "geo/mesh.h"
+
+namespace quarke {
+namespace geo {
+
+// The number of entries in the simulated post-transform vertex cache.
+// Conservative enough for most desktop hardware.
+const size_t DEFAULT_VERTEX_CACHE_SIZE = 16;
+
+// Post-transform cache efficiency of an index buffer, simulated on a FIFO
+// vertex cache.
+struct VertexCacheStats {
+  size_t transformed; // number of vertex shader invocations
+  float acmr; // average cache miss ratio; transformed vertices per triangle
+  float atvr; // average transformed vertex ratio; transformed per unique vertex
+};
+
+// Simulates a FIFO post-transform cache of `cache_size` entries over the
+// given triangle list. Requires no GL context.
+VertexCacheStats AnalyzeVertexCache(const GLuint* indices, size_t num_indices,
+                                    size_t num_vertices,
+                                    size_t cache_size = DEFAULT_VERTEX_CACHE_SIZE);
+
+// Reorders triangles in-place for post-transform cache locality, using
+// Sander et al.'s "Tipsify" algorithm (Fast Triangle Reordering for Vertex
+// Locality and Reduced Overdraw, 2007).
+// If `out_clusters` is non-null, it is populated with the triangle offsets of
+// each cluster beginning (where the cache was effectively flushed), for use
+// with OptimizeOverdraw.
+void OptimizeVertexCache(GLuint* indices, size_t num_indices,
+                         size_t num_vertices, size_t cache_size,
+                         std::vector<size_t>* out_clusters);
+
+// Reorders the clusters produced by OptimizeVertexCache so that outward
+// facing clusters further from the mesh centroid are drawn first, which is
+// likely to reduce overdraw independent of viewpoint.
+// `positions` points to the first vertex position, stored as three floats,
+// with consecutive positions separated by `stride` bytes. Clusters are split further wherever the
+// cache efficiency within a cluster remains within `threshold` of its total.
+void OptimizeOverdraw(GLuint* indices, size_t num_indices,
+                      const void* positions, size_t stride,
+                      size_t num_vertices, const std::vector<size_t>& clusters,
+                      size_t cache_size, float threshold = 1.05f);
+
+// Reorders vertex data to match first use in the index buffer, rewriting
+// indices accordingly. Vertices unreferenced by the index buffer are dropped.
+// Returns the number of vertices remaining.
+size_t OptimizeVertexFetch(void* vertices, size_t vertex_size,
+                           GLuint* indices, size_t num_indices,
+                           size_t num_vertices);
+
+// Runs the vertex cache, overdraw and vertex fetch passes on `data`, which
+// must not be in a packed format.
+// If provided, cache statistics prior to and following optimization are
+// written to `out_before` and `out_after` respectively.
+void OptimizeMesh(MeshData& data, VertexCacheStats* out_before = nullptr,
+                  VertexCacheStats* out_after = nullptr,
+                  size_t cache_size = DEFAULT_VERTEX_CACHE_SIZE);
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_MESH_OPTIMIZER_H_
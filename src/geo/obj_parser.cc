@@ -0,0 +1,423 @@
+#include "geo/obj_parser.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include "util/mapped_file.h"
+
+namespace quarke {
+namespace geo {
+
+namespace {
+
+// Chunks smaller than this aren't worth the cost of a thread.
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+// The maximum number of decimal digits exactly representable in a uint64_t.
+const int MAX_MANTISSA_DIGITS = 19;
+
+// Powers of ten exactly representable as doubles.
+const double POW10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+enum Attribute {
+  ATTRIB_POSITION = 0,
+  ATTRIB_TEXCOORD = 1,
+  ATTRIB_NORMAL = 2,
+};
+
+// The parse results of a contiguous, line-aligned range of the file.
+// Indices are absolute, except for those written as negative (relative)
+// indices in the file; those are stored relative to the beginning of the
+// chunk and listed in `relative` to be fixed up once the attribute counts of
+// preceding chunks are known.
+struct Chunk {
+  const char* begin;
+  const char* end;
+
+  std::vector<float> positions;
+  std::vector<float> normals;
+  std::vector<float> texcoords;
+  std::vector<ObjIndex> indices;
+  // Offsets of relative indices, as (index * 3 + Attribute).
+  std::vector<size_t> relative;
+};
+
+inline bool IsDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+inline const char* SkipSpace(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+// SWAR (SIMD within a register) test that 8 little-endian bytes are all
+// ASCII digits.
+inline bool IsEightDigits(uint64_t val) {
+  return !(((val + 0x4646464646464646ull) | (val - 0x3030303030303030ull)) &
+           0x8080808080808080ull);
+}
+
+// SWAR conversion of 8 little-endian ASCII digits to their integer value,
+// using three multiplications rather than eight.
+inline uint32_t ParseEightDigits(uint64_t val) {
+  const uint64_t mask = 0x000000FF000000FFull;
+  const uint64_t mul1 = 100 + (1000000ull << 32);
+  const uint64_t mul2 = 1 + (10000ull << 32);
+  val -= 0x3030303030303030ull;
+  val = (val * 10) + (val >> 8);
+  val = (((val & mask) * mul1) + (((val >> 16) & mask) * mul2)) >> 32;
+  return (uint32_t) val;
+}
+
+inline bool LittleEndian() {
+  const uint16_t probe = 1;
+  return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+}
+
+// Accumulates a run of digits into `mantissa`. Returns the number of digits
+// consumed, and sets `truncated` if any didn't fit.
+inline int ParseDigits(const char*& p, const char* end, uint64_t& mantissa,
+                       int& digits, bool& truncated) {
+  const char* start = p;
+  if (LittleEndian()) {
+    while (end - p >= 8 && digits + 8 <= MAX_MANTISSA_DIGITS) {
+      uint64_t block;
+      memcpy(&block, p, sizeof(block));
+      if (!IsEightDigits(block))
+        break;
+      mantissa = mantissa * 100000000ull + ParseEightDigits(block);
+      digits += 8;
+      p += 8;
+    }
+  }
+  while (p < end && IsDigit(*p)) {
+    if (digits < MAX_MANTISSA_DIGITS) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits++;
+    } else {
+      truncated = true;
+    }
+    p++;
+  }
+  return p - start;
+}
+
+// Parses a decimal floating point value. Values with at most 19 significant
+// digits and a small exponent are computed exactly in double precision
+// (Clinger's fast path); anything else falls back to strtod.
+bool ParseFloat(const char*& p, const char* end, float& out) {
+  const char* start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool truncated = false;
+
+  int integer_digits = ParseDigits(p, end, mantissa, digits, truncated);
+  if (truncated) {
+    // Dropped integer digits still contribute to the magnitude.
+    exponent += integer_digits - digits;
+  }
+
+  int fraction_digits = 0;
+  if (p < end && *p == '.') {
+    p++;
+    int before = digits;
+    bool fraction_truncated = false;
+    fraction_digits = ParseDigits(p, end, mantissa, digits, fraction_truncated);
+    exponent -= digits - before;
+    truncated = truncated || fraction_truncated;
+  }
+
+  if (integer_digits == 0 && fraction_digits == 0) {
+    p = start;
+    return false;
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* e = p++;
+    bool exp_negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      exp_negative = *p == '-';
+      p++;
+    }
+    if (p < end && IsDigit(*p)) {
+      int exp_value = 0;
+      while (p < end && IsDigit(*p)) {
+        if (exp_value < 10000)
+          exp_value = exp_value * 10 + (*p - '0');
+        p++;
+      }
+      exponent += exp_negative ? -exp_value : exp_value;
+    } else {
+      p = e;
+    }
+  }
+
+  if (!truncated && mantissa <= (1ull << 53) && exponent >= -22 &&
+      exponent <= 22) {
+    double value = (double) mantissa;
+    value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+    out = (float) (negative ? -value : value);
+    return true;
+  }
+
+  char buffer[128];
+  size_t length = std::min<size_t>(p - start, sizeof(buffer) - 1);
+  memcpy(buffer, start, length);
+  buffer[length] = '\0';
+  out = (float) strtod(buffer, nullptr);
+  return true;
+}
+
+bool ParseInt(const char*& p, const char* end, int& out) {
+  bool negative = false;
+  const char* start = p;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  if (p >= end || !IsDigit(*p)) {
+    p = start;
+    return false;
+  }
+  int value = 0;
+  while (p < end && IsDigit(*p)) {
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+  out = negative ? -value : value;
+  return true;
+}
+
+// Parses up to `count` floats, defaulting missing components to zero.
+void ParseFloats(const char* p, const char* end, int count,
+                 std::vector<float>& out) {
+  for (int i = 0; i < count; i++) {
+    p = SkipSpace(p, end);
+    float value = 0.f;
+    if (!ParseFloat(p, end, value))
+      value = 0.f;
+    out.push_back(value);
+  }
+}
+
+// A single vertex of a face, prior to triangulation.
+struct FaceVertex {
+  ObjIndex index;
+  int relative; // bitmask of (1 << Attribute) for relative indices
+};
+
+// Resolves a 1-based or negative OBJ index into a zero-based index, relative
+// to the chunk if negative.
+inline int ResolveIndex(int value, size_t chunk_count, int attribute,
+                        int& relative) {
+  if (value > 0)
+    return value - 1;
+  if (value < 0) {
+    relative |= 1 << attribute;
+    return (int) chunk_count + value;
+  }
+  return -1;
+}
+
+void ParseFace(const char* p, const char* end, Chunk& chunk,
+               std::vector<FaceVertex>& face) {
+  face.clear();
+  while (true) {
+    p = SkipSpace(p, end);
+    int value;
+    if (!ParseInt(p, end, value))
+      break;
+
+    FaceVertex v = { { -1, -1, -1 }, 0 };
+    v.index.position = ResolveIndex(value, chunk.positions.size() / 3,
+                                    ATTRIB_POSITION, v.relative);
+    if (p < end && *p == '/') {
+      p++;
+      if (ParseInt(p, end, value)) {
+        v.index.texcoord = ResolveIndex(value, chunk.texcoords.size() / 2,
+                                        ATTRIB_TEXCOORD, v.relative);
+      }
+      if (p < end && *p == '/') {
+        p++;
+        if (ParseInt(p, end, value)) {
+          v.index.normal = ResolveIndex(value, chunk.normals.size() / 3,
+                                        ATTRIB_NORMAL, v.relative);
+        }
+      }
+    }
+    face.push_back(v);
+
+    // Skip anything else attached to the token.
+    while (p < end && *p != ' ' && *p != '\t')
+      p++;
+  }
+
+  // Triangulate as a fan around the first vertex, as tinyobjloader does.
+  auto emit = [&chunk](const FaceVertex& v) {
+    for (int a = 0; a < 3; a++) {
+      if (v.relative & (1 << a))
+        chunk.relative.push_back(chunk.indices.size() * 3 + a);
+    }
+    chunk.indices.push_back(v.index);
+  };
+  for (size_t k = 2; k < face.size(); k++) {
+    emit(face[0]);
+    emit(face[k - 1]);
+    emit(face[k]);
+  }
+}
+
+void ParseChunk(Chunk& chunk) {
+  std::vector<FaceVertex> face;
+  const char* p = chunk.begin;
+  const char* end = chunk.end;
+  while (p < end) {
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (!eol)
+      eol = end;
+    const char* line_end = eol;
+    if (line_end > p && line_end[-1] == '\r')
+      line_end--;
+
+    p = SkipSpace(p, line_end);
+    if (line_end - p >= 2) {
+      if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+        ParseFloats(p + 2, line_end, 3, chunk.positions);
+      } else if (p[0] == 'v' && p[1] == 'n' && line_end - p >= 3 &&
+                 (p[2] == ' ' || p[2] == '\t')) {
+        ParseFloats(p + 3, line_end, 3, chunk.normals);
+      } else if (p[0] == 'v' && p[1] == 't' && line_end - p >= 3 &&
+                 (p[2] == ' ' || p[2] == '\t')) {
+        ParseFloats(p + 3, line_end, 2, chunk.texcoords);
+      } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+        ParseFace(p + 2, line_end, chunk, face);
+      }
+    }
+    p = eol + 1;
+  }
+}
+
+// Runs `fn(i)` for each i in [0, count) on its own thread.
+template <typename Fn>
+void ParallelFor(size_t count, Fn fn) {
+  if (count == 1) {
+    fn(0);
+    return;
+  }
+  std::vector<std::thread> threads;
+  threads.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    threads.emplace_back(fn, i);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace
+
+bool ParseOBJ(const std::string& path, ObjData& out_data,
+              unsigned num_threads) {
+  auto file = util::MappedFile::Open(path);
+  if (!file) {
+    std::cerr << "[obj] Failed to open " << path << std::endl;
+    return false;
+  }
+
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  const char* data = static_cast<const char*>(file->data());
+  const size_t size = file->size();
+  const size_t num_chunks =
+    std::max<size_t>(std::min<size_t>(num_threads, size / MIN_CHUNK_SIZE), 1);
+
+  // Split into roughly equal ranges, moving each boundary past the end of
+  // the line it falls within.
+  std::vector<Chunk> chunks(num_chunks);
+  const char* begin = data;
+  for (size_t i = 0; i < num_chunks; i++) {
+    const char* end = data + size;
+    if (i + 1 < num_chunks) {
+      end = std::max(begin, data + size * (i + 1) / num_chunks);
+      const char* eol = static_cast<const char*>(
+          memchr(end, '\n', data + size - end));
+      end = eol ? eol + 1 : data + size;
+    }
+    chunks[i].begin = begin;
+    chunks[i].end = end;
+    begin = end;
+  }
+
+  ParallelFor(num_chunks, [&chunks](size_t i) { ParseChunk(chunks[i]); });
+
+  // Prefix sums of each chunk's attribute counts give the offsets into the
+  // merged arrays.
+  std::vector<size_t> position_base(num_chunks + 1, 0);
+  std::vector<size_t> normal_base(num_chunks + 1, 0);
+  std::vector<size_t> texcoord_base(num_chunks + 1, 0);
+  std::vector<size_t> index_base(num_chunks + 1, 0);
+  for (size_t i = 0; i < num_chunks; i++) {
+    position_base[i + 1] = position_base[i] + chunks[i].positions.size();
+    normal_base[i + 1] = normal_base[i] + chunks[i].normals.size();
+    texcoord_base[i + 1] = texcoord_base[i] + chunks[i].texcoords.size();
+    index_base[i + 1] = index_base[i] + chunks[i].indices.size();
+  }
+
+  out_data.positions.resize(position_base[num_chunks]);
+  out_data.normals.resize(normal_base[num_chunks]);
+  out_data.texcoords.resize(texcoord_base[num_chunks]);
+  out_data.indices.resize(index_base[num_chunks]);
+
+  ParallelFor(num_chunks, [&](size_t i) {
+    Chunk& chunk = chunks[i];
+    std::copy(chunk.positions.begin(), chunk.positions.end(),
+              out_data.positions.begin() + position_base[i]);
+    std::copy(chunk.normals.begin(), chunk.normals.end(),
+              out_data.normals.begin() + normal_base[i]);
+    std::copy(chunk.texcoords.begin(), chunk.texcoords.end(),
+              out_data.texcoords.begin() + texcoord_base[i]);
+
+    ObjIndex* indices = out_data.indices.data() + index_base[i];
+    std::copy(chunk.indices.begin(), chunk.indices.end(), indices);
+    for (size_t offset : chunk.relative) {
+      ObjIndex& index = indices[offset / 3];
+      switch (offset % 3) {
+        case ATTRIB_POSITION:
+          index.position += position_base[i] / 3;
+          break;
+        case ATTRIB_TEXCOORD:
+          index.texcoord += texcoord_base[i] / 2;
+          break;
+        case ATTRIB_NORMAL:
+          index.normal += normal_base[i] / 3;
+          break;
+      }
+    }
+
+    // Release chunk memory as we go; large files have large chunks.
+    std::vector<float>().swap(chunk.positions);
+    std::vector<float>().swap(chunk.normals);
+    std::vector<float>().swap(chunk.texcoords);
+    std::vector<ObjIndex>().swap(chunk.indices);
+  });
+
+  return true;
+}
+
+}  // namespace geo
+}  // namespace quarke
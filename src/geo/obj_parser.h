@@ -0,0 +1,38 @@
+#ifndef QUARKE_SRC_GEO_OBJ_PARSER_H_
+#define QUARKE_SRC_GEO_OBJ_PARSER_H_
+
+#include <string>
+#include <vector>
+
+namespace quarke {
+namespace geo {
+
+// Zero-based indices of the attributes forming a single face vertex, or -1
+// if the attribute is absent.
+struct ObjIndex {
+  int position;
+  int texcoord;
+  int normal;
+};
+
+// The geometry of an OBJ file, with all groups flattened in file order.
+struct ObjData {
+  std::vector<float> positions; // 3 components per position
+  std::vector<float> normals; // 3 components per normal
+  std::vector<float> texcoords; // 2 components per uv coordinate
+  // Polygons are fan-triangulated; each triple of indices forms a triangle.
+  std::vector<ObjIndex> indices;
+};
+
+// Parses the OBJ file at `path`, producing the same triangulation and
+// attribute data as tinyobjloader. The file is memory-mapped and split into
+// line-aligned chunks, which are parsed on up to `num_threads` threads (or
+// one per hardware thread if zero) before being merged.
+// Materials, lines and points are ignored. Returns false on failure.
+bool ParseOBJ(const std::string& path, ObjData& out_data,
+              unsigned num_threads = 0);
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_OBJ_PARSER_H_
@@ -0,0 +1,146 @@
+#include "geo/vertex_packing.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <glm/gtc/matrix_transform.hpp>
+
+namespace quarke {
+namespace geo {
+
+VertexFormat PackedFormat(VertexFormat format) {
+  switch (format) {
+    case VertexFormat::P3N3T2:
+      return VertexFormat::P3N3T2_PACKED;
+    case VertexFormat::P3N3:
+      return VertexFormat::P3N3_PACKED;
+    case VertexFormat::P3T2:
+      return VertexFormat::P3T2_PACKED;
+    case VertexFormat::P3:
+      return VertexFormat::P3_PACKED;
+    default:
+      // Already packed.
+      return format;
+  }
+}
+
+GLushort PackHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const uint32_t float_exponent = (bits >> 23) & 0xFF;
+  uint32_t mantissa = bits & 0x7FFFFF;
+  const int32_t exponent = (int32_t) float_exponent - 127 + 15;
+
+  if (float_exponent == 0xFF) {
+    // Infinity or NaN, preserving a quiet NaN bit.
+    return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+  }
+  if (exponent >= 0x1F) {
+    // Overflow to infinity.
+    return sign | 0x7C00;
+  }
+  if (exponent <= 0) {
+    // Denormal, or underflow to zero.
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    const uint32_t shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1)
+      half++;
+    return sign | half;
+  }
+
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+  // Round to nearest; a carry correctly propagates into the exponent.
+  if (mantissa & 0x1000)
+    half++;
+  return half;
+}
+
+GLuint PackSnorm10(const glm::vec3& value) {
+  GLuint packed = 0;
+  for (int c = 0; c < 3; c++) {
+    float clamped = std::min(std::max(value[c], -1.f), 1.f);
+    int32_t component = (int32_t) std::round(clamped * 511.f);
+    packed |= ((GLuint) component & 0x3FF) << (10 * c);
+  }
+  return packed;
+}
+
+static GLushort PackUnorm16(float value) {
+  float clamped = std::min(std::max(value, 0.f), 1.f);
+  return (GLushort) std::round(clamped * 65535.f);
+}
+
+glm::mat4 DequantizeTransform(const glm::vec3& bounds_min,
+                              const glm::vec3& bounds_max) {
+  return glm::translate(glm::mat4(), bounds_min) *
+         glm::scale(glm::mat4(), bounds_max - bounds_min);
+}
+
+void PackMeshData(MeshData& data) {
+  assert(!IsPackedFormat(data.format));
+
+  const VertexFormat packed_format = PackedFormat(data.format);
+  const bool has_normals = HasNormals(data.format);
+  const bool has_texcoords = HasTexCoords(data.format);
+  const size_t num_vertices = data.num_vertices();
+  const size_t packed_size = VertexSize(packed_format);
+
+  // Flat meshes have no extent along some axis; map those to zero.
+  glm::vec3 extent = data.bounds_max - data.bounds_min;
+  glm::vec3 inv_extent;
+  for (int c = 0; c < 3; c++) {
+    inv_extent[c] = extent[c] > 0.f ? 1.f / extent[c] : 0.f;
+  }
+
+  std::vector<GLubyte> packed(num_vertices * packed_size);
+  const GLubyte* in = data.vertices.data();
+  GLubyte* out = packed.data();
+  for (size_t v = 0; v < num_vertices; v++) {
+    GLfloat position[3];
+    memcpy(position, in, sizeof(position));
+    in += sizeof(position);
+
+    GLushort packed_position[4] = { 0, 0, 0, 0 };
+    for (int c = 0; c < 3; c++) {
+      packed_position[c] =
+        PackUnorm16((position[c] - data.bounds_min[c]) * inv_extent[c]);
+    }
+    memcpy(out, packed_position, sizeof(packed_position));
+    out += sizeof(packed_position);
+
+    if (has_normals) {
+      GLfloat normal[3];
+      memcpy(normal, in, sizeof(normal));
+      in += sizeof(normal);
+
+      GLuint packed_normal = PackSnorm10(glm::vec3(normal[0], normal[1], normal[2]));
+      memcpy(out, &packed_normal, sizeof(packed_normal));
+      out += sizeof(packed_normal);
+    }
+
+    if (has_texcoords) {
+      GLfloat texcoord[2];
+      memcpy(texcoord, in, sizeof(texcoord));
+      in += sizeof(texcoord);
+
+      GLushort packed_texcoord[2] = {
+        PackHalf(texcoord[0]), PackHalf(texcoord[1])
+      };
+      memcpy(out, packed_texcoord, sizeof(packed_texcoord));
+      out += sizeof(packed_texcoord);
+    }
+  }
+  assert(out == packed.data() + packed.size());
+
+  data.format = packed_format;
+  data.vertices.swap(packed);
+}
+
+}  // namespace geo
+}  // namespace quarke
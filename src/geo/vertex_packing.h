@@ -0,0 +1,31 @@
+#ifndef QUARKE_SRC_GEO_VERTEX_PACKING_H_
+#define QUARKE_SRC_GEO_VERTEX_PACKING_H_
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "geo/mesh.h"
+
+namespace quarke {
+namespace geo {
+
+// Returns the _PACKED equivalent of a floating point vertex format.
+VertexFormat PackedFormat(VertexFormat format);
+
+// Quantizes the vertex data of `data` in place to the equivalent _PACKED
+// format. Positions are normalized to the mesh's bounds, which must be set.
+void PackMeshData(MeshData& data);
+
+// Returns the transform from packed positions in [0, 1] back to model space.
+glm::mat4 DequantizeTransform(const glm::vec3& bounds_min,
+                              const glm::vec3& bounds_max);
+
+// Converts a 32-bit float to an IEEE 754 half float, rounding to nearest.
+GLushort PackHalf(float value);
+
+// Packs a unit vector into the xyz components of GL_INT_2_10_10_10_REV.
+GLuint PackSnorm10(const glm::vec3& value);
+
+}  // namespace geo
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_GEO_VERTEX_PACKING_H_
@@ -51,6 +51,12 @@ class Material {
   virtual bool has_vertex_shader() const = 0;
   // Returns true if texture coordinates are used/required.
   virtual bool use_texture() const = 0;
+  // Returns true if meshes sharing a vertex buffer may be drawn with a single
+  // instanced draw call. Instanced shaders are built with QUARKE_INSTANCED
+  // defined, and receive the mesh color as `flat in vec4 vInstanceColor` in
+  // place of any per-mesh uniforms. {Pre,Post}DrawMesh are then called once
+  // per batch, with its first mesh.
+  virtual bool supports_instancing() const { return false; }
 };
 
 }  // namespace mat
@@ -14,7 +14,11 @@ void SolidMaterial::BuildVertexShader(std::ostream& vs) const {
 void SolidMaterial::BuildFragmentShader(std::ostream& fs) const {
   fs << "uniform vec4 solidColor;" << std::endl
      << "void material() {" << std::endl
+     << "#ifdef QUARKE_INSTANCED" << std::endl
+     << "outColor = vInstanceColor;" << std::endl
+     << "#else" << std::endl
      << "outColor = solidColor;" << std::endl
+     << "#endif" << std::endl
      << "}" << std::endl;
 }
 
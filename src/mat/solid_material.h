@@ -17,6 +17,7 @@ class SolidMaterial : public Material {
   void PreDrawMesh(const geo::Mesh& mesh) override;
   bool has_vertex_shader() const override { return false; }
   bool use_texture() const override { return false; }
+  bool supports_instancing() const override { return true; }
  private:
   GLint color_location_;
 };
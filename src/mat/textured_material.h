@@ -16,6 +16,8 @@ class TexturedMaterial : public Material {
   void BuildFragmentShader(std::ostream& fs) const override;
   bool has_vertex_shader() const override { return true; }
   bool use_texture() const override { return true; }
+  // All meshes currently share the material's texture.
+  bool supports_instancing() const override { return true; }
 
   void OnBindProgram(GLuint program) override;
   void PreDrawMesh(const geo::Mesh& mesh) override;
@@ -1,7 +0,0 @@
-#include "pipe/blend_stage.h"
-
-namespace quarke {
-namespace pipe {
-
-}  // namespace pipe
-}  // namespace quarke
@@ -1,14 +0,0 @@
-#ifndef QUARKE_SRC_PIPE_BLEND_STAGE_H_
-#define QUARKE_SRC_PIPE_BLEND_STAGE_H_
-
-namespace quarke {
-namespace pipe {
-
-class BlendStage {
-  // TODO
-};
-
-}  // namespace pipe
-}  // namespace quarke
-
-#endif  // QUARKE_SRC_PIPE_BLEND_STAGE_H_
@@ -1,5 +0,0 @@
-#include "pipe/blit_stage.h"
-
-BlitStage::Blit() {
-  // TODO
-}
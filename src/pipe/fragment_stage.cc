@@ -25,9 +25,10 @@ void main(void) {
 }
 )";
 
-std::unique_ptr<FragmentStage> FragmentStage::Create(int width, int height,
-    GLsizei num_outputs, const char* fs_source) {
-
+std::unique_ptr<FragmentStage> FragmentStage::Create(RenderTargetPool& pool,
+    int width, int height, std::vector<GLenum> formats, const char* fs_source,
+    Outputs outputs, Depth depth) {
+  const GLsizei num_outputs = formats.size();
   if (num_outputs > 4) {
     std::cerr << "Warning: attempted to create fragment stage with " << num_outputs << "outputs." << std::endl
               << "The GL spec only mandates 4 color attachments." << std::endl;
@@ -43,30 +44,27 @@ std::unique_ptr<FragmentStage> FragmentStage::Create(int width, int height,
 
   std::vector<GLuint> textures(num_outputs);
   std::vector<GLuint> buffers(num_outputs);
-  glGenTextures(num_outputs, textures.data());
-
   for (int i = 0; i < num_outputs; i++) {
-    GLuint tex = textures[i];
-    glBindTexture(GL_TEXTURE_RECTANGLE, tex);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, format(), width, height, 0,
-                 GL_RGBA, GL_FLOAT, nullptr);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, tex, 0);
     buffers[i] = GL_COLOR_ATTACHMENT0 + i;
   }
 
-  GLuint depth_tex;
-  glGenTextures(1, &depth_tex);
-  glBindTexture(GL_TEXTURE_RECTANGLE, depth_tex);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, depth_format(), width, height, 0,
-               GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_tex, 0);
-
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-    std::cerr << "[fs] Incomplete framebuffer." << std::endl;
-    glDeleteFramebuffers(1, &fbo);
-    glDeleteTextures(num_outputs, textures.data());
-    glDeleteTextures(1, &depth_tex);
-    return nullptr;
+  GLuint depth_tex = 0;
+  if (depth == DEPTH_ATTACHED)
+    depth_tex = AcquireDepth(pool, width, height);
+
+  // Completeness of external outputs is checked as they are attached.
+  if (outputs == OUTPUTS_OWNED) {
+    AcquireOutputs(pool, width, height, formats, textures);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      std::cerr << "[fs] Incomplete framebuffer." << std::endl;
+      glDeleteFramebuffers(1, &fbo);
+      for (GLuint tex : textures) {
+        pool.Release(tex);
+      }
+      if (depth_tex)
+        pool.Release(depth_tex);
+      return nullptr;
+    }
   }
 
   GLuint program;
@@ -75,33 +73,35 @@ std::unique_ptr<FragmentStage> FragmentStage::Create(int width, int height,
     return nullptr;
   }
 
-  GLuint screen_vbo;
-  glGenBuffers(1, &screen_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, screen_vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(SCREEN_VERTICES), SCREEN_VERTICES, GL_STATIC_DRAW);
-
-  GLuint screen_vao;
-  glGenVertexArrays(1, &screen_vao);
-  glBindVertexArray(screen_vao);
-  glEnableVertexAttribArray(VS_IN_POSITION_LOCATION);
-  glVertexAttribPointer(VS_IN_POSITION_LOCATION, 2, GL_FLOAT, GL_FALSE,
-                        sizeof(GLfloat) * 2, nullptr);
+  GLuint screen_vbo, screen_vao;
+  CreateScreenQuad(screen_vbo, screen_vao);
 
-  return std::make_unique<FragmentStage>(width, height, program, fbo, textures,
-                                         buffers, num_outputs, depth_tex,
-                                         screen_vbo, screen_vao);
+  return std::make_unique<FragmentStage>(pool, width, height, program, fbo,
+                                         std::move(formats), textures,
+                                         buffers, depth_tex, screen_vbo,
+                                         screen_vao, outputs);
 }
 
-FragmentStage::FragmentStage(int width, int height, GLuint program, GLuint fbo,
-                             std::vector<GLuint> textures, std::vector<GLenum> buffers,
-                             GLsizei num_outputs, GLuint depth_tex, GLuint vbo, GLuint vao)
-  : out_width_(width), out_height_(height), program_(program), fbo_(fbo)
-  , textures_(textures), buffers_(buffers), num_outputs_(num_outputs)
-  , depth_tex_(depth_tex), vbo_(vbo), vao_(vao) {
+FragmentStage::FragmentStage(RenderTargetPool& pool, int width, int height,
+                             GLuint program, GLuint fbo,
+                             std::vector<GLenum> formats,
+                             std::vector<GLuint> textures,
+                             std::vector<GLenum> buffers, GLuint depth_tex,
+                             GLuint vbo, GLuint vao, Outputs outputs)
+  : pool_(pool), out_width_(width), out_height_(height)
+  , formats_(std::move(formats)), textures_(textures), buffers_(buffers)
+  , num_outputs_(formats_.size()), outputs_(outputs), depth_tex_(depth_tex)
+  , program_(program), fbo_(fbo), vbo_(vbo), vao_(vao) {
 }
 
 FragmentStage::~FragmentStage() {
-  glDeleteTextures(num_outputs_, textures_.data());
+  if (outputs_ == OUTPUTS_OWNED) {
+    for (GLuint tex : textures_) {
+      pool_.Release(tex);
+    }
+  }
+  if (depth_tex_)
+    pool_.Release(depth_tex_);
   glDeleteVertexArrays(1, &vao_);
   glDeleteBuffers(1, &vbo_);
   glDeleteFramebuffers(1, &fbo_);
@@ -112,15 +112,46 @@ void FragmentStage::Clear(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_);
   glDrawBuffers(num_outputs_, buffers_.data());
   glClearColor(r, g, b, a);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glClear(GL_COLOR_BUFFER_BIT | (depth_tex_ ? GL_DEPTH_BUFFER_BIT : 0));
+}
+
+void FragmentStage::AcquireOutputs(RenderTargetPool& pool, int width,
+                                   int height,
+                                   const std::vector<GLenum>& formats,
+                                   std::vector<GLuint>& textures) {
+  for (size_t i = 0; i < formats.size(); i++) {
+    // Linear filtering lets readers such as the Gaussian blur merge taps.
+    textures[i] = pool.Acquire({ width, height, formats[i],
+                                 GL_TEXTURE_RECTANGLE }, GL_LINEAR);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+                         textures[i], 0);
+  }
+}
+
+GLuint FragmentStage::AcquireDepth(RenderTargetPool& pool, int width,
+                                   int height) {
+  GLuint depth_tex = pool.Acquire({ width, height, depth_format(),
+                                    GL_TEXTURE_RECTANGLE });
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_tex, 0);
+  return depth_tex;
 }
 
-void FragmentStage::Resize(int width, int height) {
-  for (auto it = textures_.begin(); it != textures_.end(); it++) {
-    glBindTexture(GL_TEXTURE_RECTANGLE, *it);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, format(), width, height, 0,
-                 GL_RGBA, GL_FLOAT, nullptr);
+void FragmentStage::SetOutputs(const GLuint* textures) {
+  assert(outputs_ == OUTPUTS_EXTERNAL);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_);
+  for (GLsizei i = 0; i < num_outputs_; i++) {
+    if (textures_[i] == textures[i])
+      continue;
+    textures_[i] = textures[i];
+    glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+                         textures[i], 0);
+  }
+#ifdef QUARKE_DEBUG
+  if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) !=
+      GL_FRAMEBUFFER_COMPLETE) {
+    std::cerr << "[fs] Incomplete framebuffer." << std::endl;
   }
+#endif  // QUARKE_DEBUG
 }
 
 void FragmentStage::Draw() {
@@ -131,6 +162,18 @@ void FragmentStage::Draw() {
   glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 }
 
+void FragmentStage::CreateScreenQuad(GLuint& out_vbo, GLuint& out_vao) {
+  glGenBuffers(1, &out_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, out_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(SCREEN_VERTICES), SCREEN_VERTICES, GL_STATIC_DRAW);
+
+  glGenVertexArrays(1, &out_vao);
+  glBindVertexArray(out_vao);
+  glEnableVertexAttribArray(VS_IN_POSITION_LOCATION);
+  glVertexAttribPointer(VS_IN_POSITION_LOCATION, 2, GL_FLOAT, GL_FALSE,
+                        sizeof(GLfloat) * 2, nullptr);
+}
+
 bool FragmentStage::BuildShaderProgram(GLuint& out_program, const char* fs_source) {
   GLuint program = glCreateProgram();
   GLint compiled;
@@ -5,30 +5,53 @@
 #include <glad/glad.h>
 #include <memory>
 #include <vector>
+#include "pipe/render_target_pool.h"
 
 namespace quarke {
 namespace pipe {
 
 // A generic shader stage that produces output textures in screen space.
-// Textures are guaranteed to be of format GL_RGBA32F, bound to GL_TEXTURE_RECTANGLE.
-// A depth buffer is present, but unused.
+// Each output has its own internal format, such as GL_R8, GL_RG16F, GL_RGBA8,
+// GL_R11F_G11F_B10F, GL_RGBA16F or GL_RGBA32F, bound to GL_TEXTURE_RECTANGLE.
+// Stages only have a depth buffer if requested.
 class FragmentStage {
  public:
-  static std::unique_ptr<FragmentStage> Create(int width, int height,
-                                               GLsizei num_outputs,
-                                               const char* fs_source);
+  enum Outputs {
+    // Output textures are allocated and owned by the stage.
+    OUTPUTS_OWNED,
+    // Output textures are provided through SetOutputs() before drawing, for
+    // instance by a RenderGraph.
+    OUTPUTS_EXTERNAL,
+  };
 
-  FragmentStage(int width, int height, GLuint program, GLuint fbo,
+  enum Depth {
+    DEPTH_NONE,
+    // A depth texture of depth_format() is allocated and owned by the stage.
+    DEPTH_ATTACHED,
+  };
+
+  // Creates a stage with an output of each of `formats`. Owned textures are
+  // acquired from `pool`, which must outlive the stage.
+  static std::unique_ptr<FragmentStage> Create(RenderTargetPool& pool,
+                                               int width, int height,
+                                               std::vector<GLenum> formats,
+                                               const char* fs_source,
+                                               Outputs outputs = OUTPUTS_OWNED,
+                                               Depth depth = DEPTH_NONE);
+
+  FragmentStage(RenderTargetPool& pool, int width, int height,
+                GLuint program, GLuint fbo, std::vector<GLenum> formats,
                 std::vector<GLuint> textures, std::vector<GLenum> buffers,
-                GLsizei num_outputs, GLuint depth_tex, GLuint vbo, GLuint vao);
+                GLuint depth_tex, GLuint vbo, GLuint vao, Outputs outputs);
   ~FragmentStage();
 
   FragmentStage(FragmentStage&&) = delete;
   FragmentStage(const FragmentStage&) = delete;
 
-  // Resizes the light buffer to the given dimensions.
-  // Implicitly clears the light buffer.
-  void Resize(int width, int height);
+  // Attaches a texture to each output of the stage, for stages created with
+  // OUTPUTS_EXTERNAL. Textures must be GL_TEXTURE_RECTANGLEs of the outputs'
+  // formats, and outlive their use.
+  void SetOutputs(const GLuint* textures);
 
   void Clear(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
 
@@ -41,21 +64,34 @@ class FragmentStage {
     assert(idx >= 0 && idx < GL_MAX_COLOR_ATTACHMENTS);
     return textures_[idx];
   }
+  // Zero for stages created with DEPTH_NONE.
   GLuint depth_tex() { return depth_tex_; }
-  static GLuint format() { return GL_RGBA32F; }
-  static GLuint depth_format() { return GL_DEPTH_COMPONENT; }
+  GLenum format(GLsizei idx) const { return formats_[idx]; }
+  static GLenum depth_format() { return GL_DEPTH_COMPONENT24; }
 
  private:
   static bool BuildShaderProgram(GLuint& out_program, const char* fs_source);
+  // Creates the vertex buffer and array of a quad covering the screen.
+  static void CreateScreenQuad(GLuint& out_vbo, GLuint& out_vao);
+  // Acquires a texture of each of `formats` from `pool`, attaching them to
+  // the bound framebuffer as outputs.
+  static void AcquireOutputs(RenderTargetPool& pool, int width, int height,
+                             const std::vector<GLenum>& formats,
+                             std::vector<GLuint>& textures);
+  // Acquires a depth texture, attaching it to the bound framebuffer.
+  static GLuint AcquireDepth(RenderTargetPool& pool, int width, int height);
 
+  RenderTargetPool& pool_;
   int out_width_;
   int out_height_;
 
+  const std::vector<GLenum> formats_;
   std::vector<GLuint> textures_;
   std::vector<GLenum> buffers_;
   GLsizei num_outputs_;
+  const Outputs outputs_;
 
-  const GLuint depth_tex_;
+  GLuint depth_tex_;
   const GLuint program_;
   const GLuint fbo_;
   const GLuint vbo_;
@@ -1,59 +1,119 @@
 #include "pipe/gaussian_stage.h"
+#include <algorithm>
+#include <cmath>
 
 namespace quarke {
 namespace pipe {
 
+// The tap arrays hold the center tap and up to GaussianStage::MAX_TAPS more.
 static const char* FS_SOURCE = R"(
 #version 330 core
 
 uniform sampler2DRect tex;
-uniform float sigma;
+uniform vec2 direction; // unit step along the blurred axis
+uniform int num_taps;
+// taps on either side of the center, the first being the center itself
+uniform float weights[17];
+uniform float offsets[17];
 
 layout(location = 0) out vec4 out_color;
 
 void main(void) {
-  int size = int(floor(3.0 * sigma));
-  vec4 value = vec4(0.0, 0.0, 0.0, 0.0);
-  float d = 2.0 * pow(sigma, 2.0);
-  // TODO: abuse separability of gaussian.
-  //       alternatively, use preconstructed convolution filter.
-  //       tradeoff between time and space, as usual.
-  float sum = 0.0;
-  for (int y = -size; y <= size; y++) {
-    for (int x = -size; x <= size; x++) {
-      float weight = exp(-((pow(x, 2.0) / d) + (pow(y, 2.0) / d)));
-      value += weight * texture(tex, vec2(x, y) + gl_FragCoord.xy);
-      sum += weight;
-    }
+  vec4 value = weights[0] * texture(tex, gl_FragCoord.xy);
+  for (int i = 1; i < num_taps; i++) {
+    vec2 offset = offsets[i] * direction;
+    value += weights[i] * (texture(tex, gl_FragCoord.xy + offset) +
+                           texture(tex, gl_FragCoord.xy - offset));
   }
-  out_color = value / sum; // normalize
+  out_color = value;
 }
 )";
 
-std::unique_ptr<GaussianStage> GaussianStage::Create(int width, int height) {
-  auto fstage = FragmentStage::Create(width, height, 1, FS_SOURCE);
-  if (!fstage) {
+std::unique_ptr<GaussianStage> GaussianStage::Create(RenderTargetPool& pool,
+                                                     int width, int height,
+                                                     GLenum format) {
+  auto horizontal = FragmentStage::Create(pool, width, height, { format },
+                                          FS_SOURCE);
+  auto vertical = FragmentStage::Create(pool, width, height, { format },
+                                        FS_SOURCE);
+  if (!horizontal || !vertical) {
     return nullptr;
   }
-  return std::make_unique<GaussianStage>(std::move(fstage));
+  return std::make_unique<GaussianStage>(std::move(horizontal),
+                                         std::move(vertical));
 }
 
-GaussianStage::GaussianStage(std::unique_ptr<FragmentStage> fstage)
-  : fstage_(std::move(fstage)) {
-  uniform_texture_ = glGetUniformLocation(fstage_->program(), "tex");
-  uniform_sigma_ = glGetUniformLocation(fstage_->program(), "sigma");
+GaussianStage::GaussianStage(std::unique_ptr<FragmentStage> horizontal,
+                             std::unique_ptr<FragmentStage> vertical)
+  : sigma_(-1.f) {
+  passes_[HORIZONTAL].fstage = std::move(horizontal);
+  passes_[VERTICAL].fstage = std::move(vertical);
+  for (Pass& pass : passes_) {
+    GLuint program = pass.fstage->program();
+    pass.uniform_texture = glGetUniformLocation(program, "tex");
+    pass.uniform_direction = glGetUniformLocation(program, "direction");
+    pass.uniform_num_taps = glGetUniformLocation(program, "num_taps");
+    pass.uniform_weights = glGetUniformLocation(program, "weights");
+    pass.uniform_offsets = glGetUniformLocation(program, "offsets");
+  }
+}
+
+void GaussianStage::ComputeTaps(GLfloat sigma) {
+  sigma_ = sigma;
+  const int radius = std::max(
+      std::min((int) std::ceil(3.f * sigma), 2 * MAX_TAPS), 0);
+
+  // Discrete weights of texels 0 to radius away from the center.
+  std::vector<GLfloat> texels(radius + 1);
+  texels[0] = 1.f;
+  GLfloat sum = 1.f;
+  for (int i = 1; i <= radius; i++) {
+    texels[i] = std::exp(-(i * i) / (2.f * sigma * sigma));
+    sum += 2.f * texels[i];
+  }
+
+  // Merge texel pairs (1, 2), (3, 4), ... into a single fetch, placed between
+  // them such that linear filtering reproduces both weights.
+  weights_.assign(1, texels[0] / sum);
+  offsets_.assign(1, 0.f);
+  for (int i = 1; i <= radius; i += 2) {
+    const GLfloat w0 = texels[i];
+    const GLfloat w1 = i + 1 <= radius ? texels[i + 1] : 0.f;
+    // Weights only decrease from here, so once they underflow, as they do
+    // for small sigmas, the remaining taps would contribute nothing.
+    if (w0 + w1 == 0.f)
+      break;
+    weights_.push_back((w0 + w1) / sum);
+    offsets_.push_back((i * w0 + (i + 1) * w1) / (w0 + w1));
+  }
 }
 
 void GaussianStage::Render(GLuint texture, GLfloat sigma) {
-  glUseProgram(fstage_->program());
-  glUniform1f(uniform_sigma_, sigma);
+  if (sigma != sigma_)
+    ComputeTaps(sigma);
+
+  DrawPass(passes_[HORIZONTAL], texture, HORIZONTAL);
+  DrawPass(passes_[VERTICAL], passes_[HORIZONTAL].fstage->texture(0),
+           VERTICAL);
+}
+
+void GaussianStage::DrawPass(Pass& pass, GLuint texture, Direction direction) {
+  glUseProgram(pass.fstage->program());
+  glUniform2f(pass.uniform_direction, direction == HORIZONTAL ? 1.f : 0.f,
+              direction == VERTICAL ? 1.f : 0.f);
+  glUniform1i(pass.uniform_num_taps, weights_.size());
+  glUniform1fv(pass.uniform_weights, weights_.size(), weights_.data());
+  glUniform1fv(pass.uniform_offsets, offsets_.size(), offsets_.data());
 
   glActiveTexture(GL_TEXTURE0);
   glBindTexture(GL_TEXTURE_RECTANGLE, texture);
-  glUniform1i(uniform_sigma_, 0);
+  // Merged taps fetch between texels, and rely on bilinear filtering.
+  glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glUniform1i(pass.uniform_texture, 0);
 
-  fstage_->Clear(0.f, 0.f, 0.f, 0.f);
-  fstage_->Draw();
+  pass.fstage->Clear(0.f, 0.f, 0.f, 0.f);
+  pass.fstage->Draw();
 }
 
 }  // namespace pipe
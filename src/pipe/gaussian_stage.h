@@ -1,6 +1,7 @@
 #ifndef QUARKE_SRC_PIPE_GAUSSIAN_STAGE_H_
 #define QUARKE_SRC_PIPE_GAUSSIAN_STAGE_H_
 
+#include <vector>
 #include "pipe/fragment_stage.h"
 
 namespace quarke {
@@ -8,21 +9,59 @@ namespace pipe {
 
 // A fragment stage applying a parametrically discretized gaussian to an RGBA
 // texture. The 2D gaussian convolution encapsulates 99.7% (3σ) of the data.
+//
+// The gaussian is separated into a horizontal and a vertical pass, each
+// rendered by its own fragment stage. Weights are computed on the CPU, and
+// adjacent taps are merged into a single bilinear fetch between them.
 class GaussianStage {
  public:
-  static std::unique_ptr<GaussianStage> Create(int width, int height);
+  // Creates a stage blurring textures of `format` into textures of the same
+  // format.
+  static std::unique_ptr<GaussianStage> Create(RenderTargetPool& pool,
+                                               int width, int height,
+                                               GLenum format);
 
-  GaussianStage(std::unique_ptr<FragmentStage> fstage);
+  GaussianStage(std::unique_ptr<FragmentStage> horizontal,
+                std::unique_ptr<FragmentStage> vertical);
 
+  // Blurs `texture` into tex(). The texture is switched to linear filtering.
+  // Kernels are truncated beyond a 3σ radius of 2 * MAX_TAPS texels.
   void Render(GLuint texture, GLfloat sigma);
 
-  GLuint fbo() const { return fstage_->fbo(); }
+  GLuint fbo() const { return passes_[VERTICAL].fstage->fbo(); }
   GLuint buffer() const { return GL_COLOR_ATTACHMENT0; }
-  GLuint tex() const { return fstage_->texture(0); }
+  GLuint tex() const { return passes_[VERTICAL].fstage->texture(0); }
+
+  // Maximum number of fetches on either side of the center, per pass.
+  static const int MAX_TAPS = 16;
  private:
-  std::unique_ptr<FragmentStage> fstage_;
-  GLint uniform_texture_;
-  GLint uniform_sigma_;
+  enum Direction {
+    HORIZONTAL = 0,
+    VERTICAL,
+    NUM_PASSES
+  };
+
+  struct Pass {
+    std::unique_ptr<FragmentStage> fstage;
+    GLint uniform_texture;
+    GLint uniform_direction;
+    GLint uniform_num_taps;
+    GLint uniform_weights;
+    GLint uniform_offsets;
+  };
+
+  // Recomputes the merged taps of a gaussian with the given sigma.
+  void ComputeTaps(GLfloat sigma);
+
+  // Convolves `texture` along `direction` into the pass's output.
+  void DrawPass(Pass& pass, GLuint texture, Direction direction);
+
+  Pass passes_[NUM_PASSES];
+
+  // Taps of the current kernel, the first being the center texel.
+  GLfloat sigma_;
+  std::vector<GLfloat> weights_;
+  std::vector<GLfloat> offsets_;
 };
 
 }  // namespace pipe
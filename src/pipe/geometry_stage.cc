@@ -1,8 +1,14 @@
 #include "pipe/geometry_stage.h"
 #include "mat/material.h"
 #include "game/camera.h"
+#include "geo/frustum.h"
 #include "geo/mesh.h"
+#include "pipe/occlusion_culler.h"
+#include "util/matrix_batch.h"
+#include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <cstddef>
 #include <iostream>
 #include <sstream>
 
@@ -11,6 +17,7 @@ namespace pipe {
 
 static const char* UNIFORM_MODEL_MATRIX_NAME = "model_matrix";
 static const char* UNIFORM_MVP_MATRIX_NAME = "mvp_matrix";
+static const char* UNIFORM_VP_MATRIX_NAME = "vp_matrix";
 static const char* UNIFORM_NORMAL_MATRIX_NAME = "normal_matrix";
 static const char* UNIFORM_SAMPLER_MATRIX_NAME = "sampler";
 
@@ -18,81 +25,260 @@ static const GLuint FS_OUT_COLOR_BUFFER = 0;
 static const GLuint FS_OUT_NORMAL_BUFFER = 1;
 static const GLuint FS_OUT_POSITION_BUFFER = 2;
 
-std::unique_ptr<GeometryStage> GeometryStage::Create(int width, int height) {
+static const char* NORMAL_DECODE_SOURCE = R"(
+#ifdef GBUFFER_COMPACT
+// octahedral decoding, see GeometryStage::BuildFragmentShader()
+vec3 decodeNormal(vec4 texel) {
+  vec3 n = vec3(texel.xy, 1.0 - abs(texel.x) - abs(texel.y));
+  if (n.z < 0.0) {
+    n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0,
+                                    n.y >= 0.0 ? 1.0 : -1.0);
+  }
+  return normalize(n);
+}
+#else
+vec3 decodeNormal(vec4 texel) {
+  return texel.xyz;
+}
+#endif
+)";
+
+// Triangles of the unit cube [0, 1]^3, for occlusion queries.
+static const GLfloat BOX_VERTICES[] = {
+  0, 0, 0,  1, 0, 0,  1, 1, 0,  0, 0, 0,  1, 1, 0,  0, 1, 0, // -z
+  0, 0, 1,  1, 1, 1,  1, 0, 1,  0, 0, 1,  0, 1, 1,  1, 1, 1, // +z
+  0, 0, 0,  0, 1, 1,  0, 0, 1,  0, 0, 0,  0, 1, 0,  0, 1, 1, // -x
+  1, 0, 0,  1, 0, 1,  1, 1, 1,  1, 0, 0,  1, 1, 1,  1, 1, 0, // +x
+  0, 0, 0,  0, 0, 1,  1, 0, 1,  0, 0, 0,  1, 0, 1,  1, 0, 0, // -y
+  0, 1, 0,  1, 1, 1,  0, 1, 1,  0, 1, 0,  1, 1, 0,  1, 1, 1, // +y
+};
+
+static const char* BOX_VS_SOURCE = R"(
+#version 330 core
+
+uniform mat4 mvp_matrix;
+
+layout(location = 0) in vec3 position;
+
+void main(void) {
+  gl_Position = mvp_matrix * vec4(position, 1.0);
+}
+)";
+
+// Only depth testing matters, with color writes masked off.
+static const char* BOX_FS_SOURCE = R"(
+#version 330 core
+
+void main(void) {}
+)";
+
+// Builds the program drawing bounding boxes for occlusion queries.
+// Returns 0 on failure.
+static GLuint BuildBoxProgram() {
+  GLint status;
+  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vs, 1, &BOX_VS_SOURCE, nullptr);
+  glCompileShader(vs);
+  glGetShaderiv(vs, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    std::cerr << "[gs] failed to compile box vertex shader!" << std::endl;
+    glDeleteShader(vs);
+    return 0;
+  }
+
+  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fs, 1, &BOX_FS_SOURCE, nullptr);
+  glCompileShader(fs);
+  glGetShaderiv(fs, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    std::cerr << "[gs] failed to compile box fragment shader!" << std::endl;
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    return 0;
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  glDetachShader(program, vs);
+  glDetachShader(program, fs);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status) {
+    std::cerr << "[gs] failed to link box program!" << std::endl;
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+// Returns true if `point` lies within `margin` of `box`.
+static bool Contains(const geo::AABB& box, const glm::vec3& point,
+                     float margin) {
+  for (int i = 0; i < 3; i++) {
+    if (point[i] < box.min[i] - margin || point[i] > box.max[i] + margin)
+      return false;
+  }
+  return true;
+}
+
+// Per-instance attribute locations, following the per-vertex attributes.
+// Matrices occupy one location per column.
+static const GLuint VS_ATTRIB_INSTANCE_MODEL_MATRIX = 3;
+static const GLuint VS_ATTRIB_INSTANCE_NORMAL_MATRIX = 7;
+static const GLuint VS_ATTRIB_INSTANCE_COLOR = 11;
+
+std::unique_ptr<GeometryStage> GeometryStage::Create(RenderTargetPool& pool,
+                                                     int width, int height,
+                                                     Layout layout) {
   GLuint fbo;
   glGenFramebuffers(1, &fbo);
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 
-  GLuint color_tex;
-  glGenTextures(1, &color_tex);
-  glBindTexture(GL_TEXTURE_RECTANGLE, color_tex);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, color_format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
+  GLuint color_tex, normal_tex, position_tex, depth_tex;
+  AcquireTargets(pool, width, height, layout, color_tex, normal_tex,
+                 position_tex, depth_tex);
+
+  auto release_targets = [&]() {
+    glDeleteFramebuffers(1, &fbo);
+    pool.Release(color_tex);
+    pool.Release(normal_tex);
+    if (position_tex)
+      pool.Release(position_tex);
+    pool.Release(depth_tex);
+  };
+
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cerr << "[gs] Incomplete framebuffer." << std::endl;
+    release_targets();
+    return nullptr;
+  }
+
+  GLuint box_program = BuildBoxProgram();
+  if (!box_program) {
+    release_targets();
+    return nullptr;
+  }
+
+  GLuint box_vbo;
+  glGenBuffers(1, &box_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, box_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(BOX_VERTICES), BOX_VERTICES,
+               GL_STATIC_DRAW);
+
+  GLuint box_vao;
+  glGenVertexArrays(1, &box_vao);
+  glBindVertexArray(box_vao);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 3,
+                        nullptr);
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  GLuint instance_buffer;
+  glGenBuffers(1, &instance_buffer);
+
+  return std::make_unique<GeometryStage>(pool, width, height, layout, fbo,
+                                         color_tex, normal_tex, position_tex,
+                                         depth_tex, instance_buffer,
+                                         box_program, box_vao);
+}
+
+GeometryStage::GeometryStage(RenderTargetPool& pool, int width, int height,
+                             Layout layout, GLuint fbo, GLuint color_tex,
+                             GLuint normal_tex, GLuint position_tex,
+                             GLuint depth_tex, GLuint instance_buffer,
+                             GLuint box_program, GLuint box_vao)
+  : pool_(pool), layout_(layout), fbo_(fbo), color_tex_(color_tex)
+  , normal_tex_(normal_tex), position_tex_(position_tex), depth_tex_(depth_tex)
+  , instance_buffer_(instance_buffer), box_program_(box_program)
+  , box_vao_(box_vao), occlusion_culler_(nullptr), cull_stats_()
+  , out_width_(width), out_height_(height) {
+  uniform_box_mvp_ = glGetUniformLocation(box_program_, "mvp_matrix");
+}
+
+GeometryStage::~GeometryStage() {
+  ReleaseTargets();
+  for (const auto& entry : shader_cache_) {
+    glDeleteProgram(entry.second);
+  }
+  if (!queries_.empty())
+    glDeleteQueries(queries_.size(), queries_.data());
+  glDeleteVertexArrays(1, &box_vao_);
+  glDeleteProgram(box_program_);
+  glDeleteBuffers(1, &instance_buffer_);
+  glDeleteFramebuffers(1, &fbo_);
+}
+
+/* static */
+void GeometryStage::AcquireTargets(RenderTargetPool& pool, int width,
+                                   int height, Layout layout,
+                                   GLuint& color_tex, GLuint& normal_tex,
+                                   GLuint& position_tex, GLuint& depth_tex) {
+  color_tex = pool.Acquire({ width, height, color_format(layout),
+                             GL_TEXTURE_RECTANGLE });
   glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, color_tex, 0);
 
-  GLuint normal_tex;
-  glGenTextures(1, &normal_tex);
-  glBindTexture(GL_TEXTURE_RECTANGLE, normal_tex);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, normal_format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
+  normal_tex = pool.Acquire({ width, height, normal_format(layout),
+                              GL_TEXTURE_RECTANGLE });
   glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, normal_tex, 0);
 
-  GLuint position_tex;
-  glGenTextures(1, &position_tex);
-  glBindTexture(GL_TEXTURE_RECTANGLE, position_tex);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, position_format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
+  position_tex = 0;
+  if (layout == LAYOUT_FULL) {
+    position_tex = pool.Acquire({ width, height, position_format(),
+                                  GL_TEXTURE_RECTANGLE });
+  }
   glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, position_tex, 0);
 
-  GLuint depth_tex;
-  glGenTextures(1, &depth_tex);
-  glBindTexture(GL_TEXTURE_2D, depth_tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, depth_format(), width, height, 0,
-               GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_tex, 0);
+  // Sampled by texel, which the pool's nearest filtering suits.
+  depth_tex = pool.Acquire({ width, height, depth_format(), GL_TEXTURE_2D });
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, depth_tex,
+                       0);
+}
 
-  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-    std::cerr << "[gs] Incomplete framebuffer." << std::endl;
-    glDeleteFramebuffers(1, &fbo);
-    glDeleteTextures(1, &color_tex);
-    glDeleteTextures(1, &normal_tex);
-    glDeleteTextures(1, &position_tex);
-    glDeleteTextures(1, &depth_tex);
-    return nullptr;
-  }
+void GeometryStage::ReleaseTargets() {
+  pool_.Release(color_tex_);
+  pool_.Release(normal_tex_);
+  if (position_tex_)
+    pool_.Release(position_tex_);
+  pool_.Release(depth_tex_);
+}
 
-  return std::make_unique<GeometryStage>(width, height, fbo, color_tex,
-                                         normal_tex, position_tex, depth_tex);
+/* static */
+const char* GeometryStage::layout_defines(Layout layout) {
+  return layout == LAYOUT_COMPACT ? "#define GBUFFER_COMPACT\n" : "";
 }
 
-GeometryStage::GeometryStage(int width, int height, GLuint fbo,
-                             GLuint color_tex, GLuint normal_tex,
-                             GLuint position_tex, GLuint depth_tex)
-  : out_width_(width), out_height_(height), fbo_(fbo), color_tex_(color_tex)
-  , position_tex_(position_tex), normal_tex_(normal_tex), depth_tex_(depth_tex)
-{}
+/* static */
+const char* GeometryStage::normal_decode_source() {
+  return NORMAL_DECODE_SOURCE;
+}
 
 void GeometryStage::Clear() {
   // TODO: scoped framebuffer state
   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo_);
-  glDrawBuffers(3, (const GLenum[]) { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2});
+  // Naming an empty attachment leaves the framebuffer incomplete in GL 3.3.
+  const GLenum buffers[] = {
+    GL_COLOR_ATTACHMENT0,
+    GL_COLOR_ATTACHMENT1,
+    position_tex_ ? GL_COLOR_ATTACHMENT2 : (GLenum) GL_NONE
+  };
+  glDrawBuffers(3, buffers);
   glClearColor(0.0, 0.0, 0.0, 0.0);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glClearStencil(0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 }
 
 void GeometryStage::SetOutputSize(int width, int height) {
   out_width_ = width;
   out_height_ = height;
 
-  glBindTexture(GL_TEXTURE_RECTANGLE, color_tex_);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, color_format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
-  glBindTexture(GL_TEXTURE_RECTANGLE, normal_tex_);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, normal_format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
-  glBindTexture(GL_TEXTURE_2D, depth_tex_);
-  glTexImage2D(GL_TEXTURE_2D, 0, depth_format(), width, height, 0,
-               GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+  ReleaseTargets();
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+  AcquireTargets(pool_, width, height, layout_, color_tex_, normal_tex_,
+                 position_tex_, depth_tex_);
 }
 
 void GeometryStage::Render(const game::Camera& camera, MaterialIterator& iter,
@@ -118,77 +304,298 @@ void GeometryStage::Render(const game::Camera& camera, MaterialIterator& iter,
   const GLenum buffers[] = {
     color ? GL_COLOR_ATTACHMENT0 : (GLenum) GL_NONE,
     normal ? GL_COLOR_ATTACHMENT1 : (GLenum) GL_NONE,
-    position ? GL_COLOR_ATTACHMENT2 : (GLenum) GL_NONE
+    position && position_tex_ ? GL_COLOR_ATTACHMENT2 : (GLenum) GL_NONE
   };
   glDrawBuffers(3, buffers);
 
   glm::mat4 vp_matrix = camera.ComputeProjection();
   glm::mat4 view_matrix = camera.ComputeView();
+  const geo::Frustum frustum(vp_matrix);
+  const glm::vec3 eye = camera.Position();
+  cull_stats_ = { 0, 0, 0 };
+  occluded_.clear();
 
   MaterialMeshIterator* mit = nullptr;
   while ((mit = iter.NextMaterial()) != nullptr) {
+    GatherVisible(*mit, frustum, eye, camera.z_near());
+    if (batch_meshes_.empty())
+      continue;
+
     // FIXME: should we be using a pointer to index materials?
     mat::Material* mat = mit->Material();
-    auto cache_it = shader_cache_.find(mat);
-    GLuint program;
-    if (cache_it == shader_cache_.end()) {
-      // Construct a new shader for `mat`.
-      program = glCreateProgram();
-      GLuint vs = BuildVertexShader(*mat);
-      GLuint fs = BuildFragmentShader(*mat);
-      glAttachShader(program, vs);
-      glAttachShader(program, fs);
-      glLinkProgram(program);
-      shader_cache_[mat] = program;
-
-      // TODO: check for errors generated here.
-      //       we should also clean up unused material shaders after a few
-      //       idle passes. but hey, we have like no materials so life's good.
-    } else {
-      program = cache_it->second;
-    }
-
+    GLuint program = GetProgram(mat);
     glUseProgram(program);
 
     mat->OnBindProgram(program);
+    RenderBatch(program, mat, vp_matrix);
+    mat->OnUnbindProgram(program);
+  }
 
-    GLuint model_location = glGetUniformLocation(program, UNIFORM_MODEL_MATRIX_NAME);
-    GLuint mvp_location = glGetUniformLocation(program, UNIFORM_MVP_MATRIX_NAME);
-    GLuint normal_matrix_location = glGetUniformLocation(program, UNIFORM_NORMAL_MATRIX_NAME);
+  RenderOccluded(vp_matrix);
+}
 
-    const geo::Mesh* mesh = nullptr;
-    while ((mesh = mit->Next()) != nullptr) {
-      geo::VertexBuffer& vb = mesh->array_buffer();
-      glBindVertexArray(vb.vertex_array());
+GLuint GeometryStage::GetProgram(mat::Material* mat) {
+  auto cache_it = shader_cache_.find(mat);
+  if (cache_it != shader_cache_.end())
+    return cache_it->second;
+
+  // Construct a new shader for `mat`.
+  GLuint program = glCreateProgram();
+  GLuint vs = BuildVertexShader(*mat);
+  GLuint fs = BuildFragmentShader(*mat);
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  shader_cache_[mat] = program;
+
+  // TODO: check for errors generated here.
+  //       we should also clean up unused material shaders after a few
+  //       idle passes. but hey, we have like no materials so life's good.
+  return program;
+}
 
-      glm::mat4 model_matrix = mesh->transform();
-      glUniformMatrix4fv(model_location, 1, GL_FALSE, glm::value_ptr(model_matrix));
-      glm::mat4 mvp_matrix = vp_matrix * mesh->transform();
-      glUniformMatrix4fv(mvp_location, 1, GL_FALSE, glm::value_ptr(mvp_matrix));
-      glm::mat4 normal_matrix = glm::transpose(glm::inverse(mesh->transform()));
-      glUniformMatrix4fv(normal_matrix_location, 1, GL_FALSE, glm::value_ptr(normal_matrix));
+void GeometryStage::RenderBatch(GLuint program, mat::Material* mat,
+                                const glm::mat4& vp_matrix) {
+  if (mat->supports_instancing()) {
+    RenderInstanced(program, mat, vp_matrix);
+  } else {
+    RenderMeshes(program, mat, vp_matrix);
+  }
+}
 
-      mat->PreDrawMesh(*mesh); // setup per-mesh uniform attributes
+void GeometryStage::RenderOccluded(const glm::mat4& vp_matrix) {
+  if (occluded_.empty())
+    return;
 
-      glDisable(GL_BLEND);
-      glDrawArrays(GL_TRIANGLES, 0, mesh->num_vertices());
+  if (queries_.size() < occluded_.size()) {
+    const size_t first = queries_.size();
+    queries_.resize(occluded_.size());
+    glGenQueries(queries_.size() - first, &queries_[first]);
+  }
 
-      mat->PostDrawMesh(*mesh);
+  // Test all boxes up front, so that queries are likely to have completed
+  // by the time their meshes are drawn.
+  glUseProgram(box_program_);
+  glBindVertexArray(box_vao_);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  glDepthMask(GL_FALSE);
+  for (size_t i = 0; i < occluded_.size(); i++) {
+    const geo::AABB& box = occluded_[i].mesh->world_bounds();
+    const glm::mat4 mvp = vp_matrix *
+        glm::scale(glm::translate(glm::mat4(), box.min), box.max - box.min);
+    glUniformMatrix4fv(uniform_box_mvp_, 1, GL_FALSE, glm::value_ptr(mvp));
+    glBeginQuery(GL_ANY_SAMPLES_PASSED, queries_[i]);
+    glDrawArrays(GL_TRIANGLES, 0, 36);
+    glEndQuery(GL_ANY_SAMPLES_PASSED);
+  }
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glDepthMask(GL_TRUE);
+
+  // occluded_ was gathered in material order.
+  size_t begin = 0;
+  while (begin < occluded_.size()) {
+    mat::Material* mat = occluded_[begin].material;
+    GLuint program = GetProgram(mat);
+    glUseProgram(program);
+    mat->OnBindProgram(program);
+
+    size_t end = begin;
+    for (; end < occluded_.size() && occluded_[end].material == mat; end++) {
+      batch_meshes_.assign(1, occluded_[end].mesh);
+      glBeginConditionalRender(queries_[end], GL_QUERY_WAIT);
+      RenderBatch(program, mat, vp_matrix);
+      glEndConditionalRender();
     }
 
     mat->OnUnbindProgram(program);
+    begin = end;
+  }
+}
+
+void GeometryStage::GatherVisible(MaterialMeshIterator& mit,
+                                  const geo::Frustum& frustum,
+                                  const glm::vec3& eye, float near) {
+  all_meshes_.clear();
+  spheres_.clear();
+  const geo::Mesh* mesh = nullptr;
+  while ((mesh = mit.Next()) != nullptr) {
+    all_meshes_.push_back(mesh);
+    spheres_.push_back(mesh->world_bounding_sphere());
+  }
+
+  visible_.resize(all_meshes_.size());
+  const size_t num_visible = frustum.CullSpheres(spheres_.data(),
+                                                 spheres_.size(),
+                                                 visible_.data());
+  cull_stats_.drawn += num_visible;
+  cull_stats_.culled += all_meshes_.size() - num_visible;
+
+  batch_meshes_.clear();
+  for (size_t i = 0; i < all_meshes_.size(); i++) {
+    if (!visible_[i])
+      continue;
+    const geo::Mesh* mesh = all_meshes_[i];
+    if (occlusion_culler_) {
+      const geo::AABB& box = mesh->world_bounds();
+      if (!Contains(box, eye, near) && occlusion_culler_->IsOccluded(box)) {
+        occluded_.push_back({ mesh, mit.Material() });
+        cull_stats_.drawn--;
+        cull_stats_.tested++;
+        continue;
+      }
+    }
+    batch_meshes_.push_back(mesh);
   }
 }
 
+void GeometryStage::RenderMeshes(GLuint program, mat::Material* mat,
+                                 const glm::mat4& vp_matrix) {
+  GLuint model_location = glGetUniformLocation(program, UNIFORM_MODEL_MATRIX_NAME);
+  GLuint mvp_location = glGetUniformLocation(program, UNIFORM_MVP_MATRIX_NAME);
+  GLuint normal_matrix_location = glGetUniformLocation(program, UNIFORM_NORMAL_MATRIX_NAME);
+
+  // Compute all MVPs for the material up front in a single batch.
+  mvp_matrices_.clear();
+  for (const geo::Mesh* mesh : batch_meshes_) {
+    mvp_matrices_.push_back(mesh->model_matrix());
+  }
+  util::MultiplyMatrices(vp_matrix, mvp_matrices_.data(), mvp_matrices_.data(),
+                         mvp_matrices_.size());
+
+  for (size_t i = 0; i < batch_meshes_.size(); i++) {
+    const geo::Mesh* mesh = batch_meshes_[i];
+    geo::VertexBuffer& vb = mesh->array_buffer();
+    glBindVertexArray(vb.vertex_array());
+
+    // The model matrix includes dequantization of packed positions, which
+    // mustn't affect normals.
+    glUniformMatrix4fv(model_location, 1, GL_FALSE, glm::value_ptr(mesh->model_matrix()));
+    glUniformMatrix4fv(mvp_location, 1, GL_FALSE, glm::value_ptr(mvp_matrices_[i]));
+    glUniformMatrix4fv(normal_matrix_location, 1, GL_FALSE, glm::value_ptr(mesh->normal_matrix()));
+
+    mat->PreDrawMesh(*mesh); // setup per-mesh uniform attributes
+
+    glDisable(GL_BLEND);
+    glDrawElements(GL_TRIANGLES, mesh->num_indices(), vb.index_type(),
+                   nullptr);
+
+    mat->PostDrawMesh(*mesh);
+  }
+}
+
+void GeometryStage::RenderInstanced(GLuint program, mat::Material* mat,
+                                    const glm::mat4& vp_matrix) {
+  // Group meshes drawing the same range of the same vertex buffer.
+  auto same_batch = [](const geo::Mesh* a, const geo::Mesh* b) {
+    return &a->array_buffer() == &b->array_buffer() &&
+           a->num_indices() == b->num_indices();
+  };
+  std::stable_sort(batch_meshes_.begin(), batch_meshes_.end(),
+      [](const geo::Mesh* a, const geo::Mesh* b) {
+        if (&a->array_buffer() != &b->array_buffer())
+          return &a->array_buffer() < &b->array_buffer();
+        return a->num_indices() < b->num_indices();
+      });
+
+  // Stream all of the material's instances at once, orphaning the previous
+  // contents of the buffer.
+  instance_data_.resize(batch_meshes_.size());
+  for (size_t i = 0; i < batch_meshes_.size(); i++) {
+    const geo::Mesh* mesh = batch_meshes_[i];
+    InstanceData& instance = instance_data_[i];
+    instance.model_matrix = mesh->model_matrix();
+    instance.normal_matrix = mesh->normal_matrix();
+    instance.color = mesh->color();
+  }
+  const GLsizeiptr instance_data_size =
+      instance_data_.size() * sizeof(InstanceData);
+  glBindBuffer(GL_ARRAY_BUFFER, instance_buffer_);
+  glBufferData(GL_ARRAY_BUFFER, instance_data_size, nullptr, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, instance_data_size,
+                  instance_data_.data());
+
+  GLuint vp_location = glGetUniformLocation(program, UNIFORM_VP_MATRIX_NAME);
+  glUniformMatrix4fv(vp_location, 1, GL_FALSE, glm::value_ptr(vp_matrix));
+
+  glDisable(GL_BLEND);
+  size_t begin = 0;
+  while (begin < batch_meshes_.size()) {
+    size_t end = begin + 1;
+    while (end < batch_meshes_.size() &&
+           same_batch(batch_meshes_[begin], batch_meshes_[end])) {
+      end++;
+    }
+
+    const geo::Mesh& first = *batch_meshes_[begin];
+    geo::VertexBuffer& vb = first.array_buffer();
+    glBindVertexArray(vb.vertex_array());
+
+    // GL 3.3 lacks a base instance, so point the instance attributes at the
+    // batch's range of the buffer instead. This is VAO state, but is cheap
+    // relative to the draw calls saved, and is undone after the draw.
+    const size_t base = begin * sizeof(InstanceData);
+    const GLsizei stride = sizeof(InstanceData);
+    for (GLuint column = 0; column < 4; column++) {
+      const GLuint model_attrib = VS_ATTRIB_INSTANCE_MODEL_MATRIX + column;
+      const GLuint normal_attrib = VS_ATTRIB_INSTANCE_NORMAL_MATRIX + column;
+      glEnableVertexAttribArray(model_attrib);
+      glVertexAttribPointer(model_attrib, 4, GL_FLOAT, GL_FALSE, stride,
+          (void*) (base + offsetof(InstanceData, model_matrix) +
+                   column * sizeof(glm::vec4)));
+      glVertexAttribDivisor(model_attrib, 1);
+      glEnableVertexAttribArray(normal_attrib);
+      glVertexAttribPointer(normal_attrib, 4, GL_FLOAT, GL_FALSE, stride,
+          (void*) (base + offsetof(InstanceData, normal_matrix) +
+                   column * sizeof(glm::vec4)));
+      glVertexAttribDivisor(normal_attrib, 1);
+    }
+    glEnableVertexAttribArray(VS_ATTRIB_INSTANCE_COLOR);
+    glVertexAttribPointer(VS_ATTRIB_INSTANCE_COLOR, 4, GL_FLOAT, GL_FALSE,
+        stride, (void*) (base + offsetof(InstanceData, color)));
+    glVertexAttribDivisor(VS_ATTRIB_INSTANCE_COLOR, 1);
+
+    mat->PreDrawMesh(first);
+    glDrawElementsInstanced(GL_TRIANGLES, first.num_indices(),
+                            vb.index_type(), nullptr,
+                            (GLsizei) (end - begin));
+    mat->PostDrawMesh(first);
+
+    // The mesh's VAO is shared with every other pass drawing it, such as
+    // shadows, which must not see the instance attributes.
+    for (GLuint attrib = VS_ATTRIB_INSTANCE_MODEL_MATRIX;
+         attrib <= VS_ATTRIB_INSTANCE_COLOR; attrib++) {
+      glVertexAttribDivisor(attrib, 0);
+      glDisableVertexAttribArray(attrib);
+    }
+
+    begin = end;
+  }
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 GLuint GeometryStage::BuildVertexShader(const mat::Material& material) const {
   // XXX: currently, materials are unused.
   //      should populate vertex/uniform info from them.
+  const bool instanced = material.supports_instancing();
   std::ostringstream vs;
   vs << "#version 330" << std::endl;
 
-  vs << "uniform mat4 " << UNIFORM_MODEL_MATRIX_NAME << ";" << std::endl;
-  vs << "uniform mat4 " << UNIFORM_MVP_MATRIX_NAME << ";" << std::endl;
-  vs << "uniform mat4 " << UNIFORM_NORMAL_MATRIX_NAME << ";" << std::endl;
+  if (instanced) {
+    vs << "#define QUARKE_INSTANCED" << std::endl;
+    vs << "uniform mat4 " << UNIFORM_VP_MATRIX_NAME << ";" << std::endl;
+    vs << "layout(location = " << VS_ATTRIB_INSTANCE_MODEL_MATRIX << ") "
+       << "in mat4 " << UNIFORM_MODEL_MATRIX_NAME << ";" << std::endl;
+    vs << "layout(location = " << VS_ATTRIB_INSTANCE_NORMAL_MATRIX << ") "
+       << "in mat4 " << UNIFORM_NORMAL_MATRIX_NAME << ";" << std::endl;
+    vs << "layout(location = " << VS_ATTRIB_INSTANCE_COLOR << ") "
+       << "in vec4 instanceColor;" << std::endl;
+    vs << "flat out vec4 vInstanceColor;" << std::endl;
+  } else {
+    vs << "uniform mat4 " << UNIFORM_MODEL_MATRIX_NAME << ";" << std::endl;
+    vs << "uniform mat4 " << UNIFORM_MVP_MATRIX_NAME << ";" << std::endl;
+    vs << "uniform mat4 " << UNIFORM_NORMAL_MATRIX_NAME << ";" << std::endl;
+  }
 
   vs << "layout(location = " << geo::VertexBuffer::VS_ATTRIB_POSITION << ") "
      << "in vec3 position;" << std::endl;
@@ -213,7 +620,12 @@ GLuint GeometryStage::BuildVertexShader(const mat::Material& material) const {
      << "vNormal = normalize(" << UNIFORM_NORMAL_MATRIX_NAME << " * vec4(normal, 0.0));" << std::endl
      << "vPosition = " << UNIFORM_MODEL_MATRIX_NAME << " * vec4(position, 1.0);" << std::endl;
 
-  vs << "gl_Position = " << UNIFORM_MVP_MATRIX_NAME << " * vec4(position, 1.0);" << std::endl;
+  if (instanced) {
+    vs << "gl_Position = " << UNIFORM_VP_MATRIX_NAME << " * vPosition;" << std::endl
+       << "vInstanceColor = instanceColor;" << std::endl;
+  } else {
+    vs << "gl_Position = " << UNIFORM_MVP_MATRIX_NAME << " * vec4(position, 1.0);" << std::endl;
+  }
 
   // Call the generated material() function from the VS
   if (material.has_vertex_shader()) {
@@ -241,27 +653,51 @@ GLuint GeometryStage::BuildFragmentShader(const mat::Material& material) const {
   std::ostringstream fs;
   fs << "#version 330" << std::endl;
 
-  fs << "uniform mat4 " << UNIFORM_MVP_MATRIX_NAME << ";" << std::endl;
-  fs << "uniform mat4 " << UNIFORM_NORMAL_MATRIX_NAME << ";" << std::endl;
+  if (material.supports_instancing()) {
+    fs << "#define QUARKE_INSTANCED" << std::endl;
+    fs << "flat in vec4 vInstanceColor;" << std::endl;
+  } else {
+    fs << "uniform mat4 " << UNIFORM_MVP_MATRIX_NAME << ";" << std::endl;
+    fs << "uniform mat4 " << UNIFORM_NORMAL_MATRIX_NAME << ";" << std::endl;
+  }
 
   fs << "in vec4 vNormal;" << std::endl;
   fs << "in vec4 vPosition;" << std::endl;
 
+  const bool compact = layout_ == LAYOUT_COMPACT;
+  if (compact) {
+    // Octahedral normal encoding, see "A Survey of Efficient Representations
+    // for Independent Unit Vectors" (Cigolle et al. 2014).
+    fs << "vec2 signNotZero(vec2 v) {" << std::endl
+       << "return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);" << std::endl
+       << "}" << std::endl
+       << "vec2 octEncode(vec3 n) {" << std::endl
+       << "n /= abs(n.x) + abs(n.y) + abs(n.z);" << std::endl
+       << "return n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signNotZero(n.xy);" << std::endl
+       << "}" << std::endl;
+  }
+
   fs << "layout(location = " << FS_OUT_COLOR_BUFFER << ") "
      << "out vec4 outColor;" << std::endl;
   fs << "layout(location = " << FS_OUT_NORMAL_BUFFER << ") "
      << "out vec4 outNormal;" << std::endl;
-  fs << "layout(location = " << FS_OUT_POSITION_BUFFER << ") "
-     << "out vec4 outPosition;" << std::endl;
+  if (!compact) {
+    fs << "layout(location = " << FS_OUT_POSITION_BUFFER << ") "
+       << "out vec4 outPosition;" << std::endl;
+  }
 
   // call upon dat material to make frags
   material.BuildFragmentShader(fs);
 
   fs << "void main(void) {" << std::endl
-     << "outColor = vec4(abs(cos(vPosition.x)), abs(cos(vPosition.y)), abs(cos(vPosition.z)), 1.0); //vColor;" << std::endl
-     << "outNormal = normalize(vec4(vNormal.xyz, 0.0));" << std::endl
-     << "outPosition = vPosition;" << std::endl
-     << "material();" << std::endl
+     << "outColor = vec4(abs(cos(vPosition.x)), abs(cos(vPosition.y)), abs(cos(vPosition.z)), 1.0); //vColor;" << std::endl;
+  if (compact) {
+    fs << "outNormal = vec4(octEncode(normalize(vNormal.xyz)), 0.0, 0.0);" << std::endl;
+  } else {
+    fs << "outNormal = normalize(vec4(vNormal.xyz, 0.0));" << std::endl
+       << "outPosition = vPosition;" << std::endl;
+  }
+  fs << "material();" << std::endl
      << "}";
 
 #ifdef QUARKE_DEBUG
@@ -3,8 +3,12 @@
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
 #include <map>
 #include <memory>
+#include <vector>
+#include "geo/frustum.h"
+#include "pipe/render_target_pool.h"
 
 namespace quarke {
 
@@ -23,6 +27,8 @@ struct Mesh;
 
 namespace pipe {
 
+class OcclusionCuller;
+
 // A per-material iterator over meshes to avoid excessive shader swaps.
 class MaterialMeshIterator {
   public:
@@ -55,41 +61,147 @@ class MaterialIterator {
 //   we should allow for custom vertex attribute binding.
 class GeometryStage {
  public:
-  static std::unique_ptr<GeometryStage> Create(int width, int height);
-
-  GeometryStage(int width, int height, GLuint fbo, GLuint color_tex,
-                GLuint normal_tex, GLuint position_tex, GLuint depth_tex);
+  // Storage formats of the G-buffer attachments.
+  enum Layout {
+    // RGBA color, and world space normals and positions in RGBA32F.
+    // 36 bytes per pixel, plus depth.
+    LAYOUT_FULL,
+    // RGBA8 color and octahedral normals in RG16F, with positions left to
+    // be reconstructed from depth. 8 bytes per pixel, plus depth.
+    LAYOUT_COMPACT,
+  };
+
+  // G-buffer textures are acquired from `pool`, which must outlive the
+  // stage.
+  static std::unique_ptr<GeometryStage> Create(RenderTargetPool& pool,
+                                               int width, int height,
+                                               Layout layout = LAYOUT_COMPACT);
+
+  // `position_tex` is 0 for LAYOUT_COMPACT.
+  GeometryStage(RenderTargetPool& pool, int width, int height, Layout layout,
+                GLuint fbo, GLuint color_tex, GLuint normal_tex,
+                GLuint position_tex, GLuint depth_tex, GLuint instance_buffer,
+                GLuint box_program, GLuint box_vao);
+  ~GeometryStage();
+
+  GeometryStage(const GeometryStage&) = delete;
 
   // Clears the G-buffer, overwriting all attachments with zeroes.
   void Clear();
 
   // Iterates over the given mesh iterator, drawing each one per-material.
+  // Meshes outside of the camera frustum are culled.
+  // For materials supporting instancing, meshes sharing a vertex buffer are
+  // drawn together with a single instanced draw call.
+  //
+  // With an occlusion culler set, meshes it reports as occluded are drawn
+  // last, each conditionally on an occlusion query of its bounding box
+  // against the depth of the meshes drawn before it.
   void Render(const game::Camera& camera, MaterialIterator& iter,
               bool color = true, bool normal = true, bool position = true);
 
+  // Returns the number of meshes drawn, culled, and left to occlusion
+  // queries by the last Render().
+  const geo::CullStats& cull_stats() const { return cull_stats_; }
+  // Returns the number of meshes left to occlusion queries by the last
+  // Render().
+  size_t occlusion_queries() const { return occluded_.size(); }
+
+  // Sets the culler to skip occluded meshes with, or nullptr to only cull
+  // against the frustum. The culler must outlive its use.
+  void set_occlusion_culler(const OcclusionCuller* culler) {
+    occlusion_culler_ = culler;
+  }
+
   GLuint fbo() const { return fbo_; }
+  Layout layout() const { return layout_; }
 
   GLuint color_tex() const { return color_tex_; }
-  static GLenum color_format() { return GL_RGBA; }
+  static GLenum color_format(Layout layout) {
+    return layout == LAYOUT_COMPACT ? GL_RGBA8 : GL_RGBA;
+  }
 
+  // Holds octahedral encoded normals in LAYOUT_COMPACT.
   GLuint normal_tex() const { return normal_tex_; }
-  // Need GL_RGBA32F to ensure signed representation.
-  static GLenum normal_format() { return GL_RGBA32F; }
+  // Need floating point formats to ensure signed representation.
+  static GLenum normal_format(Layout layout) {
+    return layout == LAYOUT_COMPACT ? GL_RG16F : GL_RGBA32F;
+  }
 
+  // Absent in LAYOUT_COMPACT; reconstruct positions from depth_tex() and the
+  // inverse view-projection instead.
   GLuint position_tex() const { return position_tex_; }
   // Need GL_RGBA32F to ensure signed representation.
   static GLenum position_format() { return GL_RGBA32F; }
 
   GLuint depth_tex() const { return depth_tex_; }
-  static GLuint depth_format() { return GL_DEPTH_COMPONENT; }
+  // Carries a stencil buffer for the lighting stages.
+  static GLuint depth_format() { return GL_DEPTH24_STENCIL8; }
+
+  // Returns GLSL preprocessor definitions describing `layout`, to precede
+  // normal_decode_source() in shaders reading the G-buffer.
+  static const char* layout_defines(Layout layout);
+  // Returns GLSL source defining `vec3 decodeNormal(vec4 texel)`, mapping a
+  // texel of normal_tex() to a world space normal.
+  static const char* normal_decode_source();
 
   GLuint color_buffer() const { return GL_COLOR_ATTACHMENT0; }
   GLuint normal_buffer() const { return GL_COLOR_ATTACHMENT1; }
   GLuint position_buffer() const { return GL_COLOR_ATTACHMENT2; }
 
  private:
+  // Per-instance attributes, streamed through the instance buffer.
+  struct InstanceData {
+    glm::mat4 model_matrix;
+    glm::mat4 normal_matrix;
+    glm::vec4 color;
+  };
+
   void SetOutputSize(int width, int height);
 
+  // Acquires G-buffer textures of the given size from `pool`, attaching them
+  // to the bound framebuffer. `position_tex` is left 0 for LAYOUT_COMPACT.
+  static void AcquireTargets(RenderTargetPool& pool, int width, int height,
+                             Layout layout, GLuint& color_tex,
+                             GLuint& normal_tex, GLuint& position_tex,
+                             GLuint& depth_tex);
+  // Returns the G-buffer textures to the pool.
+  void ReleaseTargets();
+
+  // A mesh deferred to an occlusion query.
+  struct OccludedMesh {
+    const geo::Mesh* mesh;
+    mat::Material* material;
+  };
+
+  // Populates batch_meshes_ with the meshes of `mit` intersecting
+  // `frustum`, moving those reported by the occlusion culler to occluded_.
+  // Meshes with bounds containing `eye` are never deferred, as their boxes
+  // would be clipped by the near plane.
+  void GatherVisible(MaterialMeshIterator& mit, const geo::Frustum& frustum,
+                     const glm::vec3& eye, float near);
+
+  // Returns the program for `material`, building it on first use.
+  GLuint GetProgram(mat::Material* material);
+
+  // Draws batch_meshes_ with `program`, which must be current.
+  void RenderBatch(GLuint program, mat::Material* mat,
+                   const glm::mat4& vp_matrix);
+
+  // Queries the visibility of the bounding boxes of occluded_, then draws
+  // each mesh conditionally on its query.
+  void RenderOccluded(const glm::mat4& vp_matrix);
+
+  // Draws each mesh of batch_meshes_ with a separate draw call, passing
+  // transforms as uniforms.
+  void RenderMeshes(GLuint program, mat::Material* mat,
+                    const glm::mat4& vp_matrix);
+
+  // Draws batch_meshes_ in instanced batches of meshes sharing a vertex
+  // buffer.
+  void RenderInstanced(GLuint program, mat::Material* mat,
+                       const glm::mat4& vp_matrix);
+
   // Constructs a vertex shader for the given material.
   // Returns 0 on failure.
   GLuint BuildVertexShader(const mat::Material& material) const;
@@ -98,11 +210,32 @@ class GeometryStage {
   // Returns 0 on failure.
   GLuint BuildFragmentShader(const mat::Material& material) const;
 
+  RenderTargetPool& pool_;
+  const Layout layout_;
   GLuint fbo_;
   GLuint color_tex_;
   GLuint normal_tex_;
   GLuint position_tex_;
   GLuint depth_tex_;
+  GLuint instance_buffer_;
+  // Draws the unit cube for occlusion queries.
+  GLuint box_program_;
+  GLuint box_vao_;
+  GLint uniform_box_mvp_;
+
+  const OcclusionCuller* occlusion_culler_;
+  std::vector<OccludedMesh> occluded_;
+  std::vector<GLuint> queries_; // by occluded mesh
+
+  geo::CullStats cull_stats_;
+
+  // Scratch space for culling and batching, retained to avoid reallocation.
+  std::vector<const geo::Mesh*> all_meshes_;
+  std::vector<glm::vec4> spheres_;
+  std::vector<uint8_t> visible_;
+  std::vector<const geo::Mesh*> batch_meshes_;
+  std::vector<InstanceData> instance_data_;
+  std::vector<glm::mat4> mvp_matrices_;
 
   // TODO: don't use raw pointers as identifiers here!
   std::map<const mat::Material*, GLuint> shader_cache_;
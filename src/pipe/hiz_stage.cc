@@ -0,0 +1,172 @@
+#include "pipe/hiz_stage.h"
+#include <algorithm>
+#include <iostream>
+
+namespace quarke {
+namespace pipe {
+
+// Reduces 2x2 texels of the full resolution depth buffer.
+static const char* FIRST_LEVEL_SOURCE = R"(
+#version 330 core
+
+uniform sampler2D depth_tex;
+
+layout(location = 0) out vec4 out_bounds;
+
+void main(void) {
+  ivec2 size = textureSize(depth_tex, 0);
+  ivec2 base = ivec2(gl_FragCoord.xy) * 2;
+  float d0 = texelFetch(depth_tex, base, 0).r;
+  float d1 = texelFetch(depth_tex, min(base + ivec2(1, 0), size - 1), 0).r;
+  float d2 = texelFetch(depth_tex, min(base + ivec2(0, 1), size - 1), 0).r;
+  float d3 = texelFetch(depth_tex, min(base + ivec2(1, 1), size - 1), 0).r;
+  out_bounds = vec4(min(min(d0, d1), min(d2, d3)),
+                    max(max(d0, d1), max(d2, d3)), 0.0, 0.0);
+}
+)";
+
+// Reduces 2x2 texels of the previous level.
+static const char* NEXT_LEVEL_SOURCE = R"(
+#version 330 core
+
+uniform sampler2DRect depth_tex;
+
+layout(location = 0) out vec4 out_bounds;
+
+void main(void) {
+  ivec2 size = textureSize(depth_tex);
+  ivec2 base = ivec2(gl_FragCoord.xy) * 2;
+  vec2 b0 = texelFetch(depth_tex, base).rg;
+  vec2 b1 = texelFetch(depth_tex, min(base + ivec2(1, 0), size - 1)).rg;
+  vec2 b2 = texelFetch(depth_tex, min(base + ivec2(0, 1), size - 1)).rg;
+  vec2 b3 = texelFetch(depth_tex, min(base + ivec2(1, 1), size - 1)).rg;
+  out_bounds = vec4(min(min(b0.r, b1.r), min(b2.r, b3.r)),
+                    max(max(b0.g, b1.g), max(b2.g, b3.g)), 0.0, 0.0);
+}
+)";
+
+std::unique_ptr<HiZStage> HiZStage::Create(RenderTargetPool& pool,
+                                          int width, int height) {
+  std::vector<std::unique_ptr<FragmentStage>> levels;
+  int level_width = width;
+  int level_height = height;
+  do {
+    level_width = (level_width + 1) / 2;
+    level_height = (level_height + 1) / 2;
+    // Bounds are read back as floats, and must be exact to stay
+    // conservative.
+    auto level = FragmentStage::Create(
+        pool, level_width, level_height, { GL_RG32F },
+        levels.empty() ? FIRST_LEVEL_SOURCE : NEXT_LEVEL_SOURCE);
+    if (!level) {
+      std::cerr << "[hiz] failed to create level " << levels.size() << "!"
+                << std::endl;
+      return nullptr;
+    }
+    levels.push_back(std::move(level));
+  } while (level_width > 1 || level_height > 1);
+
+  GLuint readback_buffer;
+  glGenBuffers(1, &readback_buffer);
+
+  return std::make_unique<HiZStage>(width, height, std::move(levels),
+                                    readback_buffer);
+}
+
+HiZStage::HiZStage(int width, int height,
+                   std::vector<std::unique_ptr<FragmentStage>> levels,
+                   GLuint readback_buffer)
+  : width_(width), height_(height), levels_(std::move(levels))
+  , readback_buffer_(readback_buffer), readback_pending_(false)
+  , pending_level_(0), readback_level_(0) {
+  for (auto& level : levels_) {
+    glUseProgram(level->program());
+    glUniform1i(glGetUniformLocation(level->program(), "depth_tex"), 0);
+  }
+}
+
+HiZStage::~HiZStage() {
+  glDeleteBuffers(1, &readback_buffer_);
+}
+
+void HiZStage::Build(GLuint depth_tex) {
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+  glActiveTexture(GL_TEXTURE0);
+
+  for (int i = 0; i < num_levels(); i++) {
+    if (i == 0) {
+      glBindTexture(GL_TEXTURE_2D, depth_tex);
+    } else {
+      glBindTexture(GL_TEXTURE_RECTANGLE, tex(i - 1));
+    }
+    glViewport(0, 0, level_width(i), level_height(i));
+    levels_[i]->Draw();
+  }
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glViewport(0, 0, width_, height_);
+}
+
+void HiZStage::ReadBack(int level) {
+  const GLsizeiptr size =
+      level_width(level) * level_height(level) * sizeof(glm::vec2);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback_buffer_);
+  glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, levels_[level]->fbo());
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glReadPixels(0, 0, level_width(level), level_height(level), GL_RG, GL_FLOAT,
+               nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  readback_pending_ = true;
+  pending_level_ = level;
+}
+
+bool HiZStage::FinishReadBack() {
+  if (!readback_pending_)
+    return false;
+  readback_pending_ = false;
+
+  const size_t count =
+      level_width(pending_level_) * level_height(pending_level_);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback_buffer_);
+  const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                      count * sizeof(glm::vec2),
+                                      GL_MAP_READ_BIT);
+  if (data) {
+    const glm::vec2* texels = static_cast<const glm::vec2*>(data);
+    readback_.assign(texels, texels + count);
+    readback_level_ = pending_level_;
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    std::cerr << "[hiz] failed to map read back buffer!" << std::endl;
+    readback_.clear();
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  return !readback_.empty();
+}
+
+glm::vec2 HiZStage::DepthBounds(int x0, int y0, int x1, int y1) const {
+  if (readback_.empty())
+    return glm::vec2(0.f, 1.f);
+
+  const int s = scale(readback_level_);
+  const int w = level_width(readback_level_);
+  const int tx0 = std::max(x0, 0) / s;
+  const int ty0 = std::max(y0, 0) / s;
+  const int tx1 = std::min(x1, width_ - 1) / s;
+  const int ty1 = std::min(y1, height_ - 1) / s;
+
+  glm::vec2 bounds(1.f, 0.f);
+  for (int y = ty0; y <= ty1; y++) {
+    for (int x = tx0; x <= tx1; x++) {
+      const glm::vec2& b = readback_[y * w + x];
+      bounds.x = std::min(bounds.x, b.x);
+      bounds.y = std::max(bounds.y, b.y);
+    }
+  }
+  return bounds;
+}
+
+}  // namespace pipe
+}  // namespace quarke
@@ -0,0 +1,78 @@
+#ifndef QUARKE_SRC_PIPE_HIZ_STAGE_H_
+#define QUARKE_SRC_PIPE_HIZ_STAGE_H_
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+#include "pipe/fragment_stage.h"
+
+namespace quarke {
+namespace pipe {
+
+// Builds a hierarchical depth pyramid from a depth buffer, where each level
+// stores the minimum and maximum depth of the texels it covers in r and g.
+//
+// Level 0 is half the resolution of the source depth, and each following
+// level halves the previous one (rounding up) until a single texel remains.
+// A texel (x, y) of level i covers the source pixels [x, x + 1) * 2^(i + 1)
+// along each axis, clamped to the source.
+class HiZStage {
+ public:
+  static std::unique_ptr<HiZStage> Create(RenderTargetPool& pool,
+                                          int width, int height);
+
+  HiZStage(int width, int height,
+           std::vector<std::unique_ptr<FragmentStage>> levels,
+           GLuint readback_buffer);
+  ~HiZStage();
+
+  // Downsamples the given GL_TEXTURE_2D depth texture into the pyramid.
+  void Build(GLuint depth_tex);
+
+  // Starts copying `level` of the pyramid into client memory for
+  // DepthBounds(), through a pixel buffer so as not to stall on the GPU.
+  void ReadBack(int level);
+
+  // Completes the last ReadBack(), blocking if the GPU hasn't caught up with
+  // it. Ideally called a frame later. Returns false if none was pending.
+  bool FinishReadBack();
+
+  // Returns the (min, max) depth over the source pixel rectangle
+  // [x0, x1] x [y0, y1] from the last finished read back, clamped to the
+  // source.
+  // Bounds are conservative, covering every tile of the read level that
+  // intersects the rectangle. Returns (0, 1) if nothing has been read back.
+  glm::vec2 DepthBounds(int x0, int y0, int x1, int y1) const;
+
+  int num_levels() const { return levels_.size(); }
+  int level_width(int level) const {
+    return (width_ + scale(level) - 1) / scale(level);
+  }
+  int level_height(int level) const {
+    return (height_ + scale(level) - 1) / scale(level);
+  }
+  // Returns the GL_TEXTURE_RECTANGLE holding `level`.
+  GLuint tex(int level) const { return levels_[level]->texture(0); }
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+ private:
+  // Returns the width of source pixels covered by a texel of `level`.
+  static int scale(int level) { return 2 << level; }
+
+  const int width_;
+  const int height_;
+  std::vector<std::unique_ptr<FragmentStage>> levels_;
+
+  const GLuint readback_buffer_;
+  bool readback_pending_;
+  int pending_level_;
+  int readback_level_;
+  std::vector<glm::vec2> readback_;
+};
+
+}  // namespace pipe
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_PIPE_HIZ_STAGE_H_
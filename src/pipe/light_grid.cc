@@ -0,0 +1,125 @@
+#include "pipe/light_grid.h"
+#include <algorithm>
+#include <cmath>
+#include "game/camera.h"
+#include "pipe/phong_stage.h"
+
+namespace quarke {
+namespace pipe {
+
+// Returns the bounds of x / d over the box [x0, x1] x [d0, d1], with d0 > 0.
+static void ProjectInterval(float x0, float x1, float d0, float d1,
+                            float& out_min, float& out_max) {
+  out_min = x0 / (x0 >= 0.f ? d1 : d0);
+  out_max = x1 / (x1 >= 0.f ? d0 : d1);
+}
+
+LightGrid::LightGrid(int tile_size, int num_slices)
+  : tile_size_(tile_size), num_slices_(num_slices), tiles_x_(0), tiles_y_(0)
+  , z_near_(0.f), z_far_(0.f), slice_scale_(0.f), slice_bias_(0.f) {}
+
+int LightGrid::SliceAt(float depth) const {
+  if (depth <= z_near_)
+    return 0;
+  int slice = (int) std::floor(std::log(depth) * slice_scale_ + slice_bias_);
+  return std::min(std::max(slice, 0), num_slices_ - 1);
+}
+
+float LightGrid::SliceDepth(int slice) const {
+  return z_near_ * std::pow(z_far_ / z_near_, (float) slice / num_slices_);
+}
+
+void LightGrid::Build(const game::Camera& camera,
+                      const std::vector<PointLight>& lights) {
+  const int width = camera.viewport_width();
+  const int height = camera.viewport_height();
+  tiles_x_ = (width + tile_size_ - 1) / tile_size_;
+  tiles_y_ = (height + tile_size_ - 1) / tile_size_;
+  z_near_ = camera.z_near();
+  z_far_ = camera.z_far();
+  slice_scale_ = num_slices_ / std::log(z_far_ / z_near_);
+  slice_bias_ = -std::log(z_near_) * slice_scale_;
+
+  // Scales from view space to NDC, divided by depth.
+  const float focal_y = 1.f / std::tan(camera.fov() / 2.f);
+  const float focal_x = focal_y * height / width;
+  const glm::mat4 view = camera.ComputeView();
+
+  spans_.clear();
+  for (uint32_t i = 0; i < lights.size(); i++) {
+    const PointLight& light = lights[i];
+    const glm::vec4 center = view * glm::vec4(light.position, 1.f);
+    const float depth = -center.z;
+    const float r = light.max_distance;
+    const float d_min = std::max(depth - r, z_near_);
+    const float d_max = std::min(depth + r, z_far_);
+    if (d_min >= d_max)
+      continue;
+
+    const int first_slice = SliceAt(d_min);
+    const int last_slice = SliceAt(d_max);
+    for (int s = first_slice; s <= last_slice; s++) {
+      // Bound the light's cross-section with the slice by a view space box.
+      const float d0 = std::max(SliceDepth(s), d_min);
+      const float d1 = std::min(SliceDepth(s + 1), d_max);
+      if (d0 >= d1)
+        continue;
+      const float dz = depth < d0 ? d0 - depth
+                     : depth > d1 ? depth - d1
+                     : 0.f;
+      const float extent = std::sqrt(std::max(r * r - dz * dz, 0.f));
+
+      float x_min, x_max, y_min, y_max;
+      ProjectInterval(center.x - extent, center.x + extent, d0, d1,
+                      x_min, x_max);
+      ProjectInterval(center.y - extent, center.y + extent, d0, d1,
+                      y_min, y_max);
+
+      // NDC to pixels.
+      x_min = (x_min * focal_x * 0.5f + 0.5f) * width;
+      x_max = (x_max * focal_x * 0.5f + 0.5f) * width;
+      y_min = (y_min * focal_y * 0.5f + 0.5f) * height;
+      y_max = (y_max * focal_y * 0.5f + 0.5f) * height;
+      if (x_max < 0.f || y_max < 0.f || x_min >= width || y_min >= height)
+        continue;
+
+      Span span;
+      span.light = i;
+      span.slice = s;
+      span.x0 = (int) std::max(x_min, 0.f) / tile_size_;
+      span.x1 = (int) std::min(x_max, width - 1.f) / tile_size_;
+      span.y0 = (int) std::max(y_min, 0.f) / tile_size_;
+      span.y1 = (int) std::min(y_max, height - 1.f) / tile_size_;
+      spans_.push_back(span);
+    }
+  }
+
+  // Count the lights in each cluster, then lay out their lists contiguously.
+  clusters_.assign(tiles_x_ * tiles_y_ * num_slices_, { 0, 0 });
+  for (const Span& span : spans_) {
+    for (int y = span.y0; y <= span.y1; y++) {
+      Cluster* row = &clusters_[(span.slice * tiles_y_ + y) * tiles_x_];
+      for (int x = span.x0; x <= span.x1; x++) {
+        row[x].count++;
+      }
+    }
+  }
+  uint32_t offset = 0;
+  for (Cluster& cluster : clusters_) {
+    cluster.offset = offset;
+    offset += cluster.count;
+    cluster.count = 0;
+  }
+  indices_.resize(offset);
+  for (const Span& span : spans_) {
+    for (int y = span.y0; y <= span.y1; y++) {
+      Cluster* row = &clusters_[(span.slice * tiles_y_ + y) * tiles_x_];
+      for (int x = span.x0; x <= span.x1; x++) {
+        indices_[row[x].offset + row[x].count++] = span.light;
+      }
+    }
+  }
+}
+
+}  // namespace pipe
+}  // namespace quarke
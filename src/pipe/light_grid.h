@@ -0,0 +1,85 @@
+#ifndef QUARKE_SRC_PIPE_LIGHT_GRID_H_
+#define QUARKE_SRC_PIPE_LIGHT_GRID_H_
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace quarke {
+
+namespace game {
+class Camera;
+}  // namespace game
+
+namespace pipe {
+
+struct PointLight;
+
+// Bins point lights into clusters, formed by dividing the view frustum into
+// square screen tiles and exponentially spaced depth slices, so that shading
+// only has to consider the lights that can reach each cluster.
+//
+// Binning is done on the CPU. Each light's sphere of influence is bounded
+// per depth slice by the box around its cross-section with the slice, which
+// is projected to find the tiles it covers.
+class LightGrid {
+ public:
+  // A range of `indices()` holding the lights that reach a cluster.
+  struct Cluster {
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  // Creates a grid of `tile_size` pixel tiles, with `num_slices` depth slices
+  // between the near and far planes of the camera.
+  LightGrid(int tile_size, int num_slices);
+
+  // Rebuilds the light lists of every cluster for `lights` as seen from
+  // `camera`. Lists are ordered by light index.
+  void Build(const game::Camera& camera,
+             const std::vector<PointLight>& lights);
+
+  int tile_size() const { return tile_size_; }
+  int tiles_x() const { return tiles_x_; }
+  int tiles_y() const { return tiles_y_; }
+  int num_slices() const { return num_slices_; }
+
+  // Maps a view depth d to its slice as floor(log(d) * scale + bias).
+  float slice_scale() const { return slice_scale_; }
+  float slice_bias() const { return slice_bias_; }
+
+  // Clusters in x-major, then y, then slice order.
+  const std::vector<Cluster>& clusters() const { return clusters_; }
+  const std::vector<uint32_t>& indices() const { return indices_; }
+ private:
+  // The extent of a light within a single slice, in tiles.
+  struct Span {
+    uint32_t light;
+    uint16_t slice;
+    uint16_t x0, x1, y0, y1; // inclusive
+  };
+
+  // Returns the slice at the given view depth, clamped to the grid.
+  int SliceAt(float depth) const;
+
+  // Returns the view depth of the near boundary of `slice`.
+  float SliceDepth(int slice) const;
+
+  const int tile_size_;
+  const int num_slices_;
+  int tiles_x_;
+  int tiles_y_;
+  float z_near_;
+  float z_far_;
+  float slice_scale_;
+  float slice_bias_;
+
+  std::vector<Cluster> clusters_;
+  std::vector<uint32_t> indices_;
+  std::vector<Span> spans_; // scratch space, retained across builds
+};
+
+}  // namespace pipe
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_PIPE_LIGHT_GRID_H_
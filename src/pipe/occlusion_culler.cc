@@ -0,0 +1,59 @@
+#include "pipe/occlusion_culler.h"
+#include <algorithm>
+#include <cmath>
+#include "game/camera.h"
+#include "pipe/hiz_stage.h"
+
+namespace quarke {
+namespace pipe {
+
+// Pyramid level to read back, with tiles of 8x8 pixels. Coarser levels are
+// cheaper to transfer and test, but occlude less.
+static const int READBACK_LEVEL = 2;
+
+OcclusionCuller::OcclusionCuller(HiZStage& hiz)
+  : hiz_(hiz), enabled_(false) {}
+
+void OcclusionCuller::Capture(const game::Camera& camera) {
+  pending_view_projection_ = camera.ComputeProjection();
+  hiz_.ReadBack(std::min(READBACK_LEVEL, hiz_.num_levels() - 1));
+}
+
+void OcclusionCuller::Update() {
+  enabled_ = hiz_.FinishReadBack();
+  view_projection_ = pending_view_projection_;
+}
+
+bool OcclusionCuller::IsOccluded(const geo::AABB& box) const {
+  if (!enabled_)
+    return false;
+
+  glm::vec3 ndc_min(1.f);
+  glm::vec3 ndc_max(-1.f);
+  for (int i = 0; i < 8; i++) {
+    const glm::vec4 corner(i & 1 ? box.max.x : box.min.x,
+                           i & 2 ? box.max.y : box.min.y,
+                           i & 4 ? box.max.z : box.min.z, 1.f);
+    const glm::vec4 clip = view_projection_ * corner;
+    if (clip.w <= 0.f || clip.z < -clip.w)
+      return false; // in front of the near plane
+    const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+    ndc_min = glm::min(ndc_min, ndc);
+    ndc_max = glm::max(ndc_max, ndc);
+  }
+  if (ndc_min.x < -1.f || ndc_min.y < -1.f ||
+      ndc_max.x > 1.f || ndc_max.y > 1.f)
+    return false;
+
+  const int width = hiz_.width();
+  const int height = hiz_.height();
+  const int x0 = (int) std::floor((ndc_min.x * 0.5f + 0.5f) * width);
+  const int x1 = (int) std::floor((ndc_max.x * 0.5f + 0.5f) * width);
+  const int y0 = (int) std::floor((ndc_min.y * 0.5f + 0.5f) * height);
+  const int y1 = (int) std::floor((ndc_max.y * 0.5f + 0.5f) * height);
+  const float nearest = ndc_min.z * 0.5f + 0.5f;
+  return nearest > hiz_.DepthBounds(x0, y0, x1, y1).y;
+}
+
+}  // namespace pipe
+}  // namespace quarke
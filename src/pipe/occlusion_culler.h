@@ -0,0 +1,55 @@
+#ifndef QUARKE_SRC_PIPE_OCCLUSION_CULLER_H_
+#define QUARKE_SRC_PIPE_OCCLUSION_CULLER_H_
+
+#include <glm/glm.hpp>
+#include "geo/bounds.h"
+
+namespace quarke {
+
+namespace game {
+class Camera;
+}  // namespace game
+
+namespace pipe {
+
+class HiZStage;
+
+// Tests bounding boxes against the depth of the previous frame, read back
+// from a coarse level of a Hi-Z pyramid.
+//
+// Results lag a frame behind, so a box may be reported as occluded while it
+// is visible from the current camera. Callers must fall back to an exact
+// test for occluded boxes, such as an occlusion query against the current
+// depth buffer.
+class OcclusionCuller {
+ public:
+  // Reads back from `hiz`, which must outlive the culler.
+  explicit OcclusionCuller(HiZStage& hiz);
+
+  // Starts reading back the pyramid just built for a frame seen by `camera`,
+  // to cull the following frame against.
+  void Capture(const game::Camera& camera);
+
+  // Makes the last Capture() available to IsOccluded(). Call at the start of
+  // a frame, before culling. Culling is disabled if nothing was captured.
+  void Update();
+
+  // Returns true if `box` was entirely hidden behind the captured depth.
+  // Boxes reaching past the near plane or the edges of the screen are never
+  // occluded, as there is no depth to test them against.
+  bool IsOccluded(const geo::AABB& box) const;
+
+  bool enabled() const { return enabled_; }
+ private:
+  HiZStage& hiz_;
+  bool enabled_;
+  // World-to-clip transforms of the frames being read back and culled
+  // against.
+  glm::mat4 pending_view_projection_;
+  glm::mat4 view_projection_;
+};
+
+}  // namespace pipe
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_PIPE_OCCLUSION_CULLER_H_
@@ -1,15 +1,31 @@
 #include "pipe/omni_shadow_stage.h"
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <iostream>
+#include <limits>
+#include "geo/frustum.h"
 #include "geo/mesh.h"
+#include "util/matrix_batch.h"
 
 namespace quarke {
 namespace pipe {
 
 static const float Z_NEAR = 0.1f;
 static const float Z_FAR = 100.f;
+
+// Bounds on the size of a single cube face in the atlas, in texels.
+static const GLsizei MIN_TILE_SIZE = 64;
+static const GLsizei MAX_TILE_SIZE = 1024;
+
+// Lights keep their tiles until they need less than this fraction of them,
+// so that lights hovering around a size threshold don't thrash the atlas.
+static const float TILE_SHRINK_THRESHOLD = 0.375f;
+
+static const size_t DEFAULT_UPDATE_BUDGET = 4;
+
 static const char* VS_SOURCE = R"(
 #version 330 core
 
@@ -26,6 +42,73 @@ void main() {
   gl_Position = mvp_matrix * vec4(position, 1.0);
 }
 )";
+// Single pass rendering transforms to world space only, leaving the geometry
+// shader to project into each face.
+static const char* SINGLE_PASS_VS_SOURCE = R"(
+#version 330 core
+
+uniform mat4 model_matrix;
+
+layout(location = 0) in vec3 position;
+
+out vec4 g_position;
+
+void main() {
+  g_position = model_matrix * vec4(position, 1.0);
+}
+)";
+static const char* SINGLE_PASS_GS_SOURCE = R"(
+#version 330 core
+
+layout(triangles) in;
+layout(triangle_strip, max_vertices = 18) out;
+
+uniform mat4 face_matrices[6];
+uniform vec2 face_offsets[6]; // center of each face's tile, in atlas NDC
+uniform float face_scale; // size of a tile relative to the atlas
+uniform int face_mask; // faces overlapped by the mesh's bounds
+
+in vec4 g_position[];
+
+out vec4 v_position;
+out float gl_ClipDistance[4];
+
+void main() {
+  for (int face = 0; face < 6; face++) {
+    if ((face_mask & (1 << face)) == 0)
+      continue;
+
+    vec4 clip[3];
+    for (int i = 0; i < 3; i++) {
+      clip[i] = face_matrices[face] * g_position[i];
+    }
+
+    // Skip faces where the triangle lies entirely outside of a clip plane.
+    vec3 x = vec3(clip[0].x, clip[1].x, clip[2].x);
+    vec3 y = vec3(clip[0].y, clip[1].y, clip[2].y);
+    vec3 z = vec3(clip[0].z, clip[1].z, clip[2].z);
+    vec3 w = vec3(clip[0].w, clip[1].w, clip[2].w);
+    if (all(lessThan(x, -w)) || all(greaterThan(x, w)) ||
+        all(lessThan(y, -w)) || all(greaterThan(y, w)) ||
+        all(lessThan(z, -w)) || all(greaterThan(z, w)))
+      continue;
+
+    for (int i = 0; i < 3; i++) {
+      // Move the face's clip volume onto its tile, and clip to the tile
+      // edges ourselves.
+      vec4 c = clip[i];
+      gl_Position = vec4(c.xy * face_scale + face_offsets[face] * c.w, c.zw);
+      gl_ClipDistance[0] = c.w + c.x;
+      gl_ClipDistance[1] = c.w - c.x;
+      gl_ClipDistance[2] = c.w + c.y;
+      gl_ClipDistance[3] = c.w - c.y;
+      v_position = g_position[i];
+      EmitVertex();
+    }
+    EndPrimitive();
+  }
+}
+)";
 static const char* FS_SOURCE = R"(
 #version 330 core
 
@@ -44,117 +127,438 @@ void main() {
 
 static const GLuint FS_OUT_LIGHT_DISTANCE = 0;
 
+// Compiles a shader of `type` from `source`, deleting it on failure.
+static bool CompileShader(GLenum type, const char* source,
+                          GLuint& out_shader) {
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, nullptr);
+  glCompileShader(shader);
+
+  GLint compiled;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+  if (!compiled) {
+    glDeleteShader(shader);
+    return false;
+  }
+  out_shader = shader;
+  return true;
+}
+
+std::unique_ptr<OmniShadowStage> OmniShadowStage::Create(
+    RenderTargetPool& pool, GLsizei atlas_size, RenderMode mode) {
+  // Built first, so that no render targets are held if it fails.
+  GLuint program;
+  if (!BuildShaderProgram(mode, program))
+    return nullptr;
+
+  // Neighbouring tiles are unrelated, so never filter across them; the
+  // pool's nearest filtering does just that.
+  const RenderTargetDesc distance_desc = {
+    atlas_size, atlas_size, distance_internal_format(), GL_TEXTURE_2D
+  };
+  GLuint atlas_tex = pool.Acquire(distance_desc);
+  GLuint static_atlas_tex = pool.Acquire(distance_desc);
+  GLuint depth_tex = pool.Acquire({ atlas_size, atlas_size,
+                                    depth_internal_format(), GL_TEXTURE_2D });
 
-std::unique_ptr<OmniShadowStage> OmniShadowStage::Create(GLsizei texture_size) {
   GLuint fbo;
   glGenFramebuffers(1, &fbo);
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-
-  GLuint depth_tex;
-  glGenTextures(1, &depth_tex);
-  glBindTexture(GL_TEXTURE_2D, depth_tex);
-  glTexImage2D(GL_TEXTURE_2D, 0, depth_internal_format(), texture_size,
-               texture_size, 0, depth_format(), GL_FLOAT, nullptr);
   glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depth_tex, 0);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, atlas_tex, 0);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    std::cerr << "[oss] atlas framebuffer incomplete!" << std::endl;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &fbo);
+    pool.Release(atlas_tex);
+    pool.Release(static_atlas_tex);
+    pool.Release(depth_tex);
+    glDeleteProgram(program);
+    return nullptr;
+  }
 
-  GLuint program = glCreateProgram();
+  // Used to copy static layers into the atlas.
+  GLuint copy_fbos[2];
+  glGenFramebuffers(2, copy_fbos);
+  glBindFramebuffer(GL_FRAMEBUFFER, copy_fbos[0]);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, static_atlas_tex,
+                       0);
+  glBindFramebuffer(GL_FRAMEBUFFER, copy_fbos[1]);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, atlas_tex, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  return std::make_unique<OmniShadowStage>(pool, mode, program, fbo, copy_fbos,
+                                           atlas_tex, static_atlas_tex,
+                                           depth_tex, atlas_size);
+}
 
-  GLint compiled;
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &VS_SOURCE, nullptr);
-  glCompileShader(vs);
-  glGetShaderiv(vs, GL_COMPILE_STATUS, &compiled);
-  if (!compiled) {
+/* static */
+bool OmniShadowStage::BuildShaderProgram(RenderMode mode,
+                                         GLuint& out_program) {
+  const bool single_pass = mode == RENDER_SINGLE_PASS;
+
+  GLuint vs;
+  if (!CompileShader(GL_VERTEX_SHADER,
+                     single_pass ? SINGLE_PASS_VS_SOURCE : VS_SOURCE, vs)) {
     std::cerr << "[oss] failed to compile vertex shader!" << std::endl;
-    return nullptr;
+    return false;
   }
 
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &FS_SOURCE, nullptr);
-  glCompileShader(fs);
-  glGetShaderiv(fs, GL_COMPILE_STATUS, &compiled);
-  if (!compiled) {
+  GLuint gs = 0;
+  if (single_pass &&
+      !CompileShader(GL_GEOMETRY_SHADER, SINGLE_PASS_GS_SOURCE, gs)) {
+    std::cerr << "[oss] failed to compile geometry shader!" << std::endl;
+    glDeleteShader(vs);
+    return false;
+  }
+
+  GLuint fs;
+  if (!CompileShader(GL_FRAGMENT_SHADER, FS_SOURCE, fs)) {
     std::cerr << "[oss] failed to compile fragment shader!" << std::endl;
-    return nullptr;
+    glDeleteShader(vs);
+    if (gs)
+      glDeleteShader(gs);
+    return false;
   }
 
+  GLuint program = glCreateProgram();
   glAttachShader(program, vs);
+  if (gs)
+    glAttachShader(program, gs);
   glAttachShader(program, fs);
   glLinkProgram(program);
 
-  GLint linked;
-  glGetProgramiv(program, GL_LINK_STATUS, &linked);
-  if (!linked) {
-    std::cerr << "[oss] failed to link program!" << std::endl;
-    return nullptr;
-  }
-
+  // The linked program no longer needs its shaders, whether or not it
+  // linked.
   glDetachShader(program, vs);
   glDetachShader(program, fs);
   glDeleteShader(vs);
   glDeleteShader(fs);
+  if (gs) {
+    glDetachShader(program, gs);
+    glDeleteShader(gs);
+  }
 
-  glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
-
-  GLuint cube_texture;
-  glGenTextures(1, &cube_texture);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, cube_texture);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-  for (int i = 0; i < 6; i++) {
-    glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, distance_internal_format(),
-                 texture_size, texture_size, 0, distance_format(), GL_FLOAT, nullptr);
+  GLint linked;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    std::cerr << "[oss] failed to link program!" << std::endl;
+    glDeleteProgram(program);
+    return false;
   }
-  glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 
-  return std::make_unique<OmniShadowStage>(program, fbo, cube_texture,
-                                           depth_tex, texture_size);
+  out_program = program;
+  return true;
 }
 
-OmniShadowStage::OmniShadowStage(GLuint program, GLuint fbo,
-                                 GLuint cube_texture, GLuint depth_texture,
-                                 GLsizei texture_size)
-  : program_(program), fbo_(fbo)
-  , cube_texture_(cube_texture), depth_texture_(depth_texture)
-  , texture_size_(texture_size) {
+OmniShadowStage::OmniShadowStage(RenderTargetPool& pool, RenderMode mode,
+                                 GLuint program, GLuint fbo,
+                                 const GLuint copy_fbos[2],
+                                 GLuint atlas_texture,
+                                 GLuint static_atlas_texture,
+                                 GLuint depth_texture, GLsizei atlas_size)
+  : pool_(pool), mode_(mode), program_(program), fbo_(fbo)
+  , copy_read_fbo_(copy_fbos[0]), copy_draw_fbo_(copy_fbos[1])
+  , atlas_texture_(atlas_texture), static_atlas_texture_(static_atlas_texture)
+  , depth_texture_(depth_texture), atlas_size_(atlas_size), cull_stats_()
+  , update_budget_(DEFAULT_UPDATE_BUDGET), updates_(0) {
   uniform_transform_ = glGetUniformLocation(program, "mvp_matrix");
+  uniform_face_transforms_ = glGetUniformLocation(program, "face_matrices");
+  uniform_face_offsets_ = glGetUniformLocation(program, "face_offsets");
+  uniform_face_scale_ = glGetUniformLocation(program, "face_scale");
+  uniform_face_mask_ = glGetUniformLocation(program, "face_mask");
   uniform_model_transform_ = glGetUniformLocation(program, "model_matrix");
   uniform_light_position_ = glGetUniformLocation(program, "light_position");
 }
 
+OmniShadowStage::~OmniShadowStage() {
+  const GLuint fbos[] = { fbo_, copy_read_fbo_, copy_draw_fbo_ };
+  glDeleteFramebuffers(3, fbos);
+  pool_.Release(atlas_texture_);
+  pool_.Release(static_atlas_texture_);
+  pool_.Release(depth_texture_);
+  glDeleteProgram(program_);
+}
+
+void OmniShadowStage::Allocate(const game::Camera& camera,
+                               const std::vector<PointLight>& lights) {
+  light_maps_.resize(lights.size());
+
+  // Rate lights by the screen-space radius of their reach. Lights whose reach
+  // is out of view can't affect the frame, and get no tiles.
+  const geo::Frustum frustum(camera.ComputeProjection());
+  const float focal_length = 0.5f * camera.viewport_height() /
+                             std::tan(0.5f * camera.fov());
+  const glm::vec3 eye = camera.Position();
+  bool changed = false;
+  for (size_t i = 0; i < lights.size(); i++) {
+    const PointLight& light = lights[i];
+    LightMap& map = light_maps_[i];
+
+    float importance = 0.f;
+    if (frustum.Intersects(glm::vec4(light.position, light.max_distance))) {
+      const glm::vec3 offset = light.position - eye;
+      const float dist_sq = glm::dot(offset, offset);
+      const float radius_sq = light.max_distance * light.max_distance;
+      importance = dist_sq > radius_sq
+          ? focal_length * light.max_distance / std::sqrt(dist_sq - radius_sq)
+          : std::numeric_limits<float>::max();
+    }
+    map.importance = importance;
+
+    const GLsizei size = TileSizeFor(importance, map.requested_size);
+    changed |= size != map.requested_size;
+    map.requested_size = size;
+  }
+  if (changed)
+    Pack();
+
+  update_order_.clear();
+  for (size_t i = 0; i < light_maps_.size(); i++) {
+    if (light_maps_[i].tile_size)
+      update_order_.push_back(i);
+  }
+  std::stable_sort(update_order_.begin(), update_order_.end(),
+                   [this](size_t a, size_t b) {
+    const LightMap& map_a = light_maps_[a];
+    const LightMap& map_b = light_maps_[b];
+    if (map_a.valid != map_b.valid)
+      return !map_a.valid;
+    return map_a.importance > map_b.importance;
+  });
+  updates_ = 0;
+}
+
+GLsizei OmniShadowStage::TileSizeFor(float importance,
+                                     GLsizei current_size) const {
+  if (importance <= 0.f)
+    return 0;
+  // Three tiles must fit across the atlas.
+  const GLsizei max_size = std::min(MAX_TILE_SIZE, atlas_size_ / 3);
+  GLsizei size = MIN_TILE_SIZE;
+  while (size < importance && size * 2 <= max_size) {
+    size *= 2;
+  }
+  if (size < current_size &&
+      importance > current_size * TILE_SHRINK_THRESHOLD) {
+    return current_size;
+  }
+  return size;
+}
+
+void OmniShadowStage::Pack() {
+  // Shelf pack blocks in order of decreasing size. With power-of-two sizes,
+  // little space is wasted besides the end of each shelf.
+  std::vector<size_t> order;
+  for (size_t i = 0; i < light_maps_.size(); i++) {
+    if (light_maps_[i].requested_size)
+      order.push_back(i);
+    else
+      light_maps_[i].tile_size = 0;
+  }
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    return light_maps_[a].requested_size > light_maps_[b].requested_size;
+  });
+
+  glm::ivec2 shelf(0, 0); // next free position on the current shelf
+  GLsizei shelf_height = 0;
+  for (size_t i : order) {
+    LightMap& map = light_maps_[i];
+    glm::ivec2 origin;
+    GLsizei size = map.requested_size;
+    // Settle for smaller tiles once the atlas fills up.
+    for (; size >= MIN_TILE_SIZE; size /= 2) {
+      if (shelf.x + 3 * size > atlas_size_) {
+        origin = glm::ivec2(0, shelf.y + shelf_height);
+      } else {
+        origin = shelf;
+      }
+      if (origin.y + 2 * size <= atlas_size_)
+        break;
+    }
+    if (size < MIN_TILE_SIZE) {
+      size = 0;
+    } else {
+      if (origin.y != shelf.y) {
+        shelf = origin;
+        shelf_height = 0;
+      }
+      shelf.x = origin.x + 3 * size;
+      shelf_height = std::max(shelf_height, 2 * size);
+    }
+
+    if (size != map.tile_size || (size && origin != map.origin)) {
+      map.tile_size = size;
+      map.origin = origin;
+      map.valid = false;
+      map.baked = false;
+    }
+  }
+}
+
 void OmniShadowStage::BuildShadowMap(const game::Camera& camera,
+                                     size_t light,
                                      const glm::vec3 position,
                                      MaterialIterator& iter) {
+  cull_stats_ = { 0, 0, 0 };
+  assert(light < light_maps_.size());
+  LightMap& map = light_maps_[light];
+  if (!map.tile_size)
+    return;
+
+  // Split casters into those unchanged since the static layer was baked, and
+  // those known to move. A baked caster that has moved is demoted to dynamic
+  // for good, forcing one final rebake without it.
+  const bool moved = !map.built || map.position != position;
+  bool dirty = moved || !map.baked;
+  size_t num_baked = 0;
+  static_casters_.clear();
+  dynamic_casters_.clear();
+  while (auto matit = iter.NextMaterial()) {
+    while (auto mesh = matit->Next()) {
+      if (dynamic_meshes_.count(mesh)) {
+        dynamic_casters_.push_back(mesh);
+        continue;
+      }
+      auto baked = map.casters.find(mesh);
+      if (baked == map.casters.end()) {
+        // Newly in range, e.g. streamed in.
+        static_casters_.push_back(mesh);
+        dirty = true;
+      } else if (baked->second != mesh->transform_version()) {
+        dynamic_meshes_.insert(mesh);
+        dynamic_casters_.push_back(mesh);
+        dirty = true;
+      } else {
+        static_casters_.push_back(mesh);
+        num_baked++;
+      }
+    }
+  }
+  iter.Reset();
+  // Catch baked casters that have left range, or were demoted by another
+  // light.
+  dirty |= num_baked != map.casters.size();
+
+  if (!dirty && dynamic_casters_.empty() && map.valid)
+    return;
+  // A stale map is better than none.
+  if (map.valid && updates_ >= update_budget_)
+    return;
+  updates_++;
+
   glUseProgram(program_);
-  glViewport(0, 0, texture_size_, texture_size_);
   glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, cube_texture_);
-
   glUniform3fv(uniform_light_position_, 1, glm::value_ptr(position));
   glDrawBuffers(1, (const GLenum[]) { GL_COLOR_ATTACHMENT0 });
   glEnable(GL_DEPTH_TEST);
-  glClearColor(0.0, 0.0, 0.0, 0.0);
-
-  for (int i = 0; i < 6; i++) {
-    GLenum face = GL_TEXTURE_CUBE_MAP_POSITIVE_X + i;
-    RenderFace(face, position, iter);
-    iter.Reset();
+  // The lighting pass leaves additive blending enabled.
+  glDisable(GL_BLEND);
+  // Clear to the farthest representable distance, so that dynamic casters
+  // can be merged in by taking the minimum.
+  const float far_distance = std::numeric_limits<float>::max();
+  glClearColor(far_distance, far_distance, far_distance, far_distance);
+
+  if (moved && !dynamic_casters_.empty()) {
+    // A moving light invalidates the bake every frame anyway, so draw all
+    // casters at once and rebake without the dynamic ones once it settles.
+    static_casters_.insert(static_casters_.end(), dynamic_casters_.begin(),
+                           dynamic_casters_.end());
+    RenderCasters(atlas_texture_, map, position, static_casters_, true);
+    map.baked = false;
+    map.casters.clear();
+  } else {
+    if (dirty) {
+      RenderCasters(static_atlas_texture_, map, position, static_casters_,
+                    true);
+      map.baked = true;
+      map.casters.clear();
+      for (const geo::Mesh* mesh : static_casters_) {
+        map.casters[mesh] = mesh->transform_version();
+      }
+    }
+    CopyStaticLayer(map);
+    if (!dynamic_casters_.empty()) {
+      glBindFramebuffer(GL_FRAMEBUFFER, fbo_);
+      glEnable(GL_BLEND);
+      glBlendEquation(GL_MIN);
+      glBlendFunc(GL_ONE, GL_ONE);
+      RenderCasters(atlas_texture_, map, position, dynamic_casters_, false);
+      glBlendEquation(GL_FUNC_ADD);
+      glDisable(GL_BLEND);
+    }
   }
-  glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+  map.valid = true;
+  map.built = true;
+  map.position = position;
+
+  glClearColor(0.0, 0.0, 0.0, 0.0);
   // FIXME: we only pass the camera to restore the viewport.
   glViewport(0, 0, camera.viewport_width(), camera.viewport_height());
 }
 
-void OmniShadowStage::RenderFace(GLenum face, const glm::vec3 position,
-                                 MaterialIterator& iter) {
+void OmniShadowStage::InvalidateShadowMap(size_t light) {
+  if (light < light_maps_.size())
+    light_maps_[light].baked = false;
+}
+
+glm::vec4 OmniShadowStage::tile(size_t light) const {
+  const float texel_size = 1.f / atlas_size_;
+  if (light >= light_maps_.size() || !light_maps_[light].valid)
+    return glm::vec4(0.f, 0.f, 0.f, texel_size);
+  const LightMap& map = light_maps_[light];
+  return glm::vec4(map.origin.x * texel_size, map.origin.y * texel_size,
+                   map.tile_size * texel_size, texel_size);
+}
+
+void OmniShadowStage::CopyStaticLayer(const LightMap& map) {
+  const GLint x0 = map.origin.x;
+  const GLint y0 = map.origin.y;
+  const GLint x1 = x0 + 3 * map.tile_size;
+  const GLint y1 = y0 + 2 * map.tile_size;
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, copy_read_fbo_);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, copy_draw_fbo_);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glDrawBuffers(1, (const GLenum[]) { GL_COLOR_ATTACHMENT0 });
+  glBlitFramebuffer(x0, y0, x1, y1, x0, y0, x1, y1, GL_COLOR_BUFFER_BIT,
+                    GL_NEAREST);
+}
+
+void OmniShadowStage::RenderCasters(GLuint texture, const LightMap& map,
+                                    const glm::vec3 position,
+                                    const std::vector<const geo::Mesh*>& casters,
+                                    bool clear) {
+  meshes_.clear();
+  spheres_.clear();
+  for (const geo::Mesh* mesh : casters) {
+    meshes_.push_back(mesh);
+    spheres_.push_back(mesh->world_bounding_sphere());
+  }
+  visible_.resize(meshes_.size());
+
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0);
+
+  // Only touch this light's block of the atlas.
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(map.origin.x, map.origin.y, 3 * map.tile_size, 2 * map.tile_size);
+  glClear(GL_DEPTH_BUFFER_BIT | (clear ? GL_COLOR_BUFFER_BIT : 0));
+
+  if (mode_ == RENDER_SINGLE_PASS) {
+    RenderSinglePass(map, position);
+  } else {
+    for (int i = 0; i < 6; i++) {
+      RenderFace(i, map, position);
+    }
+  }
+  glDisable(GL_SCISSOR_TEST);
+}
+
+/* static */
+glm::mat4 OmniShadowStage::FaceTransform(int face,
+                                         const glm::vec3& position) {
   glm::vec3 dir;
   glm::vec3 up;
-  switch (face) {
+  switch (GL_TEXTURE_CUBE_MAP_POSITIVE_X + face) {
     case GL_TEXTURE_CUBE_MAP_POSITIVE_X:
       dir = glm::vec3(1.f, 0.f, 0.f);
       up = glm::vec3(0.f, -1.f, 0.f);
@@ -184,23 +588,94 @@ void OmniShadowStage::RenderFace(GLenum face, const glm::vec3 position,
       break;
   }
 
-  glm::mat4 transform = glm::perspective(glm::radians(90.f), 1.f, Z_NEAR, Z_FAR) *
-                        glm::lookAt(position, position + dir, up);
+  return glm::perspective(glm::radians(90.f), 1.f, Z_NEAR, Z_FAR) *
+         glm::lookAt(position, position + dir, up);
+}
 
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, face, cube_texture_, 0);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void OmniShadowStage::RenderFace(int face, const LightMap& map,
+                                 const glm::vec3 position) {
+  const glm::mat4 transform = FaceTransform(face, position);
+
+  glViewport(map.origin.x + (face % 3) * map.tile_size,
+             map.origin.y + (face / 3) * map.tile_size,
+             map.tile_size, map.tile_size);
+
+  const geo::Frustum frustum(transform);
+  const size_t num_visible = frustum.CullSpheres(spheres_.data(),
+                                                 spheres_.size(),
+                                                 visible_.data());
+  cull_stats_.drawn += num_visible;
+  cull_stats_.culled += meshes_.size() - num_visible;
+
+  face_meshes_.clear();
+  mvp_matrices_.clear();
+  for (size_t i = 0; i < meshes_.size(); i++) {
+    if (visible_[i]) {
+      face_meshes_.push_back(meshes_[i]);
+      mvp_matrices_.push_back(meshes_[i]->model_matrix());
+    }
+  }
+  util::MultiplyMatrices(transform, mvp_matrices_.data(),
+                         mvp_matrices_.data(), mvp_matrices_.size());
+
+  for (size_t i = 0; i < face_meshes_.size(); i++) {
+    const geo::Mesh* mesh = face_meshes_[i];
+    glUniformMatrix4fv(uniform_transform_, 1, GL_FALSE, glm::value_ptr(mvp_matrices_[i]));
+    glUniformMatrix4fv(uniform_model_transform_, 1, GL_FALSE, glm::value_ptr(mesh->model_matrix()));
+    geo::VertexBuffer& buffer = mesh->array_buffer();
+    glBindVertexArray(buffer.vertex_array());
+    glDrawElements(GL_TRIANGLES, mesh->num_indices(), buffer.index_type(),
+                   nullptr);
+  }
 
-  while (auto matit = iter.NextMaterial()) {
-    while (auto mit = matit->Next()) {
-      glm::mat4 mvp_matrix = transform * mit->transform();
-      glUniformMatrix4fv(uniform_transform_, 1, GL_FALSE, glm::value_ptr(mvp_matrix));
-      glUniformMatrix4fv(uniform_model_transform_, 1, GL_FALSE, glm::value_ptr(mit->transform()));
-      geo::VertexBuffer& buffer = mit->array_buffer();
-      glBindVertexArray(buffer.vertex_array());
-      glDrawArrays(GL_TRIANGLES, 0, mit->num_vertices());
+}
+
+void OmniShadowStage::RenderSinglePass(const LightMap& map,
+                                       const glm::vec3 position) {
+  glm::mat4 transforms[6];
+  glm::vec2 offsets[6];
+  face_masks_.assign(meshes_.size(), 0);
+  for (int face = 0; face < 6; face++) {
+    transforms[face] = FaceTransform(face, position);
+    const glm::vec2 center = glm::vec2(map.origin) + (float) map.tile_size *
+        glm::vec2(face % 3 + 0.5f, face / 3 + 0.5f);
+    offsets[face] = center * (2.f / atlas_size_) - glm::vec2(1.f);
+
+    const geo::Frustum frustum(transforms[face]);
+    const size_t num_visible = frustum.CullSpheres(spheres_.data(),
+                                                   spheres_.size(),
+                                                   visible_.data());
+    cull_stats_.drawn += num_visible;
+    cull_stats_.culled += meshes_.size() - num_visible;
+    for (size_t i = 0; i < meshes_.size(); i++) {
+      face_masks_[i] |= visible_[i] << face;
     }
   }
 
+  glViewport(0, 0, atlas_size_, atlas_size_);
+  glUniformMatrix4fv(uniform_face_transforms_, 6, GL_FALSE,
+                     glm::value_ptr(transforms[0]));
+  glUniform2fv(uniform_face_offsets_, 6, glm::value_ptr(offsets[0]));
+  glUniform1f(uniform_face_scale_, (float) map.tile_size / atlas_size_);
+  for (int i = 0; i < 4; i++) {
+    glEnable(GL_CLIP_DISTANCE0 + i);
+  }
+
+  for (size_t i = 0; i < meshes_.size(); i++) {
+    if (!face_masks_[i])
+      continue;
+    const geo::Mesh* mesh = meshes_[i];
+    glUniform1i(uniform_face_mask_, face_masks_[i]);
+    glUniformMatrix4fv(uniform_model_transform_, 1, GL_FALSE, glm::value_ptr(mesh->model_matrix()));
+    geo::VertexBuffer& buffer = mesh->array_buffer();
+    glBindVertexArray(buffer.vertex_array());
+    glDrawElements(GL_TRIANGLES, mesh->num_indices(), buffer.index_type(),
+                   nullptr);
+  }
+
+  for (int i = 0; i < 4; i++) {
+    glDisable(GL_CLIP_DISTANCE0 + i);
+  }
 }
 
 }  // namespace pipe
@@ -3,60 +3,204 @@
 
 #include <glad/glad.h>
 #include <glm/glm.hpp>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "geo/frustum.h"
 #include "pipe/geometry_stage.h" // for Material(Mesh)Iterator
+#include "pipe/phong_stage.h" // for PointLight
 #include "game/camera.h"
 
 namespace quarke {
 namespace pipe {
 
 // An omni-directional shadow map implementation for point lights.
-// Stores cubemapped data for a single point light source.
 // Roughly based on http://http.developer.nvidia.com/GPUGems/gpugems_ch12.html.
 //
 // We use color buffers for the cube faces so we can store squared distances
 // without normalizing to [0, 1], avoiding additional calculations in the phong
 // FS.
+//
+// The shadow maps of all lights share a single 2D atlas, so that they can be
+// sampled together. Each light is allocated a block of 3x2 square tiles, one
+// per cube face in GL_TEXTURE_CUBE_MAP_POSITIVE_X order, sized by the light's
+// extent on screen. Lights out of view get no tiles.
+//
+// Shadow maps are cached per light. Casters are baked into a static layer that
+// is only rebuilt when the light moves or the set of static casters changes.
+// Casters seen to move are treated as dynamic from then on, and are drawn each
+// frame onto a copy of the static layer. Meshes are identified by address, so
+// casters must outlive the stage.
 class OmniShadowStage {
  public:
-  // texture_size must be a power of two.
-  static std::unique_ptr<OmniShadowStage> Create(GLsizei texture_size);
-  OmniShadowStage(GLuint program, GLuint fbo, GLuint cube_texture,
-                  GLuint depth_texture, GLsizei texture_size);
+  enum RenderMode {
+    // Submits each mesh once per light. A geometry shader projects triangles
+    // into the tiles of the faces they overlap, clipping them to each tile.
+    RENDER_SINGLE_PASS,
+    // Renders each face in a separate pass, submitting each mesh once per
+    // face it is visible in.
+    RENDER_PER_FACE,
+  };
+
+  // atlas_size must be a power of two. Atlases are acquired from `pool`,
+  // which must outlive the stage.
+  static std::unique_ptr<OmniShadowStage> Create(
+      RenderTargetPool& pool, GLsizei atlas_size,
+      RenderMode mode = RENDER_SINGLE_PASS);
+  OmniShadowStage(RenderTargetPool& pool, RenderMode mode, GLuint program,
+                  GLuint fbo,
+                  const GLuint copy_fbos[2], GLuint atlas_texture,
+                  GLuint static_atlas_texture, GLuint depth_texture,
+                  GLsizei atlas_size);
+  ~OmniShadowStage();
+
+  // Assigns atlas tiles to `lights` for the coming frame, based on their
+  // importance to `camera`. Indices into `lights` identify shadow maps from
+  // here on. Tiles only move when the requested sizes change.
+  void Allocate(const game::Camera& camera,
+                const std::vector<PointLight>& lights);
+
+  // Brings the shadow map of `light` up to date for the given light position
+  // in world space, redrawing only what has changed. Meshes are culled
+  // against the frustum of each face. Both render modes produce the same
+  // result.
+  // Once this frame's update budget is spent, lights with a usable shadow map
+  // are left as they are until a later frame.
+  void BuildShadowMap(const game::Camera& camera, size_t light,
+                      const glm::vec3 position, MaterialIterator& iter);
+
+  // Forces the static layer of `light` to be rebuilt on its next update.
+  void InvalidateShadowMap(size_t light);
 
-  // Constructs a cube shadow map at the given light position in world space.
-  // Each shadow stage stores 6 textures.
-  void BuildShadowMap(const game::Camera& camera, const glm::vec3 position,
-                      MaterialIterator& iter);
+  // Returns true if the atlas holds a shadow map for `light`'s current tiles,
+  // possibly out of date.
+  bool has_shadow_map(size_t light) const {
+    return light < light_maps_.size() && light_maps_[light].valid;
+  }
 
-  // Sets the size of each dimension of the cubemapped textures.
-  // `size` must be a power of two.
-  void SetTextureDimension(GLsizei size);
+  // Returns the lights allocated by the last Allocate(), ordered by update
+  // priority: lights without a valid shadow map first, then by importance.
+  const std::vector<size_t>& update_order() const { return update_order_; }
+
+  // Sets the number of shadow maps that may be updated per frame.
+  void set_update_budget(size_t budget) { update_budget_ = budget; }
 
   static GLenum depth_format() { return GL_DEPTH_COMPONENT; }
   static GLenum distance_format() { return GL_RED; }
-  GLuint cube_texture() { return cube_texture_; }
+
+  // Returns the GL_TEXTURE_2D atlas of squared distances from each light.
+  GLuint atlas_texture() const { return atlas_texture_; }
+
+  // Returns the location of `light`'s tiles in the atlas, packed as the
+  // normalized origin of its 3x2 block (xy), the normalized size of a face
+  // (z), and the normalized size of an atlas texel (w). z is zero if the
+  // light has no shadow map.
+  glm::vec4 tile(size_t light) const;
+
+  RenderMode mode() const { return mode_; }
+
+  // Returns the number of meshes drawn and culled by the last
+  // BuildShadowMap(), summed over all faces. Both are zero if the cached map
+  // was reused as is.
+  const geo::CullStats& cull_stats() const { return cull_stats_; }
  private:
+  struct LightMap {
+    LightMap()
+      : importance(0.f), tile_size(0), requested_size(0), valid(false)
+      , built(false), baked(false) {}
+
+    float importance; // projected radius of the light's reach, in pixels
+    GLsizei tile_size; // per face in texels, zero if unallocated
+    GLsizei requested_size;
+    glm::ivec2 origin; // of the 3x2 block in the atlas, in texels
+    bool valid; // true if the atlas holds a map for this allocation
+    bool built; // true once a map has been built at `position`
+    bool baked; // false if the static layer must be rebuilt
+    glm::vec3 position; // light position of the last build
+    // Static casters at bake time, with their transform versions.
+    std::unordered_map<const geo::Mesh*, uint32_t> casters;
+  };
 
-  // Called to render a face of the cube map.
+  // Returns the tile size to request for a light of the given importance,
+  // given the size it currently has.
+  GLsizei TileSizeFor(float importance, GLsizei current_size) const;
+
+  // Packs the requested tiles of all lights into the atlas, invalidating the
+  // maps of lights whose tiles moved.
+  void Pack();
+
+  // Copies the block of `map` from the static atlas to the atlas.
+  void CopyStaticLayer(const LightMap& map);
+
+  // Draws `casters` into the block of `map` in the atlas `texture`, clearing
+  // previous contents if `clear` is set.
+  // Assumes program_ is current and fbo_ is bound.
+  void RenderCasters(GLuint texture, const LightMap& map,
+                     const glm::vec3 position,
+                     const std::vector<const geo::Mesh*>& casters, bool clear);
+
+  // Returns the view-projection transform of the given cube face (in
+  // GL_TEXTURE_CUBE_MAP_POSITIVE_X order) for a light at `position`.
+  static glm::mat4 FaceTransform(int face, const glm::vec3& position);
+
+  // Called to render a face of `map` in RENDER_PER_FACE mode.
   // Assumes:
   // - program_ is the current program.
-  // - fbo_ is the bound framebuffer.
-  // - cube_texture_ is bound to GL_TEXTURE_CUBE_MAP.
-  // - viewport size is texture size.
-  void RenderFace(GLenum face, const glm::vec3 position, MaterialIterator& iter);
+  // - fbo_ is the bound framebuffer, with the target atlas attached.
+  // - meshes_ and spheres_ hold the shadow casters.
+  void RenderFace(int face, const LightMap& map, const glm::vec3 position);
+
+  // Renders all faces of `map` at once in RENDER_SINGLE_PASS mode, with the
+  // same assumptions as RenderFace().
+  void RenderSinglePass(const LightMap& map, const glm::vec3 position);
+
+  // Builds the program rendering distances in the given mode. Nothing is
+  // left allocated on failure.
+  static bool BuildShaderProgram(RenderMode mode, GLuint& out_program);
 
   static GLenum depth_internal_format() { return GL_DEPTH_COMPONENT; }
   static GLenum distance_internal_format() { return GL_R32F; }
 
+  RenderTargetPool& pool_;
+  const RenderMode mode_;
   const GLuint program_;
   const GLuint fbo_;
-  GLuint uniform_transform_;
+  const GLuint copy_read_fbo_; // static atlas attached
+  const GLuint copy_draw_fbo_; // atlas attached
+  GLuint uniform_transform_; // RENDER_PER_FACE only
+  GLuint uniform_face_transforms_; // RENDER_SINGLE_PASS only
+  GLuint uniform_face_offsets_; // RENDER_SINGLE_PASS only
+  GLuint uniform_face_scale_; // RENDER_SINGLE_PASS only
+  GLuint uniform_face_mask_; // RENDER_SINGLE_PASS only
   GLuint uniform_model_transform_;
   GLuint uniform_light_position_;
 
-  const GLuint cube_texture_;
+  const GLuint atlas_texture_;
+  const GLuint static_atlas_texture_;
   const GLuint depth_texture_;
-  GLsizei texture_size_;
+  const GLsizei atlas_size_;
+
+  geo::CullStats cull_stats_;
+
+  std::vector<LightMap> light_maps_; // by light index
+  std::vector<size_t> update_order_;
+  size_t update_budget_; // maximum shadow map updates per frame
+  size_t updates_; // shadow map updates so far this frame
+
+  // Casters seen to move, excluded from every static layer.
+  std::unordered_set<const geo::Mesh*> dynamic_meshes_;
+
+  // Casters of the current light, split by layer.
+  std::vector<const geo::Mesh*> static_casters_;
+  std::vector<const geo::Mesh*> dynamic_casters_;
+  // Shadow casters for the current layer, retained across faces.
+  std::vector<const geo::Mesh*> meshes_;
+  std::vector<glm::vec4> spheres_;
+  // Scratch space for per-face culling, retained to avoid reallocation.
+  std::vector<uint8_t> visible_;
+  std::vector<const geo::Mesh*> face_meshes_;
+  std::vector<glm::mat4> mvp_matrices_;
+  std::vector<uint8_t> face_masks_; // faces visible, by caster
 };
 
 }  // namespace pipe
@@ -21,8 +21,9 @@ void main() {
 )";
 
 /* static */
-unique_ptr<OverlayStage> Create(int width, int height) {
-  auto fstage = FragmentStage::Create(width, height, 1, FS_SOURCE);
+unique_ptr<OverlayStage> Create(RenderTargetPool& pool, int width, int height) {
+  auto fstage = FragmentStage::Create(pool, width, height, { GL_RGBA8 },
+                                      FS_SOURCE);
   if (!fstage) {
     std::cerr << "Failed to compile overlay fragment stage." << std::endl;
     return nullptr;
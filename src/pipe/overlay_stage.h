@@ -11,7 +11,8 @@ class OverlayStage {
  public:
   // Creates a new bitmap overlay stage with the given width, height, and
   // texture format.
-  static std::unique_ptr<OverlayStage> Create(int width, int height);
+  static std::unique_ptr<OverlayStage> Create(RenderTargetPool& pool,
+                                              int width, int height);
 
   OverlayStage(std::unique_ptr<FragmentStage> fstage, GLuint texture);
 
@@ -1,5 +1,7 @@
 #include "pipe/phong_stage.h"
 #include "game/camera.h"
+#include <algorithm>
+#include <cmath>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <iostream>
@@ -18,6 +20,9 @@ static const GLfloat SCREEN_VERTICES[] = {
 
 static const GLuint VS_IN_POSITION_LOCATION = 0;
 
+// Icosahedron subdivisions of the light volume sphere (320 faces).
+static const int VOLUME_SUBDIVISIONS = 2;
+
 static const char* PHONG_POINT_VS = R"(
 #version 330 core
 
@@ -28,21 +33,39 @@ void main(void) {
 }
 )";
 
-static const char* PHONG_POINT_FS = R"(
+// Transforms the unit light volume onto a light's sphere of influence.
+static const char* PHONG_VOLUME_VS = R"(
 #version 330 core
 
+uniform mat4 mvp;
+
+layout(location = 0) in vec3 position;
+
+void main(void) {
+  gl_Position = mvp * vec4(position, 1.0);
+}
+)";
+
+// Shared by all lighting modes; each appends its own main(). Preceded by the
+// G-buffer layout definitions and normal decoding from GeometryStage.
+static const char* PHONG_COMMON_FS = R"(
 uniform sampler2DRect colorSampler;
 uniform sampler2DRect normalSampler;
+uniform sampler2D depthSampler;
+
+#ifdef GBUFFER_COMPACT
+// positions are reconstructed from depth
+uniform mat4 inverseViewProjection;
+uniform vec2 viewportSize;
+#else
 uniform sampler2DRect positionSampler;
-uniform sampler2DRect depthSampler;
+#endif
 
 uniform vec3 eye;
-uniform vec3 lightPosition;
-uniform vec4 lightColor;
-uniform float lightDistance;
 
-// omni-directional cube map containing fragment distances from the light source
-uniform samplerCube shadowSamplerCube;
+// atlas of omni-directional shadow maps containing fragment distances from
+// each light source
+uniform sampler2D shadowAtlas;
 
 // TODO: implement this per-material. perhaps a specular buffer?
 const float specularPower = 5.0;
@@ -52,20 +75,66 @@ const float shadowMapEpsilon = 0.05;
 
 out vec4 outLight;
 
-void main(void) {
-  vec4 albedo = texture(colorSampler, gl_FragCoord.xy);
-  vec3 normal = texture(normalSampler, gl_FragCoord.xy).xyz;
-  vec3 pos = texture(positionSampler, gl_FragCoord.xy).xyz;
-  //float depth = texture(depthSampler, gl_FragCoord.xy).r;
+// Reads the albedo, world space normal and world space position of the
+// current pixel from the G-buffer.
+void readGBuffer(out vec4 albedo, out vec3 normal, out vec3 pos) {
+  albedo = texture(colorSampler, gl_FragCoord.xy);
+  normal = decodeNormal(texture(normalSampler, gl_FragCoord.xy));
+#ifdef GBUFFER_COMPACT
+  float depth = texelFetch(depthSampler, ivec2(gl_FragCoord.xy), 0).r;
+  vec3 ndc = vec3(gl_FragCoord.xy / viewportSize, depth) * 2.0 - 1.0;
+  vec4 world = inverseViewProjection * vec4(ndc, 1.0);
+  pos = world.xyz / world.w;
+#else
+  pos = texture(positionSampler, gl_FragCoord.xy).xyz;
+#endif
+}
+
+// Maps a direction from the light to its texel in the shadow atlas, with faces
+// laid out in a 3x2 grid in cube map order and projected as cube map faces.
+// shadowTile holds the light's block origin (xy), face size (z), and texel
+// size (w).
+vec2 shadowAtlasCoord(vec3 dir, vec4 shadowTile) {
+  vec3 a = abs(dir);
+  int face;
+  vec2 st;
+  float ma;
+  if (a.x >= a.y && a.x >= a.z) {
+    face = dir.x > 0.0 ? 0 : 1;
+    st = vec2(dir.x > 0.0 ? -dir.z : dir.z, -dir.y);
+    ma = a.x;
+  } else if (a.y >= a.z) {
+    face = dir.y > 0.0 ? 2 : 3;
+    st = vec2(dir.x, dir.y > 0.0 ? dir.z : -dir.z);
+    ma = a.y;
+  } else {
+    face = dir.z > 0.0 ? 4 : 5;
+    st = vec2(dir.z > 0.0 ? dir.x : -dir.x, -dir.y);
+    ma = a.z;
+  }
+  // Keep to the face's own texels, as neighbouring tiles are unrelated.
+  float halfTexel = 0.5 * shadowTile.w;
+  vec2 uv = clamp((st / ma * 0.5 + 0.5) * shadowTile.z, halfTexel,
+                  shadowTile.z - halfTexel);
+  return shadowTile.xy + vec2(face % 3, face / 3) * shadowTile.z + uv;
+}
 
+// Computes the light reaching a surface from a point light. No shadows are
+// cast if the shadow tile's face size is zero.
+vec4 shadePointLight(vec4 albedo, vec3 normal, vec3 pos, vec3 lightPosition,
+                     vec4 lightColor, float lightDistance, vec4 shadowTile) {
   vec3 pos_light = pos - lightPosition;
   float distSq = dot(pos_light, pos_light);
 
   // shadow mapping
-  float shadowDepth = texture(shadowSamplerCube, pos_light).r;
-  float shadowIntensity = 0.25; // soft shadows
-  if (abs(shadowDepth - distSq) < shadowMapEpsilon) {
-    shadowIntensity = 1.0; // if within a margin of error of the correct depth, illuminate
+  float shadowIntensity = 1.0;
+  if (shadowTile.z > 0.0) {
+    float shadowDepth = texture(shadowAtlas,
+                                shadowAtlasCoord(pos_light, shadowTile)).r;
+    shadowIntensity = 0.25; // soft shadows
+    if (abs(shadowDepth - distSq) < shadowMapEpsilon) {
+      shadowIntensity = 1.0; // if within a margin of error of the correct depth, illuminate
+    }
   }
 
   vec3 d = normalize(lightPosition - pos);
@@ -73,56 +142,181 @@ void main(void) {
   vec4 diffuseColor = albedo * lightColor * dIntensity;
 
   vec3 dEye = normalize(eye - pos);
-  vec3 half = normalize(dEye + d);
+  vec3 halfway = normalize(dEye + d);
 
-  float sIntensity = max(dot(half, normal), 0.0);
+  float sIntensity = max(dot(halfway, normal), 0.0);
   vec4 specularColor = lightColor * pow(sIntensity, specularPower);
 
   // Use a nonlinearity for falloff around the edges.
   float dist = sqrt(distSq);
   float lightIntensity = max(1.0 - pow(dist/lightDistance, 2.0), 0.0);
 
-  outLight = shadowIntensity * lightIntensity * (diffuseColor + specularColor);
+  return shadowIntensity * lightIntensity * (diffuseColor + specularColor);
+}
+)";
+
+static const char* PHONG_POINT_FS = R"(
+uniform vec3 lightPosition;
+uniform vec4 lightColor;
+uniform float lightDistance;
+// this light's tiles in the shadow atlas
+uniform vec4 shadowTile;
+
+void main(void) {
+  vec4 albedo;
+  vec3 normal, pos;
+  readGBuffer(albedo, normal, pos);
+
+  vec4 c = shadePointLight(albedo, normal, pos, lightPosition, lightColor,
+                           lightDistance, shadowTile);
+  outLight = c * c.a;
+}
+)";
+
+static const char* PHONG_CLUSTERED_FS = R"(
+// three texels per light: position and reach, color, and shadow tile
+uniform samplerBuffer lights;
+// offset and count of each cluster's range of light indices
+uniform usamplerBuffer clusters;
+uniform usamplerBuffer lightIndices;
+
+uniform mat4 view;
+uniform ivec3 clusterCounts; // tiles in x and y, depth slices
+uniform int tileSize; // in pixels
+uniform vec2 sliceParams; // slice = log(depth) * x + y
+
+void main(void) {
+  vec4 albedo;
+  vec3 normal, pos;
+  readGBuffer(albedo, normal, pos);
+
+  float depth = -(view * vec4(pos, 1.0)).z;
+  int slice = int(floor(log(max(depth, 1e-6)) * sliceParams.x + sliceParams.y));
+  slice = clamp(slice, 0, clusterCounts.z - 1);
+  ivec2 tile = min(ivec2(gl_FragCoord.xy) / tileSize, clusterCounts.xy - 1);
+  int cluster = (slice * clusterCounts.y + tile.y) * clusterCounts.x + tile.x;
+  uvec2 range = texelFetch(clusters, cluster).xy;
+
+  vec4 light = vec4(0.0);
+  for (uint i = 0u; i < range.y; i++) {
+    int l = 3 * int(texelFetch(lightIndices, int(range.x + i)).r);
+    vec4 positionDistance = texelFetch(lights, l);
+    vec4 c = shadePointLight(albedo, normal, pos, positionDistance.xyz,
+                             texelFetch(lights, l + 1), positionDistance.w,
+                             texelFetch(lights, l + 2));
+    // Sum as the per-light passes would be blended.
+    light += c * c.a;
+  }
+  outLight = light;
 }
 )";
 
-std::unique_ptr<PhongStage> PhongStage::Create(int width,
+// Tiling of the light grid, in pixels and depth slices respectively.
+static const int CLUSTER_TILE_SIZE = 32;
+static const int CLUSTER_SLICES = 24;
+
+// Builds a triangle list of a subdivided icosahedron, wound counter-clockwise
+// when seen from outside and scaled such that it encloses the unit sphere.
+static std::vector<glm::vec3> BuildVolumeSphere(int subdivisions) {
+  const float t = (1.f + std::sqrt(5.f)) / 2.f;
+  const glm::vec3 v[] = {
+    { -1, t, 0 }, { 1, t, 0 }, { -1, -t, 0 }, { 1, -t, 0 },
+    { 0, -1, t }, { 0, 1, t }, { 0, -1, -t }, { 0, 1, -t },
+    { t, 0, -1 }, { t, 0, 1 }, { -t, 0, -1 }, { -t, 0, 1 },
+  };
+  const int faces[][3] = {
+    { 0, 11, 5 }, { 0, 5, 1 }, { 0, 1, 7 }, { 0, 7, 10 }, { 0, 10, 11 },
+    { 1, 5, 9 }, { 5, 11, 4 }, { 11, 10, 2 }, { 10, 7, 6 }, { 7, 1, 8 },
+    { 3, 9, 4 }, { 3, 4, 2 }, { 3, 2, 6 }, { 3, 6, 8 }, { 3, 8, 9 },
+    { 4, 9, 5 }, { 2, 4, 11 }, { 6, 2, 10 }, { 8, 6, 7 }, { 9, 8, 1 },
+  };
+  std::vector<glm::vec3> tris;
+  for (const auto& f : faces) {
+    tris.push_back(glm::normalize(v[f[0]]));
+    tris.push_back(glm::normalize(v[f[1]]));
+    tris.push_back(glm::normalize(v[f[2]]));
+  }
+
+  for (int i = 0; i < subdivisions; i++) {
+    std::vector<glm::vec3> split;
+    split.reserve(tris.size() * 4);
+    for (size_t j = 0; j < tris.size(); j += 3) {
+      const glm::vec3 a = tris[j], b = tris[j + 1], c = tris[j + 2];
+      const glm::vec3 ab = glm::normalize(a + b);
+      const glm::vec3 bc = glm::normalize(b + c);
+      const glm::vec3 ca = glm::normalize(c + a);
+      const glm::vec3 sub[] = { a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca };
+      split.insert(split.end(), sub, sub + 12);
+    }
+    tris.swap(split);
+  }
+
+  // The faces cut inside the sphere; push them out until the closest face
+  // touches it.
+  float min_distance = 1.f;
+  for (size_t j = 0; j < tris.size(); j += 3) {
+    glm::vec3 n = glm::cross(tris[j + 1] - tris[j], tris[j + 2] - tris[j]);
+    if (glm::dot(n, tris[j]) < 0.f) {
+      std::swap(tris[j + 1], tris[j + 2]);
+      n = -n;
+    }
+    min_distance = std::min(min_distance,
+                            glm::dot(glm::normalize(n), tris[j]));
+  }
+  for (glm::vec3& p : tris) {
+    p = p / min_distance;
+  }
+  return tris;
+}
+
+std::unique_ptr<PhongStage> PhongStage::Create(RenderTargetPool& pool,
+                                               int width,
                                                int height,
                                                GLuint color_tex,
                                                GLuint normal_tex,
                                                GLuint position_tex,
-                                               GLuint depth_tex) {
+                                               GLuint depth_tex,
+                                               GeometryStage::Layout layout,
+                                               LightingMode mode) {
   const GLenum LIGHT_BUFFER = GL_COLOR_ATTACHMENT0;
 
   GLuint fbo;
   glGenFramebuffers(1, &fbo);
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 
-  GLuint light_tex;
-  glGenTextures(1, &light_tex);
-  glBindTexture(GL_TEXTURE_RECTANGLE, light_tex);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
+  GLuint light_tex = pool.Acquire({ width, height, format(),
+                                    GL_TEXTURE_RECTANGLE });
   glFramebufferTexture(GL_FRAMEBUFFER, LIGHT_BUFFER, light_tex, 0);
 
-  GLuint light_depth_tex;
-  glGenTextures(1, &light_depth_tex);
-  glBindTexture(GL_TEXTURE_RECTANGLE, light_depth_tex);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_DEPTH_COMPONENT, width, height, 0,
-               GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, light_depth_tex, 0);
+  // Light volumes are tested against a copy of the G-buffer's depth, as
+  // lighting samples depth_tex, which mustn't be attached while it does.
+  GLuint stencil_tex = 0;
+  if (mode == LIGHTING_VOLUMES) {
+    stencil_tex = pool.Acquire({ width, height, GeometryStage::depth_format(),
+                                 GL_TEXTURE_2D });
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                         stencil_tex, 0);
+  }
 
   if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
     std::cerr << "[phong] Incomplete framebuffer." << std::endl;
     glDeleteFramebuffers(1, &fbo);
-    glDeleteTextures(1, &light_tex);
-    glDeleteTextures(1, &light_depth_tex);
+    pool.Release(light_tex);
+    if (stencil_tex)
+      pool.Release(stencil_tex);
     return nullptr;
   }
 
   GLuint program;
-  if (!BuildShaderProgram(program)) {
+  GLuint stencil_program = 0;
+  if (!BuildShaderProgram(mode, layout, program) ||
+      (mode == LIGHTING_VOLUMES &&
+       !BuildStencilProgram(stencil_program))) {
     std::cerr << "[phong] Building shader program failed." << std::endl;
+    glDeleteFramebuffers(1, &fbo);
+    pool.Release(light_tex);
+    if (stencil_tex)
+      pool.Release(stencil_tex);
     return nullptr;
   }
 
@@ -139,44 +333,132 @@ std::unique_ptr<PhongStage> PhongStage::Create(int width,
                         sizeof(GLfloat) * 2, nullptr);
   // TODO: restore current VAO? may be called within context.
 
-  return std::make_unique<PhongStage>(width, height, program, fbo,
-                                      LIGHT_BUFFER, light_tex, light_depth_tex,
+  GLuint volume_vbo = 0;
+  GLuint volume_vao = 0;
+  GLsizei volume_vertices = 0;
+  if (mode == LIGHTING_VOLUMES) {
+    const std::vector<glm::vec3> sphere =
+        BuildVolumeSphere(VOLUME_SUBDIVISIONS);
+    volume_vertices = sphere.size();
+
+    glGenBuffers(1, &volume_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, volume_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sphere.size() * sizeof(glm::vec3),
+                 sphere.data(), GL_STATIC_DRAW);
+
+    glGenVertexArrays(1, &volume_vao);
+    glBindVertexArray(volume_vao);
+    glEnableVertexAttribArray(VS_IN_POSITION_LOCATION);
+    glVertexAttribPointer(VS_IN_POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE,
+                          sizeof(glm::vec3), nullptr);
+  }
+
+  // Texture buffers holding the light grid, refilled each frame.
+  const GLenum CLUSTER_FORMATS[] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+  GLuint cluster_buffers[NUM_CLUSTER_BUFFERS] = {};
+  GLuint cluster_textures[NUM_CLUSTER_BUFFERS] = {};
+  if (mode == LIGHTING_CLUSTERED) {
+    glGenBuffers(NUM_CLUSTER_BUFFERS, cluster_buffers);
+    glGenTextures(NUM_CLUSTER_BUFFERS, cluster_textures);
+    for (int i = 0; i < NUM_CLUSTER_BUFFERS; i++) {
+      glBindBuffer(GL_TEXTURE_BUFFER, cluster_buffers[i]);
+      glBufferData(GL_TEXTURE_BUFFER, 0, nullptr, GL_STREAM_DRAW);
+      glBindTexture(GL_TEXTURE_BUFFER, cluster_textures[i]);
+      glTexBuffer(GL_TEXTURE_BUFFER, CLUSTER_FORMATS[i], cluster_buffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  }
+
+  return std::make_unique<PhongStage>(pool, width, height, mode, program, fbo,
+                                      LIGHT_BUFFER, light_tex,
                                       screen_vbo, screen_vao, color_tex, normal_tex,
-                                      position_tex, depth_tex);
+                                      position_tex, depth_tex, stencil_tex,
+                                      cluster_buffers,
+                                      cluster_textures, stencil_program,
+                                      volume_vbo, volume_vao, volume_vertices);
 }
-PhongStage::PhongStage(int width, int height, GLuint program,
-                       GLuint light_fbo, GLuint light_buffer,
-                       GLuint light_tex, GLuint light_depth_tex,
-                       GLuint screen_vbo, GLuint screen_vao,
+PhongStage::PhongStage(RenderTargetPool& pool, int width, int height,
+                       LightingMode mode, GLuint program, GLuint light_fbo, GLuint light_buffer,
+                       GLuint light_tex, GLuint screen_vbo, GLuint screen_vao,
                        GLuint color_tex, GLuint normal_tex, GLuint position_tex,
-                       GLuint depth_tex)
-  : out_width_(width), out_height_(height), program_(program)
+                       GLuint depth_tex, GLuint stencil_tex,
+                       const GLuint cluster_buffers[NUM_CLUSTER_BUFFERS],
+                       const GLuint cluster_textures[NUM_CLUSTER_BUFFERS],
+                       GLuint stencil_program, GLuint volume_vbo,
+                       GLuint volume_vao, GLsizei volume_vertices)
+  : pool_(pool), out_width_(width), out_height_(height), mode_(mode)
+  , program_(program)
   , light_fbo_(light_fbo), light_buffer_(light_buffer), light_tex_(light_tex)
-  , light_depth_tex_(light_depth_tex), screen_vbo_(screen_vbo)
+  , screen_vbo_(screen_vbo)
   , screen_vao_(screen_vao), color_tex_(color_tex), normal_tex_(normal_tex)
   , position_tex_(position_tex), depth_tex_(depth_tex)
+  , stencil_tex_(stencil_tex), stencil_program_(stencil_program), volume_vbo_(volume_vbo)
+  , volume_vao_(volume_vao), volume_vertices_(volume_vertices)
+  , light_grid_(CLUSTER_TILE_SIZE, CLUSTER_SLICES)
 {
+  std::copy(cluster_buffers, cluster_buffers + NUM_CLUSTER_BUFFERS,
+            cluster_buffers_);
+  std::copy(cluster_textures, cluster_textures + NUM_CLUSTER_BUFFERS,
+            cluster_textures_);
+
   // TODO: construct vs/fs using streams+consts so we don't have to have magic strings
   color_sampler_location_ = glGetUniformLocation(program, "colorSampler");
   normal_sampler_location_ = glGetUniformLocation(program, "normalSampler");
   position_sampler_location_ = glGetUniformLocation(program, "positionSampler");
   depth_sampler_location_ = glGetUniformLocation(program, "depthSampler");
   eye_position_location_ = glGetUniformLocation(program, "eye");
+  shadow_sampler_location_ = glGetUniformLocation(program, "shadowAtlas");
+  inverse_vp_location_ = glGetUniformLocation(program, "inverseViewProjection");
+  viewport_size_location_ = glGetUniformLocation(program, "viewportSize");
+
   light_position_location_ = glGetUniformLocation(program, "lightPosition");
   light_color_location_ = glGetUniformLocation(program, "lightColor");
   light_distance_location_ = glGetUniformLocation(program, "lightDistance");
-  shadow_sampler_location_ = glGetUniformLocation(program, "shadowSamplerCube");
+  shadow_tile_location_ = glGetUniformLocation(program, "shadowTile");
+
+  lights_sampler_location_ = glGetUniformLocation(program, "lights");
+  clusters_sampler_location_ = glGetUniformLocation(program, "clusters");
+  indices_sampler_location_ = glGetUniformLocation(program, "lightIndices");
+  view_location_ = glGetUniformLocation(program, "view");
+  cluster_counts_location_ = glGetUniformLocation(program, "clusterCounts");
+  tile_size_location_ = glGetUniformLocation(program, "tileSize");
+  slice_params_location_ = glGetUniformLocation(program, "sliceParams");
+
+  volume_mvp_location_ = glGetUniformLocation(program, "mvp");
+  if (stencil_program)
+    stencil_mvp_location_ = glGetUniformLocation(stencil_program, "mvp");
+}
+
+PhongStage::~PhongStage() {
+  pool_.Release(light_tex_);
+  glDeleteFramebuffers(1, &light_fbo_);
+  glDeleteVertexArrays(1, &screen_vao_);
+  glDeleteBuffers(1, &screen_vbo_);
+  glDeleteProgram(program_);
+  if (mode_ == LIGHTING_CLUSTERED) {
+    glDeleteTextures(NUM_CLUSTER_BUFFERS, cluster_textures_);
+    glDeleteBuffers(NUM_CLUSTER_BUFFERS, cluster_buffers_);
+  }
+  if (mode_ == LIGHTING_VOLUMES) {
+    pool_.Release(stencil_tex_);
+    glDeleteProgram(stencil_program_);
+    glDeleteVertexArrays(1, &volume_vao_);
+    glDeleteBuffers(1, &volume_vbo_);
+  }
 }
 
 void PhongStage::Clear() {
   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, light_fbo_);
   glDrawBuffers(1, (const GLenum*) &light_buffer_);
-  glClearColor(0.0, 0.0, 0.0, 0.0);
+  glClearColor(0.0, 0.0, 0.0, 1.0);
   glClear(GL_COLOR_BUFFER_BIT);
 }
 
-void PhongStage::Illuminate(const game::Camera& camera, const PointLight& light,
-                            GLuint shadow_cubemap) {
+void PhongStage::Illuminate(const game::Camera& camera,
+                            const std::vector<PointLight>& lights,
+                            GLuint shadow_atlas,
+                            const std::vector<glm::vec4>& shadow_tiles) {
   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, light_fbo_);
   glDrawBuffers(1, (const GLenum*) &light_buffer_);
 
@@ -201,42 +483,176 @@ void PhongStage::Illuminate(const game::Camera& camera, const PointLight& light,
   glUniform1i(depth_sampler_location_, 3);
 
   glActiveTexture(GL_TEXTURE4);
-  glBindTexture(GL_TEXTURE_CUBE_MAP, shadow_cubemap);
+  glBindTexture(GL_TEXTURE_2D, shadow_atlas);
   glUniform1i(shadow_sampler_location_, 4);
 
   glUniform3fv(eye_position_location_, 1, glm::value_ptr(camera.Position()));
-  glUniform3fv(light_position_location_, 1, glm::value_ptr(light.position));
-  glUniform4fv(light_color_location_, 1, glm::value_ptr(light.color));
-  glUniform1f(light_distance_location_, light.max_distance);
+  glUniformMatrix4fv(inverse_vp_location_, 1, GL_FALSE,
+                     glm::value_ptr(glm::inverse(camera.ComputeProjection())));
+  glUniform2f(viewport_size_location_, camera.viewport_width(),
+              camera.viewport_height());
 
-  // Additive blending
+  glDisable(GL_DEPTH_TEST);
+  // Additive blending of lights premultiplied by their alpha, attenuated by
+  // the ambient occlusion held in the light buffer's alpha, which is kept.
   glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+  glBlendFuncSeparate(GL_DST_ALPHA, GL_ONE, GL_ZERO, GL_ONE);
+
+  if (mode_ == LIGHTING_CLUSTERED) {
+    IlluminateClustered(camera, lights, shadow_tiles);
+  } else if (mode_ == LIGHTING_VOLUMES) {
+    IlluminateVolumes(camera, lights, shadow_tiles);
+  } else {
+    for (size_t i = 0; i < lights.size(); i++) {
+      const PointLight& light = lights[i];
+      glUniform3fv(light_position_location_, 1, glm::value_ptr(light.position));
+      glUniform4fv(light_color_location_, 1, glm::value_ptr(light.color));
+      glUniform1f(light_distance_location_, light.max_distance);
+      glUniform4fv(shadow_tile_location_, 1, glm::value_ptr(shadow_tiles[i]));
+      glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    }
+  }
+
+  glActiveTexture(GL_TEXTURE4);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void PhongStage::IlluminateClustered(
+    const game::Camera& camera, const std::vector<PointLight>& lights,
+    const std::vector<glm::vec4>& shadow_tiles) {
+  light_grid_.Build(camera, lights);
+  // Nothing to draw if no light reaches the view.
+  if (light_grid_.indices().empty())
+    return;
+
+  light_data_.resize(3 * lights.size());
+  for (size_t i = 0; i < lights.size(); i++) {
+    const PointLight& light = lights[i];
+    light_data_[3 * i] = glm::vec4(light.position, light.max_distance);
+    light_data_[3 * i + 1] = light.color;
+    light_data_[3 * i + 2] = shadow_tiles[i];
+  }
+
+  // Orphan last frame's storage rather than waiting on draws still using it.
+  glBindBuffer(GL_TEXTURE_BUFFER, cluster_buffers_[CLUSTER_BUFFER_LIGHTS]);
+  glBufferData(GL_TEXTURE_BUFFER, light_data_.size() * sizeof(glm::vec4),
+               light_data_.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, cluster_buffers_[CLUSTER_BUFFER_CLUSTERS]);
+  glBufferData(GL_TEXTURE_BUFFER,
+               light_grid_.clusters().size() * sizeof(LightGrid::Cluster),
+               light_grid_.clusters().data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, cluster_buffers_[CLUSTER_BUFFER_INDICES]);
+  glBufferData(GL_TEXTURE_BUFFER,
+               light_grid_.indices().size() * sizeof(uint32_t),
+               light_grid_.indices().data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+  const GLuint samplers[] = {
+    lights_sampler_location_,
+    clusters_sampler_location_,
+    indices_sampler_location_,
+  };
+  for (int i = 0; i < NUM_CLUSTER_BUFFERS; i++) {
+    glActiveTexture(GL_TEXTURE5 + i);
+    glBindTexture(GL_TEXTURE_BUFFER, cluster_textures_[i]);
+    glUniform1i(samplers[i], 5 + i);
+  }
+
+  glUniformMatrix4fv(view_location_, 1, GL_FALSE,
+                     glm::value_ptr(camera.ComputeView()));
+  glUniform3i(cluster_counts_location_, light_grid_.tiles_x(),
+              light_grid_.tiles_y(), light_grid_.num_slices());
+  glUniform1i(tile_size_location_, light_grid_.tile_size());
+  glUniform2f(slice_params_location_, light_grid_.slice_scale(),
+              light_grid_.slice_bias());
 
-  glDisable(GL_DEPTH_TEST);
   glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 
-  glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+  for (int i = 0; i < NUM_CLUSTER_BUFFERS; i++) {
+    glActiveTexture(GL_TEXTURE5 + i);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+  }
 }
 
-void PhongStage::Resize(int width, int height) {
-  out_width_ = width;
-  out_height_ = height;
-  glBindTexture(GL_TEXTURE_RECTANGLE, light_tex_);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, format(), width, height, 0,
-               GL_RGBA, GL_FLOAT, nullptr);
-  glBindTexture(GL_TEXTURE_RECTANGLE, light_depth_tex_);
-  glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_DEPTH_COMPONENT, width, height, 0,
-               GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+void PhongStage::IlluminateVolumes(
+    const game::Camera& camera, const std::vector<PointLight>& lights,
+    const std::vector<glm::vec4>& shadow_tiles) {
+  const glm::mat4 vp_matrix = camera.ComputeProjection();
+
+  // Copy the scene's depth to test volumes against, along with its cleared
+  // stencil.
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, pool_.Framebuffer(depth_tex_));
+  glBlitFramebuffer(0, 0, out_width_, out_height_, 0, 0, out_width_,
+                    out_height_, GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT,
+                    GL_NEAREST);
+
+  glBindVertexArray(volume_vao_);
+  glEnable(GL_STENCIL_TEST);
+  glDepthMask(GL_FALSE);
+
+  for (size_t i = 0; i < lights.size(); i++) {
+    const PointLight& light = lights[i];
+    glm::mat4 model_matrix(light.max_distance);
+    model_matrix[3] = glm::vec4(light.position, 1.f);
+    const glm::mat4 mvp = vp_matrix * model_matrix;
+
+    // Mark the scene surfaces inside the volume: those behind its front
+    // faces but in front of its back faces. Faces clipped by the near plane
+    // leave back faces alone to mark the surfaces in front of them.
+    glUseProgram(stencil_program_);
+    glUniformMatrix4fv(stencil_mvp_location_, 1, GL_FALSE,
+                       glm::value_ptr(mvp));
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glStencilFunc(GL_ALWAYS, 0, 0);
+    glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+    glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+    glDrawArrays(GL_TRIANGLES, 0, volume_vertices_);
+
+    // Shade the marked pixels through the back faces, which stay visible
+    // with the camera inside the volume.
+    glUseProgram(program_);
+    glUniformMatrix4fv(volume_mvp_location_, 1, GL_FALSE, glm::value_ptr(mvp));
+    glUniform3fv(light_position_location_, 1, glm::value_ptr(light.position));
+    glUniform4fv(light_color_location_, 1, glm::value_ptr(light.color));
+    glUniform1f(light_distance_location_, light.max_distance);
+    glUniform4fv(shadow_tile_location_, 1, glm::value_ptr(shadow_tiles[i]));
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+    glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    glDrawArrays(GL_TRIANGLES, 0, volume_vertices_);
+
+    // Clear the marks for the next light.
+    glUseProgram(stencil_program_);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDisable(GL_CULL_FACE);
+    glStencilFunc(GL_ALWAYS, 0, 0);
+    glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
+    glDrawArrays(GL_TRIANGLES, 0, volume_vertices_);
+  }
+
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+  glCullFace(GL_BACK);
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_STENCIL_TEST);
+  glDepthMask(GL_TRUE);
 }
 
-bool PhongStage::BuildShaderProgram(GLuint& out_program) {
+bool PhongStage::BuildShaderProgram(LightingMode mode,
+                                    GeometryStage::Layout layout,
+                                    GLuint& out_program) {
   GLuint program = glCreateProgram();
   GLint compiled;
 
   GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  GLint vs_len = sizeof(PHONG_POINT_VS);
-  glShaderSource(vs, 1, &PHONG_POINT_VS, nullptr);
+  glShaderSource(vs, 1,
+                 mode == LIGHTING_VOLUMES ? &PHONG_VOLUME_VS : &PHONG_POINT_VS,
+                 nullptr);
   glCompileShader(vs);
 
   glGetShaderiv(vs, GL_COMPILE_STATUS, &compiled);
@@ -245,9 +661,15 @@ bool PhongStage::BuildShaderProgram(GLuint& out_program) {
     return false;
   }
 
+  const char* fs_sources[] = {
+    "#version 330 core\n",
+    GeometryStage::layout_defines(layout),
+    GeometryStage::normal_decode_source(),
+    PHONG_COMMON_FS,
+    mode == LIGHTING_CLUSTERED ? PHONG_CLUSTERED_FS : PHONG_POINT_FS,
+  };
   GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  GLint fs_len = sizeof(PHONG_POINT_FS);
-  glShaderSource(fs, 1, &PHONG_POINT_FS, nullptr);
+  glShaderSource(fs, 5, fs_sources, nullptr);
   glCompileShader(fs);
 
   glGetShaderiv(fs, GL_COMPILE_STATUS, &compiled);
@@ -271,5 +693,36 @@ bool PhongStage::BuildShaderProgram(GLuint& out_program) {
   return true;
 }
 
+bool PhongStage::BuildStencilProgram(GLuint& out_program) {
+  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vs, 1, &PHONG_VOLUME_VS, nullptr);
+  glCompileShader(vs);
+
+  GLint compiled;
+  glGetShaderiv(vs, GL_COMPILE_STATUS, &compiled);
+  if (!compiled) {
+    std::cerr << "[phong] failed to compile volume vertex shader!" << std::endl;
+    return false;
+  }
+
+  // Only the depth and stencil tests matter, so no fragment shader is needed.
+  GLuint program = glCreateProgram();
+  glAttachShader(program, vs);
+  glLinkProgram(program);
+  glDetachShader(program, vs);
+  glDeleteShader(vs);
+
+  GLint linked;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    std::cerr << "[phong] failed to link stencil program!" << std::endl;
+    glDeleteProgram(program);
+    return false;
+  }
+
+  out_program = program;
+  return true;
+}
+
 }  // namespace pipe
 }  // namespace quarke
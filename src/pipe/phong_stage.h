@@ -4,6 +4,9 @@
 #include <glm/glm.hpp>
 #include <glad/glad.h>
 #include <memory>
+#include <vector>
+#include "pipe/geometry_stage.h"
+#include "pipe/light_grid.h"
 
 namespace quarke {
 
@@ -24,46 +27,106 @@ struct PointLight {
 // A shader stage that additively blends point lights to a light buffer.
 class PhongStage {
  public:
+  enum LightingMode {
+    // Draws a fullscreen pass per light, shading every pixel for each.
+    LIGHTING_PER_LIGHT,
+    // Bins lights into screen tiles and depth slices with a LightGrid, and
+    // shades all lights in a single pass that only visits the lights
+    // reaching each pixel's cluster.
+    LIGHTING_CLUSTERED,
+    // Rasterizes a sphere bounding each light's reach, shading only the
+    // pixels whose surfaces the stencil test finds inside it.
+    LIGHTING_VOLUMES,
+  };
+
+  enum ClusterBuffer {
+    CLUSTER_BUFFER_LIGHTS = 0,
+    CLUSTER_BUFFER_CLUSTERS,
+    CLUSTER_BUFFER_INDICES,
+    NUM_CLUSTER_BUFFERS
+  };
+
   // Creates a new phong stage based on color, normal, position, and depth buffers.
-  static std::unique_ptr<PhongStage> Create(int width, int height,
+  // The depth buffer must be of GeometryStage::depth_format() and acquired
+  // from `pool`, as light volumes are composed on a copy of it. The buffers
+  // are decoded according to `layout`.
+  // The light buffer is acquired from `pool`, which must outlive the stage.
+  static std::unique_ptr<PhongStage> Create(RenderTargetPool& pool,
+                                            int width, int height,
                                             GLuint color_tex, GLuint normal_tex,
-                                            GLuint position_tex, GLuint depth_tex);
+                                            GLuint position_tex, GLuint depth_tex,
+                                            GeometryStage::Layout layout,
+                                            LightingMode mode = LIGHTING_CLUSTERED);
 
   // Instantiates a phong stage drawing to a light buffer.
-  PhongStage(int width, int height, GLuint program,
+  // The cluster buffers and their texture buffer views are only used in
+  // LIGHTING_CLUSTERED mode, and the stencil texture and program and volume
+  // mesh in LIGHTING_VOLUMES mode.
+  PhongStage(RenderTargetPool& pool, int width, int height,
+             LightingMode mode, GLuint program,
              GLuint light_fbo, GLuint light_buffer,
-             GLuint light_tex, GLuint light_depth_tex, GLuint screen_vbo,
+             GLuint light_tex, GLuint screen_vbo,
              GLuint screen_vao, GLuint color_tex, GLuint normal_tex,
-             GLuint position_tex, GLuint depth_tex);
+             GLuint position_tex, GLuint depth_tex, GLuint stencil_tex,
+             const GLuint cluster_buffers[NUM_CLUSTER_BUFFERS],
+             const GLuint cluster_textures[NUM_CLUSTER_BUFFERS],
+             GLuint stencil_program, GLuint volume_vbo, GLuint volume_vao,
+             GLsizei volume_vertices);
+  ~PhongStage();
+
+  PhongStage(const PhongStage&) = delete;
 
+  // Clears the light buffer to black, without occlusion.
   void Clear();
 
-  // Accumulates the given point light's luminosity to the light buffer.
+  // Accumulates the luminosity of the given point lights to the light buffer.
+  // Lights are scaled by the ambient occlusion in the light buffer's alpha,
+  // as written with the ambient term by SSAOStage.
+  // Shadows of lights[i] are looked up in shadow_tiles[i] of `shadow_atlas`,
+  // as given by OmniShadowStage.
   // FIXME: remove hackish shadow map thrown in; migrate to its own stage?
-  void Illuminate(const game::Camera& camera, const PointLight& light,
-                  GLuint shadow_cubemap);
-
-  // Resizes the light buffer to the given dimensions.
-  // Implicitly clears the light buffer.
-  void Resize(int width, int height);
+  void Illuminate(const game::Camera& camera,
+                  const std::vector<PointLight>& lights, GLuint shadow_atlas,
+                  const std::vector<glm::vec4>& shadow_tiles);
 
   GLuint fbo() const { return light_fbo_; }
   GLuint buffer() const { return light_buffer_; }
   GLuint tex() const { return light_tex_; }
   static GLuint format() { return GL_RGBA; }
 
- private:
-  static bool BuildShaderProgram(GLuint& out_program);
+  LightingMode mode() const { return mode_; }
+  // Returns the light grid built by the last clustered Illuminate().
+  const LightGrid& light_grid() const { return light_grid_; }
 
+ private:
+  static bool BuildShaderProgram(LightingMode mode,
+                                 GeometryStage::Layout layout,
+                                 GLuint& out_program);
+  // Builds a program transforming light volumes, without any color output.
+  static bool BuildStencilProgram(GLuint& out_program);
+
+  // Uploads the light grid and draws all lights in one pass. Assumes the
+  // program, G-buffer textures and shared uniforms are bound.
+  void IlluminateClustered(const game::Camera& camera,
+                           const std::vector<PointLight>& lights,
+                           const std::vector<glm::vec4>& shadow_tiles);
+
+  // Draws each light over the pixels within its volume. Assumes the same
+  // state as IlluminateClustered().
+  void IlluminateVolumes(const game::Camera& camera,
+                         const std::vector<PointLight>& lights,
+                         const std::vector<glm::vec4>& shadow_tiles);
+
+  RenderTargetPool& pool_;
   int out_width_;
   int out_height_;
 
+  const LightingMode mode_;
   const GLuint program_;
 
   const GLuint light_fbo_;
   const GLuint light_buffer_;
-  const GLuint light_tex_;
-  const GLuint light_depth_tex_;
+  GLuint light_tex_;
   const GLuint screen_vbo_;
   const GLuint screen_vao_;
 
@@ -71,6 +134,12 @@ class PhongStage {
   const GLuint normal_tex_;
   const GLuint position_tex_;
   const GLuint depth_tex_;
+  GLuint stencil_tex_; // copy of depth_tex_ attached to light_fbo_
+
+  const GLuint stencil_program_;
+  const GLuint volume_vbo_;
+  const GLuint volume_vao_;
+  const GLsizei volume_vertices_;
 
   GLuint color_sampler_location_;
   GLuint normal_sampler_location_;
@@ -81,6 +150,23 @@ class PhongStage {
   GLuint light_color_location_;
   GLuint light_distance_location_;
   GLuint shadow_sampler_location_;
+  GLuint shadow_tile_location_;
+  GLuint inverse_vp_location_;
+  GLuint viewport_size_location_;
+  GLuint lights_sampler_location_;
+  GLuint clusters_sampler_location_;
+  GLuint indices_sampler_location_;
+  GLuint view_location_;
+  GLuint cluster_counts_location_;
+  GLuint tile_size_location_;
+  GLuint slice_params_location_;
+  GLuint volume_mvp_location_;
+  GLuint stencil_mvp_location_;
+
+  GLuint cluster_buffers_[NUM_CLUSTER_BUFFERS];
+  GLuint cluster_textures_[NUM_CLUSTER_BUFFERS];
+  LightGrid light_grid_;
+  std::vector<glm::vec4> light_data_; // staging for CLUSTER_BUFFER_LIGHTS
 };
 
 }  // namespace pipe
@@ -0,0 +1,224 @@
+#include "pipe/profiler.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace quarke {
+namespace pipe {
+
+static const char* FRAME_SCOPE = "frame";
+
+// Returns statistics of `samples`, which is reordered.
+static Profiler::Stats ComputeSeriesStats(std::vector<float>& samples) {
+  Profiler::Stats stats = { 0.f, 0.f, 0.f };
+  if (samples.empty())
+    return stats;
+  std::sort(samples.begin(), samples.end());
+  float sum = 0.f;
+  for (float s : samples) {
+    sum += s;
+  }
+  const size_t p99 = (size_t) std::ceil(0.99 * samples.size()) - 1;
+  stats.min = samples.front();
+  stats.avg = sum / samples.size();
+  stats.p99 = samples[p99];
+  return stats;
+}
+
+Profiler::Profiler()
+  : enabled_(true), recording_(false), frame_number_(0)
+  , frame_event_(NO_EVENT), open_scopes_(0), dropped_frames_(0)
+  , calibrated_(false), gpu_to_cpu_(0), trace_(TRACE_FRAMES)
+  , trace_next_(0) {
+  for (Frame& frame : frames_) {
+    frame.pending = false;
+  }
+}
+
+Profiler::~Profiler() {
+  for (Frame& frame : frames_) {
+    if (!frame.queries.empty())
+      glDeleteQueries(frame.queries.size(), frame.queries.data());
+  }
+}
+
+/* static */
+int64_t Profiler::Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Profiler::BeginFrame() {
+  assert(open_scopes_ == 0);
+
+  if (!calibrated_) {
+    // Not exact, as the GPU may lag behind, but enough to line up traces.
+    GLint64 gpu_now;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    gpu_to_cpu_ = Now() - gpu_now;
+    calibrated_ = true;
+  }
+
+  // Collect earlier frames in order, stopping at the first still in flight.
+  for (uint64_t age = FRAME_LATENCY; age > 0; age--) {
+    if (age > frame_number_)
+      continue;
+    Frame& frame = frames_[(frame_number_ - age) % FRAME_LATENCY];
+    if (frame.pending && !Resolve(frame))
+      break;
+  }
+
+  Frame& frame = frames_[frame_number_ % FRAME_LATENCY];
+  if (frame.pending) {
+    // Reusing the queries drops their results.
+    frame.pending = false;
+    dropped_frames_++;
+  }
+  frame.events.clear();
+
+  recording_ = enabled_;
+  frame_event_ = Begin(FRAME_SCOPE);
+}
+
+void Profiler::EndFrame() {
+  End(frame_event_);
+  assert(open_scopes_ == 0);
+  Frame& frame = frames_[frame_number_ % FRAME_LATENCY];
+  frame.pending = recording_;
+  recording_ = false;
+  frame_number_++;
+}
+
+size_t Profiler::Begin(const std::string& name) {
+  if (!recording_)
+    return NO_EVENT;
+
+  Frame& frame = frames_[frame_number_ % FRAME_LATENCY];
+  const size_t event = frame.events.size();
+  if (frame.queries.size() < 2 * (event + 1)) {
+    const size_t first = frame.queries.size();
+    frame.queries.resize(2 * (event + 1));
+    glGenQueries(frame.queries.size() - first, &frame.queries[first]);
+  }
+
+  frame.events.push_back({ FindSeries(name), Now(), 0, 0, 0 });
+  glQueryCounter(frame.queries[2 * event], GL_TIMESTAMP);
+  open_scopes_++;
+  return event;
+}
+
+void Profiler::End(size_t event) {
+  if (event == NO_EVENT)
+    return;
+
+  Frame& frame = frames_[frame_number_ % FRAME_LATENCY];
+  assert(event < frame.events.size() && open_scopes_ > 0);
+  glQueryCounter(frame.queries[2 * event + 1], GL_TIMESTAMP);
+  frame.events[event].cpu_end = Now();
+  open_scopes_--;
+}
+
+bool Profiler::Resolve(Frame& frame) {
+  // Timestamps complete in order, and the frame's own scope ends last.
+  GLint available;
+  glGetQueryObjectiv(frame.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available)
+    return false;
+
+  for (size_t i = 0; i < frame.events.size(); i++) {
+    Event& event = frame.events[i];
+    GLuint64 begin, end;
+    glGetQueryObjectui64v(frame.queries[2 * i], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(frame.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+    event.gpu_begin = (int64_t) begin + gpu_to_cpu_;
+    event.gpu_end = (int64_t) end + gpu_to_cpu_;
+
+    Series& series = series_[event.series];
+    const float cpu_ms = (event.cpu_end - event.cpu_begin) * 1e-6f;
+    const float gpu_ms = (event.gpu_end - event.gpu_begin) * 1e-6f;
+    if (series.cpu_ms.size() < HISTORY_SIZE) {
+      series.cpu_ms.push_back(cpu_ms);
+      series.gpu_ms.push_back(gpu_ms);
+    } else {
+      series.cpu_ms[series.next] = cpu_ms;
+      series.gpu_ms[series.next] = gpu_ms;
+    }
+    series.next = (series.next + 1) % HISTORY_SIZE;
+  }
+
+  trace_[trace_next_] = frame.events;
+  trace_next_ = (trace_next_ + 1) % TRACE_FRAMES;
+  frame.pending = false;
+  return true;
+}
+
+size_t Profiler::FindSeries(const std::string& name) {
+  for (size_t i = 0; i < series_.size(); i++) {
+    if (series_[i].name == name)
+      return i;
+  }
+  series_.push_back({ name, {}, {}, 0 });
+  series_.back().cpu_ms.reserve(HISTORY_SIZE);
+  series_.back().gpu_ms.reserve(HISTORY_SIZE);
+  return series_.size() - 1;
+}
+
+std::vector<Profiler::ScopeStats> Profiler::ComputeStats() const {
+  std::vector<ScopeStats> stats;
+  for (const Series& series : series_) {
+    std::vector<float> cpu_ms = series.cpu_ms;
+    std::vector<float> gpu_ms = series.gpu_ms;
+    stats.push_back({ series.name, cpu_ms.size(),
+                      ComputeSeriesStats(cpu_ms),
+                      ComputeSeriesStats(gpu_ms) });
+  }
+  return stats;
+}
+
+bool Profiler::WriteChromeTrace(const std::string& path) const {
+  std::ofstream out(path);
+  if (!out) {
+    std::cerr << "[prof] failed to open " << path << "!" << std::endl;
+    return false;
+  }
+
+  // Timestamps are in microseconds, relative to the oldest frame.
+  int64_t origin = INT64_MAX;
+  for (const std::vector<Event>& events : trace_) {
+    for (const Event& event : events) {
+      origin = std::min(origin, std::min(event.cpu_begin, event.gpu_begin));
+    }
+  }
+
+  const char* const THREAD_NAMES[] = { "CPU", "GPU" };
+  out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+  for (int tid = 0; tid < 2; tid++) {
+    out << (tid ? "," : "")
+        << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << tid
+        << ",\"args\":{\"name\":\"" << THREAD_NAMES[tid] << "\"}}";
+  }
+  // Oldest frames first, starting past the most recently written.
+  for (size_t i = 0; i < TRACE_FRAMES; i++) {
+    for (const Event& event : trace_[(trace_next_ + i) % TRACE_FRAMES]) {
+      const int64_t begin[] = { event.cpu_begin, event.gpu_begin };
+      const int64_t end[] = { event.cpu_end, event.gpu_end };
+      for (int tid = 0; tid < 2; tid++) {
+        // Scope names are identifiers, and need no escaping.
+        out << ",{\"name\":\"" << series_[event.series].name
+            << "\",\"cat\":\"" << THREAD_NAMES[tid]
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << tid
+            << ",\"ts\":" << (begin[tid] - origin) * 1e-3
+            << ",\"dur\":" << (end[tid] - begin[tid]) * 1e-3 << "}";
+      }
+    }
+  }
+  out << "]}" << std::endl;
+  return out.good();
+}
+
+}  // namespace pipe
+}  // namespace quarke
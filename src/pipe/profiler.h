@@ -0,0 +1,143 @@
+#ifndef QUARKE_SRC_PIPE_PROFILER_H_
+#define QUARKE_SRC_PIPE_PROFILER_H_
+
+#include <glad/glad.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace quarke {
+namespace pipe {
+
+// Times named scopes of each frame on both the CPU and the GPU, keeping
+// rolling statistics per scope and a trace of recent frames.
+//
+// GPU times are measured with timestamp queries at either end of a scope,
+// which unlike GL_TIME_ELAPSED queries may nest. Queries are recycled from a
+// ring of FRAME_LATENCY frames, and read back once available, so that the
+// profiler never waits on the GPU; frames whose results are still pending when
+// their queries come around again are dropped.
+class Profiler {
+ public:
+  // Frames of queries in flight before they are reused.
+  static const int FRAME_LATENCY = 4;
+  // Samples kept per scope for statistics.
+  static const size_t HISTORY_SIZE = 256;
+  // Completed frames kept for tracing.
+  static const size_t TRACE_FRAMES = 64;
+
+  // Times a scope for its lifetime. Does nothing with a null profiler.
+  class Scope {
+   public:
+    Scope(Profiler* profiler, const std::string& name)
+      : profiler_(profiler)
+      , event_(profiler ? profiler->Begin(name) : NO_EVENT) {}
+    ~Scope() {
+      if (profiler_)
+        profiler_->End(event_);
+    }
+
+    Scope(const Scope&) = delete;
+   private:
+    Profiler* const profiler_;
+    const size_t event_;
+  };
+
+  // Rolling statistics of a scope, in milliseconds.
+  struct Stats {
+    float min;
+    float avg;
+    float p99;
+  };
+
+  struct ScopeStats {
+    std::string name;
+    size_t samples;
+    Stats cpu;
+    Stats gpu;
+  };
+
+  Profiler();
+  ~Profiler();
+
+  Profiler(const Profiler&) = delete;
+
+  // Reads back the results of earlier frames that are available, and starts
+  // timing a frame, itself recorded as a scope named "frame".
+  void BeginFrame();
+  // Ends the frame started by BeginFrame(). All scopes must have ended.
+  void EndFrame();
+
+  // Starts timing a scope of the current frame, returning an identifier to
+  // end it with. Prefer Scope.
+  size_t Begin(const std::string& name);
+  void End(size_t event);
+
+  // Returns statistics over the last HISTORY_SIZE samples of each scope.
+  std::vector<ScopeStats> ComputeStats() const;
+
+  // Writes the last TRACE_FRAMES completed frames to `path` in the Chrome
+  // trace event format, with CPU and GPU scopes on separate threads.
+  // Returns false on failure.
+  bool WriteChromeTrace(const std::string& path) const;
+
+  // Enables or disables profiling from the next frame on.
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  // Returns the number of frames dropped as their results weren't ready.
+  size_t dropped_frames() const { return dropped_frames_; }
+ private:
+  static const size_t NO_EVENT = SIZE_MAX;
+
+  struct Event {
+    size_t series;
+    int64_t cpu_begin; // in nanoseconds
+    int64_t cpu_end;
+    int64_t gpu_begin; // in nanoseconds, relative to the CPU clock
+    int64_t gpu_end;
+  };
+
+  struct Frame {
+    std::vector<Event> events; // in order of beginning
+    std::vector<GLuint> queries; // two per event, grown as needed
+    bool pending; // awaiting results
+  };
+
+  // Samples of a scope, in a ring of HISTORY_SIZE.
+  struct Series {
+    std::string name;
+    std::vector<float> cpu_ms;
+    std::vector<float> gpu_ms;
+    size_t next;
+  };
+
+  // Returns the CPU clock in nanoseconds.
+  static int64_t Now();
+
+  // Returns the index of the series named `name`, adding it if needed.
+  size_t FindSeries(const std::string& name);
+
+  // Reads back the queries of `frame` and records its events, if available.
+  bool Resolve(Frame& frame);
+
+  bool enabled_;
+  bool recording_; // enabled for the current frame
+  uint64_t frame_number_;
+  size_t frame_event_; // the current frame's own scope
+  size_t open_scopes_;
+  size_t dropped_frames_;
+  // Offset from the GPU clock to the CPU's, measured on the first frame.
+  bool calibrated_;
+  int64_t gpu_to_cpu_;
+
+  Frame frames_[FRAME_LATENCY];
+  std::vector<Series> series_;
+  std::vector<std::vector<Event>> trace_; // ring of TRACE_FRAMES
+  size_t trace_next_;
+};
+
+}  // namespace pipe
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_PIPE_PROFILER_H_
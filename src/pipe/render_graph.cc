@@ -0,0 +1,237 @@
+#include "pipe/render_graph.h"
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <iostream>
+#include <queue>
+
+namespace quarke {
+namespace pipe {
+
+RenderGraph::RenderGraph(RenderTargetPool& pool)
+  : pool_(pool), profiler_(nullptr) {}
+
+RenderGraph::~RenderGraph() {
+  for (const HeldTexture& held : held_) {
+    pool_.Release(held.texture);
+  }
+}
+
+void RenderGraph::Reset() {
+  resources_.clear();
+  passes_.clear();
+  order_.clear();
+}
+
+RenderGraph::Resource RenderGraph::CreateTexture(const std::string& name,
+                                                 const TextureDesc& desc) {
+  resources_.push_back({ name, desc, 0, false, {}, -1, -1 });
+  return resources_.size() - 1;
+}
+
+RenderGraph::Resource RenderGraph::ImportTexture(const std::string& name,
+                                                 GLuint texture) {
+  resources_.push_back({ name, { 0, 0, GL_NONE, GL_NONE }, texture, true,
+                         {}, -1, -1 });
+  return resources_.size() - 1;
+}
+
+void RenderGraph::AddPass(const std::string& name,
+                          std::vector<Resource> inputs,
+                          std::vector<Resource> outputs, ExecuteFunc execute,
+                          bool side_effects) {
+  passes_.push_back({ name, std::move(inputs), std::move(outputs),
+                      std::move(execute), side_effects, {} });
+}
+
+void RenderGraph::BuildDependencies() {
+  for (ResourceNode& resource : resources_) {
+    resource.writers.clear();
+  }
+  for (size_t i = 0; i < passes_.size(); i++) {
+    for (Resource r : passes_[i].outputs) {
+      resources_[r].writers.push_back(i);
+    }
+  }
+
+  for (size_t i = 0; i < passes_.size(); i++) {
+    PassNode& pass = passes_[i];
+    pass.dependencies.clear();
+    for (Resource r : pass.outputs) {
+      // Follow the previous writer.
+      const std::vector<size_t>& writers = resources_[r].writers;
+      auto it = std::find(writers.begin(), writers.end(), i);
+      if (it != writers.begin())
+        pass.dependencies.push_back(*(it - 1));
+    }
+    for (Resource r : pass.inputs) {
+      const std::vector<size_t>& writers = resources_[r].writers;
+      if (writers.empty() ||
+          std::find(pass.outputs.begin(), pass.outputs.end(), r) !=
+              pass.outputs.end()) {
+        continue; // read-modify-write passes are ordered as writers
+      }
+      // Transitively follows every other writer.
+      pass.dependencies.push_back(writers.back());
+    }
+  }
+}
+
+bool RenderGraph::SortPasses(const std::vector<bool>& live) {
+  // Kahn's algorithm, preferring passes declared earlier.
+  std::vector<size_t> in_degree(passes_.size(), 0);
+  std::vector<std::vector<size_t>> dependents(passes_.size());
+  size_t num_live = 0;
+  for (size_t i = 0; i < passes_.size(); i++) {
+    if (!live[i])
+      continue;
+    num_live++;
+    for (size_t d : passes_[i].dependencies) {
+      in_degree[i]++;
+      dependents[d].push_back(i);
+    }
+  }
+
+  std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>>
+      ready;
+  for (size_t i = 0; i < passes_.size(); i++) {
+    if (live[i] && in_degree[i] == 0)
+      ready.push(i);
+  }
+  order_.clear();
+  while (!ready.empty()) {
+    const size_t pass = ready.top();
+    ready.pop();
+    order_.push_back(pass);
+    for (size_t d : dependents[pass]) {
+      if (--in_degree[d] == 0)
+        ready.push(d);
+    }
+  }
+  return order_.size() == num_live;
+}
+
+bool RenderGraph::Compile() {
+  BuildDependencies();
+
+  // Keep the passes reachable from side effects.
+  std::vector<bool> live(passes_.size(), false);
+  std::vector<size_t> stack;
+  for (size_t i = 0; i < passes_.size(); i++) {
+    if (passes_[i].side_effects) {
+      live[i] = true;
+      stack.push_back(i);
+    }
+  }
+  while (!stack.empty()) {
+    const size_t pass = stack.back();
+    stack.pop_back();
+    for (size_t d : passes_[pass].dependencies) {
+      if (!live[d]) {
+        live[d] = true;
+        stack.push_back(d);
+      }
+    }
+  }
+
+  if (!SortPasses(live)) {
+    std::cerr << "[rg] cycle between passes!" << std::endl;
+    order_.clear();
+    return false;
+  }
+
+  for (ResourceNode& resource : resources_) {
+    resource.first_use = -1;
+    resource.last_use = -1;
+  }
+  for (size_t i = 0; i < order_.size(); i++) {
+    const PassNode& pass = passes_[order_[i]];
+    for (const std::vector<Resource>* accesses :
+         { &pass.inputs, &pass.outputs }) {
+      for (Resource r : *accesses) {
+        ResourceNode& resource = resources_[r];
+        if (resource.first_use < 0)
+          resource.first_use = i;
+        resource.last_use = i;
+      }
+    }
+  }
+  AllocateTextures();
+  return true;
+}
+
+void RenderGraph::AllocateTextures() {
+  std::vector<size_t> transients;
+  for (size_t i = 0; i < resources_.size(); i++) {
+    if (!resources_[i].imported && resources_[i].first_use >= 0)
+      transients.push_back(i);
+  }
+  std::sort(transients.begin(), transients.end(),
+            [this](size_t a, size_t b) {
+              return resources_[a].first_use < resources_[b].first_use;
+            });
+
+#ifdef QUARKE_DEBUG
+  const size_t last_bytes = pooled_bytes();
+#endif  // QUARKE_DEBUG
+  // Released storage is picked up again below if the frame is unchanged.
+  for (const HeldTexture& held : held_) {
+    pool_.Release(held.texture);
+  }
+  held_.clear();
+
+  // Hand out storage by first use, reusing any held texture of the same
+  // description freed before then.
+  for (size_t r : transients) {
+    ResourceNode& resource = resources_[r];
+    HeldTexture* match = nullptr;
+    for (HeldTexture& held : held_) {
+      if (held.desc == resource.desc && held.busy_until < resource.first_use) {
+        match = &held;
+        break;
+      }
+    }
+    if (!match) {
+      held_.push_back({ resource.desc, pool_.Acquire(resource.desc), -1 });
+      match = &held_.back();
+    }
+    match->busy_until = resource.last_use;
+    resource.texture = match->texture;
+  }
+
+#ifdef QUARKE_DEBUG
+  if (pooled_bytes() != last_bytes) {
+    std::cout << "[rg] holding " << held_.size() << " textures, "
+              << pooled_bytes() << " bytes for " << transient_bytes()
+              << " bytes of transients" << std::endl;
+  }
+#endif  // QUARKE_DEBUG
+}
+
+void RenderGraph::Execute() const {
+  for (size_t pass : order_) {
+    Profiler::Scope scope(profiler_, passes_[pass].name);
+    passes_[pass].execute(*this);
+  }
+}
+
+size_t RenderGraph::pooled_bytes() const {
+  size_t bytes = 0;
+  for (const HeldTexture& held : held_) {
+    bytes += RenderTargetPool::Size(held.desc);
+  }
+  return bytes;
+}
+
+size_t RenderGraph::transient_bytes() const {
+  size_t bytes = 0;
+  for (const ResourceNode& resource : resources_) {
+    if (resource.imported || resource.first_use < 0)
+      continue;
+    bytes += RenderTargetPool::Size(resource.desc);
+  }
+  return bytes;
+}
+
+}  // namespace pipe
+}  // namespace quarke
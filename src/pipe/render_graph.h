@@ -0,0 +1,130 @@
+#ifndef QUARKE_SRC_PIPE_RENDER_GRAPH_H_
+#define QUARKE_SRC_PIPE_RENDER_GRAPH_H_
+
+#include <glad/glad.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "pipe/profiler.h"
+#include "pipe/render_target_pool.h"
+
+namespace quarke {
+namespace pipe {
+
+// A frame's worth of rendering passes, connected by the textures they read
+// and write.
+//
+// Passes are declared along with their inputs and outputs each frame, then
+// compiled: passes that contribute nothing to a pass with side effects, such
+// as presenting to the screen, are culled, and the rest are ordered such that
+// every pass runs after those producing its inputs. Textures created by the
+// graph are transient, living from their first to their last use, and those
+// whose lifetimes don't overlap share storage acquired from a
+// RenderTargetPool.
+//
+// Writers of a texture run in the order they were declared, each one after
+// the last, so that a pass may accumulate onto its output. Passes only
+// reading a texture run after all of its writers.
+class RenderGraph {
+ public:
+  // Identifies a texture within the graph of the current frame.
+  typedef size_t Resource;
+
+  // Describes the storage of a transient texture. Textures of equal
+  // descriptions may be aliased.
+  typedef RenderTargetDesc TextureDesc;
+
+  typedef std::function<void(const RenderGraph&)> ExecuteFunc;
+
+  explicit RenderGraph(RenderTargetPool& pool);
+  ~RenderGraph();
+
+  RenderGraph(const RenderGraph&) = delete;
+
+  // Discards the passes and textures of the last frame. Storage is held
+  // until the next Compile(), so that it may be reused.
+  void Reset();
+
+  // Declares a transient texture, allocated by the graph.
+  Resource CreateTexture(const std::string& name, const TextureDesc& desc);
+
+  // Declares a texture owned outside of the graph, which is never aliased.
+  Resource ImportTexture(const std::string& name, GLuint texture);
+
+  // Declares a pass reading `inputs` and writing `outputs`, which runs
+  // `execute` when the graph is executed. Passes with side effects outside
+  // of the graph, such as presenting to the screen, are never culled.
+  void AddPass(const std::string& name, std::vector<Resource> inputs,
+               std::vector<Resource> outputs, ExecuteFunc execute,
+               bool side_effects = false);
+
+  // Culls and orders passes, and assigns storage to transient textures.
+  // Returns false if the passes' dependencies form a cycle.
+  bool Compile();
+
+  // Runs the passes kept by the last Compile(), in order.
+  void Execute() const;
+
+  // Times each pass run by Execute() as a scope named after it, if set.
+  void set_profiler(Profiler* profiler) { profiler_ = profiler; }
+
+  // Returns the texture backing `resource`. Only valid for transient
+  // textures during Execute().
+  GLuint texture(Resource resource) const {
+    return resources_[resource].texture;
+  }
+
+  // Returns the number of passes culled by the last Compile().
+  size_t culled_passes() const { return passes_.size() - order_.size(); }
+  // Returns the bytes of storage held for transient textures.
+  size_t pooled_bytes() const;
+  // Returns the bytes transient textures would take without aliasing.
+  size_t transient_bytes() const;
+ private:
+  struct ResourceNode {
+    std::string name;
+    TextureDesc desc;
+    GLuint texture; // imported, or assigned by Compile()
+    bool imported;
+    std::vector<size_t> writers; // in declaration order
+    int first_use; // positions in order_, -1 if unused
+    int last_use;
+  };
+
+  struct PassNode {
+    std::string name;
+    std::vector<Resource> inputs;
+    std::vector<Resource> outputs;
+    ExecuteFunc execute;
+    bool side_effects;
+    std::vector<size_t> dependencies; // passes to run before this one
+  };
+
+  struct HeldTexture {
+    TextureDesc desc;
+    GLuint texture;
+    int busy_until; // position in order_ of the last use
+  };
+
+  // Builds the dependencies of each pass.
+  void BuildDependencies();
+
+  // Returns the live passes ordered by dependencies, or false on a cycle.
+  bool SortPasses(const std::vector<bool>& live);
+
+  // Returns the textures held for the last frame to the pool, and acquires
+  // storage for the transient resources of this one.
+  void AllocateTextures();
+
+  std::vector<ResourceNode> resources_;
+  std::vector<PassNode> passes_;
+  std::vector<size_t> order_; // live passes, in execution order
+  RenderTargetPool& pool_;
+  std::vector<HeldTexture> held_;
+  Profiler* profiler_;
+};
+
+}  // namespace pipe
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_PIPE_RENDER_GRAPH_H_
@@ -0,0 +1,197 @@
+#include "pipe/render_target_pool.h"
+#include <cassert>
+#include <iostream>
+#include <limits>
+
+namespace quarke {
+namespace pipe {
+
+static const uint64_t DEFAULT_MAX_IDLE_FRAMES = 3;
+
+static bool IsDepthFormat(GLenum format) {
+  switch (format) {
+    case GL_DEPTH_COMPONENT:
+    case GL_DEPTH_COMPONENT16:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+    case GL_DEPTH_STENCIL:
+    case GL_DEPTH24_STENCIL8:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool HasStencil(GLenum format) {
+  return format == GL_DEPTH_STENCIL || format == GL_DEPTH24_STENCIL8;
+}
+
+RenderTargetPool::RenderTargetPool()
+  : allocated_bytes_(0), budget_(std::numeric_limits<size_t>::max())
+  , frame_(0), max_idle_frames_(DEFAULT_MAX_IDLE_FRAMES) {}
+
+RenderTargetPool::~RenderTargetPool() {
+  while (!entries_.empty()) {
+    Delete(entries_.size() - 1);
+  }
+}
+
+GLuint RenderTargetPool::Acquire(const RenderTargetDesc& desc,
+                                 GLenum filter) {
+  Entry* entry = nullptr;
+  for (Entry& e : entries_) {
+    if (!e.acquired && e.desc == desc) {
+      entry = &e;
+      break;
+    }
+  }
+
+  if (!entry) {
+    const size_t size = Size(desc);
+    MakeRoom(size);
+    if (allocated_bytes_ + size > budget_) {
+      std::cerr << "[rtp] exceeding budget of " << budget_ << " bytes with "
+                << allocated_bytes_ + size << " bytes of render targets"
+                << std::endl;
+    }
+
+    Entry e = { desc, 0, 0, false, 0 };
+    glGenTextures(1, &e.texture);
+    glBindTexture(desc.target, e.texture);
+    const bool depth = IsDepthFormat(desc.format);
+    const bool stencil = HasStencil(desc.format);
+    glTexImage2D(desc.target, 0, desc.format, desc.width, desc.height, 0,
+                 stencil ? GL_DEPTH_STENCIL :
+                 depth ? GL_DEPTH_COMPONENT : GL_RGBA,
+                 stencil ? GL_UNSIGNED_INT_24_8 : GL_FLOAT, nullptr);
+    entries_.push_back(e);
+    entry = &entries_.back();
+    allocated_bytes_ += size;
+    bytes_by_format_[desc.format] += size;
+  }
+
+  // The previous holder may have left other sampling state.
+  entry->acquired = true;
+  glBindTexture(desc.target, entry->texture);
+  glTexParameteri(desc.target, GL_TEXTURE_MIN_FILTER, filter);
+  glTexParameteri(desc.target, GL_TEXTURE_MAG_FILTER, filter);
+  glTexParameteri(desc.target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(desc.target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(desc.target, 0);
+  return entry->texture;
+}
+
+void RenderTargetPool::Release(GLuint texture) {
+  for (Entry& e : entries_) {
+    if (e.texture == texture) {
+      assert(e.acquired);
+      e.acquired = false;
+      e.released_frame = frame_;
+      return;
+    }
+  }
+  assert(false && "releasing a texture not from the pool");
+}
+
+GLuint RenderTargetPool::Framebuffer(GLuint texture) {
+  for (Entry& e : entries_) {
+    if (e.texture != texture)
+      continue;
+    if (!e.fbo) {
+      const GLenum attachment =
+          HasStencil(e.desc.format) ? GL_DEPTH_STENCIL_ATTACHMENT :
+          IsDepthFormat(e.desc.format) ? GL_DEPTH_ATTACHMENT :
+          GL_COLOR_ATTACHMENT0;
+      glGenFramebuffers(1, &e.fbo);
+      glBindFramebuffer(GL_FRAMEBUFFER, e.fbo);
+      glFramebufferTexture(GL_FRAMEBUFFER, attachment, e.texture, 0);
+      if (attachment != GL_COLOR_ATTACHMENT0) {
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+      }
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+    return e.fbo;
+  }
+  assert(false && "framebuffer requested for a texture not from the pool");
+  return 0;
+}
+
+void RenderTargetPool::EndFrame() {
+  frame_++;
+  for (size_t i = entries_.size(); i-- > 0;) {
+    const Entry& e = entries_[i];
+    if (!e.acquired && frame_ - e.released_frame > max_idle_frames_)
+      Delete(i);
+  }
+}
+
+void RenderTargetPool::MakeRoom(size_t bytes) {
+  while (allocated_bytes_ + bytes > budget_) {
+    size_t oldest = entries_.size();
+    for (size_t i = 0; i < entries_.size(); i++) {
+      const Entry& e = entries_[i];
+      if (!e.acquired && (oldest == entries_.size() ||
+                          e.released_frame < entries_[oldest].released_frame))
+        oldest = i;
+    }
+    if (oldest == entries_.size())
+      return;
+    Delete(oldest);
+  }
+}
+
+void RenderTargetPool::Delete(size_t index) {
+  Entry& e = entries_[index];
+  const size_t size = Size(e.desc);
+  allocated_bytes_ -= size;
+  bytes_by_format_[e.desc.format] -= size;
+  if (!bytes_by_format_[e.desc.format])
+    bytes_by_format_.erase(e.desc.format);
+  if (e.fbo)
+    glDeleteFramebuffers(1, &e.fbo);
+  glDeleteTextures(1, &e.texture);
+  entries_[index] = entries_.back();
+  entries_.pop_back();
+}
+
+size_t RenderTargetPool::allocated_bytes(GLenum format) const {
+  auto it = bytes_by_format_.find(format);
+  return it != bytes_by_format_.end() ? it->second : 0;
+}
+
+/* static */
+size_t RenderTargetPool::TexelSize(GLenum format) {
+  switch (format) {
+    case GL_RGBA32F:
+      return 16;
+    case GL_RGBA16F:
+    case GL_RG32F:
+    case GL_DEPTH32F_STENCIL8:
+      return 8;
+    case GL_RGBA:
+    case GL_RGBA8:
+    case GL_RG16F:
+    case GL_R32F:
+    case GL_R11F_G11F_B10F:
+    case GL_DEPTH_COMPONENT:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+    case GL_DEPTH_STENCIL:
+    case GL_DEPTH24_STENCIL8:
+      return 4;
+    case GL_RG8:
+    case GL_R16F:
+    case GL_DEPTH_COMPONENT16:
+      return 2;
+    case GL_RED:
+    case GL_R8:
+      return 1;
+    default:
+      assert(false && "unknown texel size");
+      return 16;
+  }
+}
+
+}  // namespace pipe
+}  // namespace quarke
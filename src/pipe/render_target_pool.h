@@ -0,0 +1,107 @@
+#ifndef QUARKE_SRC_PIPE_RENDER_TARGET_POOL_H_
+#define QUARKE_SRC_PIPE_RENDER_TARGET_POOL_H_
+
+#include <glad/glad.h>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace quarke {
+namespace pipe {
+
+// Describes the storage of a render target texture.
+struct RenderTargetDesc {
+  GLsizei width;
+  GLsizei height;
+  GLenum format; // internal format
+  GLenum target; // GL_TEXTURE_2D or GL_TEXTURE_RECTANGLE
+
+  bool operator==(const RenderTargetDesc& other) const {
+    return width == other.width && height == other.height &&
+           format == other.format && target == other.target;
+  }
+};
+
+// Hands out textures to render into, recycling released textures of the same
+// description across frames and resizes, and tracking the GPU memory held
+// per format.
+//
+// Released textures are kept idle for a few frames before being deleted, so
+// that stages recreated at a previous size, or transients of the next frame,
+// can pick them up again.
+class RenderTargetPool {
+ public:
+  RenderTargetPool();
+  ~RenderTargetPool();
+
+  RenderTargetPool(const RenderTargetPool&) = delete;
+
+  // Returns a texture of `desc`, reusing an idle one if possible. Contents
+  // are undefined. Filtering is set to `filter`, with edges clamped.
+  GLuint Acquire(const RenderTargetDesc& desc, GLenum filter = GL_NEAREST);
+
+  // Returns a texture from Acquire() to the pool. Framebuffers with the
+  // texture attached must not be used after this.
+  void Release(GLuint texture);
+
+  // Returns a framebuffer owned by the pool with only `texture` attached,
+  // to the depth or depth-stencil attachment for depth formats, and to
+  // GL_COLOR_ATTACHMENT0 otherwise. Valid while `texture` is acquired.
+  GLuint Framebuffer(GLuint texture);
+
+  // Deletes textures idle for longer than the idle limit. Call once per
+  // frame.
+  void EndFrame();
+
+  // Sets the number of frames a released texture is kept for.
+  void set_max_idle_frames(uint64_t frames) { max_idle_frames_ = frames; }
+
+  // Sets a soft limit on the bytes of textures held. Acquisitions beyond the
+  // budget delete idle textures first, then warn.
+  void set_budget(size_t bytes) { budget_ = bytes; }
+
+  // Returns the bytes held by textures of the pool, acquired or idle.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+  // Returns the bytes held by textures of `format`.
+  size_t allocated_bytes(GLenum format) const;
+  // Returns the bytes held by textures of each format.
+  const std::map<GLenum, size_t>& bytes_by_format() const {
+    return bytes_by_format_;
+  }
+
+  // Returns the size in bytes of a texel of the internal `format`. Unsized
+  // formats are assumed to take four bytes.
+  static size_t TexelSize(GLenum format);
+
+  // Returns the size in bytes of a texture of `desc`.
+  static size_t Size(const RenderTargetDesc& desc) {
+    return (size_t) desc.width * desc.height * TexelSize(desc.format);
+  }
+ private:
+  struct Entry {
+    RenderTargetDesc desc;
+    GLuint texture;
+    GLuint fbo; // zero until requested
+    bool acquired;
+    uint64_t released_frame;
+  };
+
+  // Deletes the texture of `entries_[index]` and removes it.
+  void Delete(size_t index);
+
+  // Deletes idle textures until `bytes` more fit in the budget, oldest
+  // first.
+  void MakeRoom(size_t bytes);
+
+  std::vector<Entry> entries_;
+  std::map<GLenum, size_t> bytes_by_format_;
+  size_t allocated_bytes_;
+  size_t budget_;
+  uint64_t frame_;
+  uint64_t max_idle_frames_;
+};
+
+}  // namespace pipe
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_PIPE_RENDER_TARGET_POOL_H_
@@ -1,93 +1,403 @@
 #include "pipe/ssao_stage.h"
 #include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
 
 namespace quarke {
 namespace pipe {
 
-static const char* FS_SOURCE = R"(
-#version 330 core
+// Number of hemisphere samples per pixel.
+static const int KERNEL_SIZE = 16;
+// Width of the square tile of kernel rotations, in half resolution pixels.
+static const int NOISE_SIZE = 4;
+// Number of Hi-Z levels available to the occlusion pass.
+static const int HIZ_LEVELS = 4;
+// Hemisphere radius and self-occlusion bias, in world units. The radius can
+// be wide since distant samples are read from coarse Hi-Z levels.
+static const float RADIUS = 1.0f;
+static const float BIAS = 0.025f;
 
-uniform mat4 mvp_matrix;
-uniform sampler2DRect light_tex;
-uniform sampler2DRect depth_tex;
+// Shared by all passes, following the definitions above.
+static const char* COMMON_SOURCE = R"(
+uniform mat4 projection;
 
-layout(location = 0) out vec4 outColor;
+// Converts a depth buffer value to a positive distance along the view axis.
+float linearizeDepth(float depth) {
+  return projection[3][2] / (depth * 2.0 - 1.0 + projection[2][2]);
+}
+
+// Weighs samples by their difference in distance from a reference.
+float depthWeight(float distance, float reference) {
+  return exp(-abs(distance - reference) * DEPTH_SHARPNESS / reference);
+}
+)";
 
-const int filterRadius = 2;
-const int samples = 4;
+// Evaluates occlusion at the top left texel of each half resolution pixel's
+// footprint. Outputs occlusion in r and view distance in g.
+static const char* AO_SOURCE = R"(
+uniform sampler2D depth_tex;
+uniform sampler2DRect normal_tex;
+uniform sampler2D noise_tex;
+// Levels 0 to HIZ_LEVELS - 1 of the Hi-Z pyramid, of which the first
+// max_hiz_level + 1 are bound.
+uniform sampler2DRect hiz_tex[HIZ_LEVELS];
+uniform int max_hiz_level;
+uniform mat4 inverse_projection;
+uniform mat3 normal_matrix; // world to view space
+uniform vec3 kernel[KERNEL_SIZE];
+uniform float radius;
+uniform float bias;
 
-// Undoes the MVP transformation from screen space to clip space.
-float linearizeDepth(in float depth) {
-  float z = depth * 2.0 - 1.0;
-  return -(z - mvp_matrix[2][3]) / mvp_matrix[2][2];
+layout(location = 0) out vec4 out_ao;
+
+// Fetches a texel of the given Hi-Z level by pixel coordinates.
+// Sampler arrays may only be indexed by constants in GLSL 3.30.
+vec2 fetchHiZ(int level, vec2 pixel) {
+  pixel /= float(2 << level);
+  if (level == 0) {
+    return texelFetch(hiz_tex[0],
+                      min(ivec2(pixel), textureSize(hiz_tex[0]) - 1)).rg;
+  } else if (level == 1) {
+    return texelFetch(hiz_tex[1],
+                      min(ivec2(pixel), textureSize(hiz_tex[1]) - 1)).rg;
+  } else if (level == 2) {
+    return texelFetch(hiz_tex[2],
+                      min(ivec2(pixel), textureSize(hiz_tex[2]) - 1)).rg;
+  }
+  return texelFetch(hiz_tex[3],
+                    min(ivec2(pixel), textureSize(hiz_tex[3]) - 1)).rg;
 }
 
-float rand(vec2 co){
-    return fract(sin(dot(co.xy ,vec2(12.9898,78.233))) * 43758.5453);
+// Returns the scene depth at `uv`, reading from `level` of the Hi-Z pyramid
+// or from the depth buffer if negative. Coarse levels give the nearest depth
+// of their tile, which errs towards occlusion.
+float sceneDepth(int level, vec2 uv) {
+  if (level < 0)
+    return texture(depth_tex, uv).r;
+  uv = clamp(uv, 0.0, 1.0);
+  return fetchHiZ(level, uv * vec2(textureSize(depth_tex, 0))).r;
 }
 
 void main(void) {
-  // use a parametric box filter, because gaussians are slow
-  float val = 0.0;
-  float centerDepth = linearizeDepth(texture(depth_tex, gl_FragCoord.xy).r);
-  for (int i = 0; i < samples; i++) {
-    vec2 coords = filterRadius * vec2(rand(gl_FragCoord.xy + i),
-                                      rand(gl_FragCoord.xy - i));
-    float depth = texture(depth_tex, gl_FragCoord.xy + coords).r;
-    val += linearizeDepth(depth);
+  ivec2 size = textureSize(depth_tex, 0);
+  ivec2 coord = min(ivec2(gl_FragCoord.xy) * 2, size - 1);
+  float depth = texelFetch(depth_tex, coord, 0).r;
+  if (depth == 1.0) {
+    // nothing to occlude
+    out_ao = vec4(1.0, linearizeDepth(depth), 0.0, 0.0);
+    return;
   }
-  val /= samples;
 
-  float shadow = 0.1 * max(centerDepth - val, 0.0);
-  outColor = texture(light_tex, gl_FragCoord.xy) - (vec4(1.0, 1.0, 1.0, 0.0) * shadow);
+  vec2 uv = (vec2(coord) + 0.5) / vec2(size);
+  vec4 p = inverse_projection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+  vec3 pos = p.xyz / p.w;
+  vec3 normal = normalize(normal_matrix *
+                          decodeNormal(texelFetch(normal_tex, coord)));
+
+  // Orient the kernel about the normal, rotated by the noise tile.
+  ivec2 noise_coord = ivec2(gl_FragCoord.xy) % NOISE_SIZE;
+  vec3 random = vec3(texelFetch(noise_tex, noise_coord, 0).xy, 0.0);
+  vec3 tangent = normalize(random - normal * dot(random, normal));
+  mat3 tbn = mat3(tangent, cross(normal, tangent), normal);
+
+  // Pick the level where the kernel's samples land about a texel apart,
+  // as a texel of Hi-Z level i covers 2^(i + 1) pixels.
+  float radius_px = radius * projection[1][1] * 0.5 * float(size.y) / -pos.z;
+  int level = int(floor(log2(radius_px / sqrt(float(KERNEL_SIZE))))) - 1;
+  level = clamp(level, -1, max_hiz_level);
+
+  float occlusion = 0.0;
+  for (int i = 0; i < KERNEL_SIZE; i++) {
+    vec3 s = pos + tbn * kernel[i] * radius;
+    vec4 clip = projection * vec4(s, 1.0);
+    vec2 s_uv = clip.xy / clip.w * 0.5 + 0.5;
+    float scene = linearizeDepth(sceneDepth(level, s_uv));
+    // Fade out occluders far outside of the hemisphere, such as those in
+    // front of a silhouette.
+    float range = smoothstep(0.0, 1.0, radius / abs(-pos.z - scene));
+    occlusion += (scene <= -s.z - bias ? 1.0 : 0.0) * range;
+  }
+  out_ao = vec4(1.0 - occlusion / KERNEL_SIZE, -pos.z, 0.0, 0.0);
 }
+)";
+
+// Averages occlusion over a noise tile, such that each kernel rotation is
+// seen once, while rejecting samples across depth discontinuities.
+static const char* BLUR_SOURCE = R"(
+uniform sampler2DRect ao_tex;
+
+layout(location = 0) out vec4 out_ao;
 
+void main(void) {
+  ivec2 size = textureSize(ao_tex);
+  ivec2 coord = ivec2(gl_FragCoord.xy);
+  vec4 center = texelFetch(ao_tex, coord);
+
+  float sum = 0.0;
+  float weight = 0.0;
+  for (int y = -NOISE_SIZE / 2; y < NOISE_SIZE / 2; y++) {
+    for (int x = -NOISE_SIZE / 2; x < NOISE_SIZE / 2; x++) {
+      ivec2 c = clamp(coord + ivec2(x, y), ivec2(0), size - 1);
+      vec4 s = texelFetch(ao_tex, c);
+      float w = depthWeight(s.g, center.g);
+      sum += w * s.r;
+      weight += w;
+    }
+  }
+  out_ao = vec4(sum / weight, center.g, 0.0, 0.0);
+}
 )";
 
-std::unique_ptr<SSAOStage> SSAOStage::Create(int width, int height) {
-  auto fstage = FragmentStage::Create(width, height, 1, FS_SOURCE);
-  if (!fstage)
+// Interpolates the half resolution occlusion at each pixel, weighing the
+// four nearest samples by their similarity in depth, and outputs the occluded
+// ambient light along with the occlusion in alpha.
+static const char* RESOLVE_SOURCE = R"(
+uniform sampler2DRect ao_tex;
+uniform sampler2DRect albedo_tex;
+uniform sampler2D depth_tex;
+uniform vec4 ambient_color;
+
+layout(location = 0) out vec4 out_light;
+
+void main(void) {
+  float distance = linearizeDepth(
+      texelFetch(depth_tex, ivec2(gl_FragCoord.xy), 0).r);
+
+  // Half resolution samples lie at the top left of their footprint.
+  vec2 h = (gl_FragCoord.xy - 0.5) * 0.5;
+  ivec2 base = ivec2(floor(h));
+  vec2 f = h - vec2(base);
+  ivec2 size = textureSize(ao_tex);
+
+  float sum = 0.0;
+  float weight = 0.0;
+  for (int i = 0; i < 4; i++) {
+    ivec2 o = ivec2(i & 1, i >> 1);
+    vec4 s = texelFetch(ao_tex, clamp(base + o, ivec2(0), size - 1));
+    vec2 b = mix(1.0 - f, f, vec2(o));
+    float w = b.x * b.y * depthWeight(s.g, distance) + 1e-4;
+    sum += w * s.r;
+    weight += w;
+  }
+  float ao = sum / weight;
+
+  vec4 albedo = texelFetch(albedo_tex, ivec2(gl_FragCoord.xy));
+  out_light = vec4(ambient_color.rgb * albedo.rgb * ao, ao);
+}
+)";
+
+// Concatenates the shared header and `source` into a full fragment shader.
+static std::string BuildSource(GeometryStage::Layout layout,
+                               const char* source) {
+  std::ostringstream fs;
+  fs << "#version 330 core" << std::endl
+     << GeometryStage::layout_defines(layout)
+     << "#define KERNEL_SIZE " << KERNEL_SIZE << std::endl
+     << "#define NOISE_SIZE " << NOISE_SIZE << std::endl
+     << "#define HIZ_LEVELS " << HIZ_LEVELS << std::endl
+     << "#define DEPTH_SHARPNESS 16.0" << std::endl
+     << GeometryStage::normal_decode_source()
+     << COMMON_SOURCE
+     << source;
+  return fs.str();
+}
+
+std::unique_ptr<SSAOStage> SSAOStage::Create(RenderTargetPool& pool,
+                                             int width, int height,
+                                             GeometryStage::Layout layout,
+                                             const glm::vec4 ambient_color) {
+  const RenderTargetDesc ao_desc = occlusion_desc(width, height);
+  auto ao_stage = FragmentStage::Create(
+      pool, ao_desc.width, ao_desc.height, { ao_desc.format },
+      BuildSource(layout, AO_SOURCE).c_str(),
+      FragmentStage::OUTPUTS_EXTERNAL);
+  auto blur_stage = FragmentStage::Create(
+      pool, ao_desc.width, ao_desc.height, { ao_desc.format },
+      BuildSource(layout, BLUR_SOURCE).c_str(),
+      FragmentStage::OUTPUTS_EXTERNAL);
+  auto resolve_stage = FragmentStage::Create(
+      pool, width, height, { PhongStage::format() },
+      BuildSource(layout, RESOLVE_SOURCE).c_str(),
+      FragmentStage::OUTPUTS_EXTERNAL);
+  if (!ao_stage || !blur_stage || !resolve_stage) {
+    std::cerr << "[ssao] failed to create fragment stages!" << std::endl;
     return nullptr;
+  }
 
-  GLint u_mvp_matrix = glGetUniformLocation(fstage->program(), "mvp_matrix");
-  GLint u_light_tex = glGetUniformLocation(fstage->program(), "light_tex");
-  GLint u_depth_tex = glGetUniformLocation(fstage->program(), "depth_tex");
+  // Random rotations about the view axis, tiled over the screen.
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> signed_unit(-1.f, 1.f);
+  std::vector<GLfloat> noise(NOISE_SIZE * NOISE_SIZE * 2);
+  for (GLfloat& n : noise) {
+    n = signed_unit(rng);
+  }
+
+  GLuint noise_tex;
+  glGenTextures(1, &noise_tex);
+  glBindTexture(GL_TEXTURE_2D, noise_tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, NOISE_SIZE, NOISE_SIZE, 0, GL_RG,
+               GL_FLOAT, noise.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
 
-  return std::make_unique<SSAOStage>(std::move(fstage), u_mvp_matrix,
-                                     u_light_tex, u_depth_tex);
+  return std::make_unique<SSAOStage>(std::move(ao_stage),
+                                     std::move(blur_stage),
+                                     std::move(resolve_stage), noise_tex,
+                                     ambient_color);
 }
 
-SSAOStage::SSAOStage(std::unique_ptr<FragmentStage> fstage,
-                     GLint uniform_mvp_matrix,
-                     GLint uniform_light_tex,
-                     GLint uniform_depth_tex)
-  : fstage_(std::move(fstage))
-  , uniform_mvp_matrix_(uniform_mvp_matrix)
-  , uniform_light_tex_(uniform_light_tex)
-  , uniform_depth_tex_(uniform_depth_tex) {}
-
-void SSAOStage::Clear() {
-  fstage_->Clear(0.f, 0.f, 0.f, 0.f);
+SSAOStage::SSAOStage(std::unique_ptr<FragmentStage> ao_stage,
+                     std::unique_ptr<FragmentStage> blur_stage,
+                     std::unique_ptr<FragmentStage> resolve_stage,
+                     GLuint noise_tex, const glm::vec4 ambient_color)
+  : ao_stage_(std::move(ao_stage))
+  , blur_stage_(std::move(blur_stage))
+  , resolve_stage_(std::move(resolve_stage))
+  , noise_tex_(noise_tex), ambient_color_(ambient_color) {
+  GLuint program = ao_stage_->program();
+  uniform_ao_depth_tex_ = glGetUniformLocation(program, "depth_tex");
+  uniform_ao_normal_tex_ = glGetUniformLocation(program, "normal_tex");
+  uniform_ao_noise_tex_ = glGetUniformLocation(program, "noise_tex");
+  uniform_ao_hiz_tex_ = glGetUniformLocation(program, "hiz_tex");
+  uniform_ao_max_hiz_level_ = glGetUniformLocation(program, "max_hiz_level");
+  uniform_ao_projection_ = glGetUniformLocation(program, "projection");
+  uniform_ao_inverse_projection_ =
+      glGetUniformLocation(program, "inverse_projection");
+  uniform_ao_normal_matrix_ = glGetUniformLocation(program, "normal_matrix");
+
+  // Samples in the unit hemisphere about +z, denser towards the center.
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  std::vector<glm::vec3> kernel(KERNEL_SIZE);
+  for (int i = 0; i < KERNEL_SIZE; i++) {
+    glm::vec3 sample(unit(rng) * 2.f - 1.f, unit(rng) * 2.f - 1.f, unit(rng));
+    sample = glm::normalize(sample) * unit(rng);
+    float scale = (float) i / KERNEL_SIZE;
+    kernel[i] = sample * (0.1f + 0.9f * scale * scale);
+  }
+  glUseProgram(program);
+  glUniform3fv(glGetUniformLocation(program, "kernel"), KERNEL_SIZE,
+               glm::value_ptr(kernel[0]));
+  glUniform1f(glGetUniformLocation(program, "radius"), RADIUS);
+  glUniform1f(glGetUniformLocation(program, "bias"), BIAS);
+
+  program = blur_stage_->program();
+  uniform_blur_ao_tex_ = glGetUniformLocation(program, "ao_tex");
+
+  program = resolve_stage_->program();
+  uniform_resolve_ao_tex_ = glGetUniformLocation(program, "ao_tex");
+  uniform_resolve_albedo_tex_ = glGetUniformLocation(program, "albedo_tex");
+  uniform_resolve_depth_tex_ = glGetUniformLocation(program, "depth_tex");
+  uniform_resolve_projection_ = glGetUniformLocation(program, "projection");
+  uniform_resolve_ambient_color_ =
+      glGetUniformLocation(program, "ambient_color");
 }
 
-void SSAOStage::Render(const game::Camera& camera, GLuint light_tex, GLuint depth_tex) {
-  glUseProgram(fstage_->program());
+SSAOStage::~SSAOStage() {
+  glDeleteTextures(1, &noise_tex_);
+}
+
+/* static */
+RenderTargetDesc SSAOStage::occlusion_desc(int width, int height) {
+  // Occlusion and the linear depth weighing the blur and upsample; half
+  // floats keep depth within a fraction of a percent.
+  return { (width + 1) / 2, (height + 1) / 2, GL_RG16F,
+           GL_TEXTURE_RECTANGLE };
+}
 
-  auto proj = camera.ComputeProjection();
-  glUniformMatrix4fv(uniform_mvp_matrix_, 1, GL_FALSE, glm::value_ptr(proj));
+void SSAOStage::Occlude(const game::Camera& camera, GLuint depth_tex,
+                        GLuint normal_tex, const HiZStage& hiz,
+                        GLuint ao_tex) {
+  const RenderTargetDesc ao_desc =
+      occlusion_desc(camera.viewport_width(), camera.viewport_height());
+  const glm::mat4& projection = camera.projection_matrix();
 
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+  glViewport(0, 0, ao_desc.width, ao_desc.height);
+  glUseProgram(ao_stage_->program());
+  glUniformMatrix4fv(uniform_ao_projection_, 1, GL_FALSE,
+                     glm::value_ptr(projection));
+  glUniformMatrix4fv(uniform_ao_inverse_projection_, 1, GL_FALSE,
+                     glm::value_ptr(glm::inverse(projection)));
+  const glm::mat3 normal_matrix(camera.ComputeView());
+  glUniformMatrix3fv(uniform_ao_normal_matrix_, 1, GL_FALSE,
+                     glm::value_ptr(normal_matrix));
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, depth_tex);
+  glUniform1i(uniform_ao_depth_tex_, 0);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_RECTANGLE, normal_tex);
+  glUniform1i(uniform_ao_normal_tex_, 1);
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_2D, noise_tex_);
+  glUniform1i(uniform_ao_noise_tex_, 2);
+  const int num_hiz_levels = std::min(hiz.num_levels(), HIZ_LEVELS);
+  GLint hiz_units[HIZ_LEVELS];
+  for (int i = 0; i < HIZ_LEVELS; i++) {
+    // Unused levels alias the coarsest one, to keep the samplers valid.
+    hiz_units[i] = 3 + std::min(i, num_hiz_levels - 1);
+  }
+  for (int i = 0; i < num_hiz_levels; i++) {
+    glActiveTexture(GL_TEXTURE3 + i);
+    glBindTexture(GL_TEXTURE_RECTANGLE, hiz.tex(i));
+  }
+  glUniform1iv(uniform_ao_hiz_tex_, HIZ_LEVELS, hiz_units);
+  glUniform1i(uniform_ao_max_hiz_level_, num_hiz_levels - 1);
+  ao_stage_->SetOutputs(&ao_tex);
+  ao_stage_->Draw();
+}
+
+void SSAOStage::Blur(const game::Camera& camera, GLuint ao_tex,
+                     GLuint blurred_tex) {
+  const RenderTargetDesc ao_desc =
+      occlusion_desc(camera.viewport_width(), camera.viewport_height());
+
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+  glViewport(0, 0, ao_desc.width, ao_desc.height);
+  glUseProgram(blur_stage_->program());
   glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_RECTANGLE, light_tex);
-  glUniform1i(uniform_light_tex_, 0);
+  glBindTexture(GL_TEXTURE_RECTANGLE, ao_tex);
+  glUniform1i(uniform_blur_ao_tex_, 0);
+  blur_stage_->SetOutputs(&blurred_tex);
+  blur_stage_->Draw();
+}
+
+void SSAOStage::Resolve(const game::Camera& camera, GLuint blurred_tex,
+                        GLuint albedo_tex, GLuint depth_tex,
+                        GLuint light_tex) {
+  const glm::mat4& projection = camera.projection_matrix();
 
-  // FIXME: for some reason we can't use GL_TEXTURE_RECTANGLE here to disable compare mode :(
-  //        we should probably switch to npot GL_TEXTURE_2D everywhere anyway.
+  // Upsampling and ambient light, written over the light buffer at full
+  // resolution.
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_BLEND);
+  glViewport(0, 0, camera.viewport_width(), camera.viewport_height());
+  glUseProgram(resolve_stage_->program());
+  glUniformMatrix4fv(uniform_resolve_projection_, 1, GL_FALSE,
+                     glm::value_ptr(projection));
+  glUniform4fv(uniform_resolve_ambient_color_, 1,
+               glm::value_ptr(ambient_color_));
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_RECTANGLE, blurred_tex);
+  glUniform1i(uniform_resolve_ao_tex_, 0);
   glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_RECTANGLE, albedo_tex);
+  glUniform1i(uniform_resolve_albedo_tex_, 1);
+  glActiveTexture(GL_TEXTURE2);
   glBindTexture(GL_TEXTURE_2D, depth_tex);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
-  glUniform1i(uniform_depth_tex_, 1);
+  glUniform1i(uniform_resolve_depth_tex_, 2);
+  resolve_stage_->SetOutputs(&light_tex);
+  resolve_stage_->Draw();
 
-  fstage_->Draw();
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 }  // namespace pipe
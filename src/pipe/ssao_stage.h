@@ -2,36 +2,85 @@
 #define QUARKE_SRC_PIPE_SSAO_STAGE_H_
 
 #include "pipe/fragment_stage.h"
+#include "pipe/geometry_stage.h"
+#include "pipe/hiz_stage.h"
+#include "pipe/phong_stage.h"
 #include "game/camera.h"
 #include <memory>
 
 namespace quarke {
 namespace pipe {
 
-// A screen-space ambient occlusion pass using a randomly rotated kernel.
-// Designed to accept the final lit scene as input, but doesn't have to.
+// A screen-space ambient occlusion pass sampling a normal-oriented hemisphere
+// around each pixel with a fixed kernel, rotated per pixel by a tiled noise
+// texture.
+//
+// Occlusion is evaluated at half resolution, then denoised with a
+// depth-aware blur over the noise tile and bilaterally upsampled to full
+// resolution. The upsampling resolves the ambient light, initializing the
+// light buffer with the occluded ambient term and the occlusion in alpha,
+// which PhongStage applies to the lights it accumulates. Samples far from
+// their pixel on screen read coarse levels of a Hi-Z pyramid rather than the
+// depth buffer, keeping wide radii cache friendly.
+//
+// The half resolution targets are provided by the caller, such as transients
+// of a RenderGraph, as they are only needed between passes.
 class SSAOStage {
  public:
-  static std::unique_ptr<SSAOStage> Create(int width, int height);
-  SSAOStage(std::unique_ptr<FragmentStage> fstage,
-            GLint uniform_mvp_matrix,
-            GLint uniform_light_tex,
-            GLint uniform_depth_tex);
+  // Creates a stage reading G-buffers of the given layout.
+  static std::unique_ptr<SSAOStage> Create(RenderTargetPool& pool,
+                                           int width, int height,
+                                           GeometryStage::Layout layout,
+                                           const glm::vec4 ambient_color = glm::vec4(0.1, 0.1, 0.1, 1.0));
+  SSAOStage(std::unique_ptr<FragmentStage> ao_stage,
+            std::unique_ptr<FragmentStage> blur_stage,
+            std::unique_ptr<FragmentStage> resolve_stage,
+            GLuint noise_tex, const glm::vec4 ambient_color);
+  ~SSAOStage();
 
-  void Clear();
+  // Returns the description of the half resolution occlusion targets for a
+  // screen of the given size.
+  static RenderTargetDesc occlusion_desc(int width, int height);
 
-  // Renders AO upon the given light_tex using information from depth_tex.
-  // Assumes both textures are of type GL_TEXTURE_RECTANGLE.
-  void Render(const game::Camera& camera, GLuint light_tex, GLuint depth_tex);
+  // Writes the occlusion of the G-buffer's depth_tex and normal_tex to
+  // `ao_tex`, of occlusion_desc(), sampling `hiz` built from depth_tex.
+  void Occlude(const game::Camera& camera, GLuint depth_tex, GLuint normal_tex,
+               const HiZStage& hiz, GLuint ao_tex);
 
-  GLuint fbo() const { return fstage_->fbo(); }
-  GLuint buffer() const { return GL_COLOR_ATTACHMENT0; }
-  GLuint tex() const { return fstage_->texture(0); }
+  // Denoises the occlusion in `ao_tex` into `blurred_tex`, both of
+  // occlusion_desc().
+  void Blur(const game::Camera& camera, GLuint ao_tex, GLuint blurred_tex);
+
+  // Overwrites `light_tex`, a texture of PhongStage::format(), with the
+  // ambient light reflected by the G-buffer's albedo_tex and its occlusion
+  // upsampled from `blurred_tex`.
+  void Resolve(const game::Camera& camera, GLuint blurred_tex,
+               GLuint albedo_tex, GLuint depth_tex, GLuint light_tex);
+
+  void SetAmbientColor(const glm::vec4 color) { ambient_color_ = color; }
  private:
-  std::unique_ptr<FragmentStage> fstage_;
-  GLint uniform_mvp_matrix_;
-  GLint uniform_light_tex_;
-  GLint uniform_depth_tex_;
+  std::unique_ptr<FragmentStage> ao_stage_;
+  std::unique_ptr<FragmentStage> blur_stage_;
+  std::unique_ptr<FragmentStage> resolve_stage_;
+  const GLuint noise_tex_;
+  glm::vec4 ambient_color_;
+
+  GLint uniform_ao_depth_tex_;
+  GLint uniform_ao_normal_tex_;
+  GLint uniform_ao_noise_tex_;
+  GLint uniform_ao_hiz_tex_;
+  GLint uniform_ao_max_hiz_level_;
+  GLint uniform_ao_projection_;
+  GLint uniform_ao_inverse_projection_;
+  GLint uniform_ao_normal_matrix_;
+
+  GLint uniform_blur_ao_tex_;
+
+  GLint uniform_resolve_ao_tex_;
+  GLint uniform_resolve_albedo_tex_;
+  GLint uniform_resolve_depth_tex_;
+  GLint uniform_resolve_projection_;
+  GLint uniform_resolve_ambient_color_;
 };
 
 }  // namespace pipe
@@ -0,0 +1,17 @@
+# Captures a frame with quarke and compares it against a reference capture.
+# Invoked by ctest with QUARKE, FRAMEDIFF, REFERENCE, CAPTURE and TOLERANCE
+# defined.
+
+file(REMOVE ${CAPTURE})
+execute_process(COMMAND ${QUARKE} --capture ${CAPTURE}
+                RESULT_VARIABLE status)
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "Capturing ${CAPTURE} failed.")
+endif()
+
+execute_process(COMMAND ${FRAMEDIFF} -t ${TOLERANCE} ${REFERENCE} ${CAPTURE}
+                RESULT_VARIABLE status)
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "${CAPTURE} differs from ${REFERENCE} by more than "
+                      "${TOLERANCE}.")
+endif()
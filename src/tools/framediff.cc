@@ -0,0 +1,66 @@
+// Compares two frames captured with `quarke --capture`, reporting how many
+// pixels differ and by how much. Fails if any channel differs by more than
+// the tolerance, in 8-bit steps.
+//
+// Usage: quarke_framediff [-t tolerance] expected.tga actual.tga
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "util/toytga.h"
+
+using quarke::util::TGA::Descriptor;
+
+int main(int argc, char* argv[]) {
+  int tolerance = 0;
+  const char* paths[2] = {};
+  int num_paths = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      tolerance = atoi(argv[++i]);
+    } else if (num_paths < 2) {
+      paths[num_paths++] = argv[i];
+    }
+  }
+  if (num_paths != 2) {
+    std::cerr << "Usage: " << argv[0] << " [-t tolerance] expected.tga"
+              << " actual.tga" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Descriptor frames[2];
+  for (int i = 0; i < 2; i++) {
+    if (!quarke::util::TGA::LoadTGA(paths[i], frames[i]))
+      return EXIT_FAILURE;
+  }
+  if (frames[0].width != frames[1].width ||
+      frames[0].height != frames[1].height ||
+      frames[0].format != frames[1].format) {
+    std::cerr << "Frames differ in size or format." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  const int pixel_size =
+      frames[0].format == Descriptor::TGA_RGBA32 ? 4 : 3;
+  const unsigned char* expected = (const unsigned char*) frames[0].data;
+  const unsigned char* actual = (const unsigned char*) frames[1].data;
+  int max_diff = 0;
+  size_t differing = 0;
+  for (int p = 0; p < frames[0].length; p += pixel_size) {
+    int pixel_diff = 0;
+    for (int c = 0; c < pixel_size; c++) {
+      pixel_diff = std::max(pixel_diff, abs(expected[p + c] - actual[p + c]));
+    }
+    max_diff = std::max(max_diff, pixel_diff);
+    if (pixel_diff > 0)
+      differing++;
+  }
+
+  const size_t num_pixels = frames[0].width * frames[0].height;
+  std::cout << differing << " of " << num_pixels << " pixels differ, by at "
+            << "most " << max_diff << std::endl;
+  free(frames[0].data);
+  free(frames[1].data);
+  return max_diff <= tolerance ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,50 @@
+// Reports post-transform vertex cache efficiency of OBJ meshes before and
+// after optimization, as performed at load time by geo::Mesh::FromOBJ.
+//
+// Usage: quarke_meshopt [-c cache_size] file.obj...
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "geo/mesh.h"
+#include "geo/mesh_optimizer.h"
+
+using quarke::geo::Mesh;
+using quarke::geo::MeshData;
+using quarke::geo::VertexCacheStats;
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " [-c cache_size] file.obj..."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  size_t cache_size = quarke::geo::DEFAULT_VERTEX_CACHE_SIZE;
+  int failures = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      cache_size = strtoul(argv[++i], nullptr, 10);
+      continue;
+    }
+
+    MeshData data;
+    if (!Mesh::LoadOBJ(argv[i], data)) {
+      failures++;
+      continue;
+    }
+
+    const size_t num_vertices = data.num_vertices();
+    VertexCacheStats before, after;
+    quarke::geo::OptimizeMesh(data, &before, &after, cache_size);
+
+    std::cout << argv[i] << ": " << data.indices.size() / 3 << " triangles, "
+              << num_vertices << " vertices (cache size " << cache_size << ")"
+              << std::endl
+              << "  ACMR " << before.acmr << " -> " << after.acmr << std::endl
+              << "  ATVR " << before.atvr << " -> " << after.atvr << std::endl
+              << "  transformed " << before.transformed << " -> "
+              << after.transformed << std::endl;
+  }
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+// Compares throughput and output of geo::ParseOBJ against tinyobjloader.
+// Without arguments, a synthetic OBJ of roughly `-s` megabytes is generated
+// in the working directory and used as input.
+//
+// Usage: quarke_objbench [-s size_mb] [-t threads] [file.obj...]
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "geo/obj_parser.h"
+
+using quarke::geo::ObjData;
+using quarke::geo::ObjIndex;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Writes a grid of quads with positions, normals and uvs, until the file is
+// at least `size_mb` megabytes.
+bool GenerateOBJ(const std::string& path, size_t size_mb) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file) {
+    std::cerr << "[objbench] Failed to create " << path << std::endl;
+    return false;
+  }
+
+  // Each grid vertex emits roughly 150 bytes of attributes and faces.
+  const size_t target = size_mb * 1024 * 1024;
+  const size_t dim = std::max<size_t>(2, std::sqrt(target / 150));
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> jitter(-0.5f, 0.5f);
+  for (size_t y = 0; y < dim; y++) {
+    for (size_t x = 0; x < dim; x++) {
+      fprintf(file, "v %f %f %f\n", x + jitter(rng), y + jitter(rng),
+              jitter(rng) * 1e-3f);
+      fprintf(file, "vn %f %f %f\n", jitter(rng), jitter(rng), 1.f);
+      fprintf(file, "vt %f %f\n", (float) x / dim, (float) y / dim);
+    }
+  }
+  for (size_t y = 0; y + 1 < dim; y++) {
+    for (size_t x = 0; x + 1 < dim; x++) {
+      size_t a = y * dim + x + 1, b = a + 1, c = a + dim + 1, d = a + dim;
+      fprintf(file, "f %zu/%zu/%zu %zu/%zu/%zu %zu/%zu/%zu %zu/%zu/%zu\n",
+              a, a, a, b, b, b, c, c, c, d, d, d);
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+size_t FileSize(const std::string& path) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  return in ? (size_t) in.tellg() : 0;
+}
+
+float MaxDifference(const std::vector<float>& a, const std::vector<float>& b) {
+  if (a.size() != b.size())
+    return INFINITY;
+  float diff = 0.f;
+  for (size_t i = 0; i < a.size(); i++) {
+    diff = std::max(diff, std::fabs(a[i] - b[i]));
+  }
+  return diff;
+}
+
+bool Benchmark(const std::string& path, unsigned threads) {
+  const double megabytes = FileSize(path) / (1024.0 * 1024.0);
+
+  Clock::time_point start = Clock::now();
+  ObjData obj;
+  if (!quarke::geo::ParseOBJ(path, obj, threads))
+    return false;
+  const double parse_time = SecondsSince(start);
+
+  start = Clock::now();
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string err;
+  if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, path.c_str(),
+                        nullptr, true)) {
+    std::cerr << "[objbench] tinyobj failed: " << err << std::endl;
+    return false;
+  }
+  const double tinyobj_time = SecondsSince(start);
+
+  std::vector<tinyobj::index_t> reference;
+  for (tinyobj::shape_t& shape : shapes) {
+    reference.insert(reference.end(), shape.mesh.indices.begin(),
+                     shape.mesh.indices.end());
+  }
+  bool indices_match = reference.size() == obj.indices.size();
+  for (size_t i = 0; indices_match && i < reference.size(); i++) {
+    const ObjIndex& a = obj.indices[i];
+    const tinyobj::index_t& b = reference[i];
+    indices_match = a.position == b.vertex_index &&
+                    a.normal == b.normal_index &&
+                    a.texcoord == b.texcoord_index;
+  }
+
+  std::cout << path << " (" << megabytes << " MB)" << std::endl
+            << "  ParseOBJ " << parse_time << "s, "
+            << megabytes / parse_time << " MB/s" << std::endl
+            << "  tinyobj  " << tinyobj_time << "s, "
+            << megabytes / tinyobj_time << " MB/s" << std::endl
+            << "  speedup  " << tinyobj_time / parse_time << "x" << std::endl
+            << "  indices  " << (indices_match ? "match" : "MISMATCH")
+            << std::endl
+            << "  max difference: positions "
+            << MaxDifference(obj.positions, attrib.vertices)
+            << ", normals " << MaxDifference(obj.normals, attrib.normals)
+            << ", texcoords " << MaxDifference(obj.texcoords, attrib.texcoords)
+            << std::endl;
+  return indices_match;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  size_t size_mb = 256;
+  unsigned threads = 0;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      size_mb = strtoul(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      threads = strtoul(argv[++i], nullptr, 10);
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+
+  if (paths.empty()) {
+    const std::string generated = "objbench.obj";
+    if (!GenerateOBJ(generated, size_mb))
+      return EXIT_FAILURE;
+    paths.push_back(generated);
+  }
+
+  int failures = 0;
+  for (const std::string& path : paths) {
+    if (!Benchmark(path, threads))
+      failures++;
+  }
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
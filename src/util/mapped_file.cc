@@ -0,0 +1,44 @@
+#include "util/mapped_file.h"
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace quarke {
+namespace util {
+
+/* static */
+std::unique_ptr<MappedFile> MappedFile::Open(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  size_t size = st.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping remains valid after the descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "[mmap] Failed to map " << path << std::endl;
+    return nullptr;
+  }
+
+  return std::make_unique<MappedFile>(data, size);
+}
+
+MappedFile::MappedFile(const void* data, size_t size)
+  : data_(data), size_(size) {
+}
+
+MappedFile::~MappedFile() {
+  munmap(const_cast<void*>(data_), size_);
+}
+
+}  // namespace util
+}  // namespace quarke
@@ -0,0 +1,33 @@
+#ifndef QUARKE_SRC_UTIL_MAPPED_FILE_H_
+#define QUARKE_SRC_UTIL_MAPPED_FILE_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace quarke {
+namespace util {
+
+// A read-only memory mapping of an entire file.
+class MappedFile {
+ public:
+  // Maps the file at `path` into memory. Returns nullptr on failure, or if the
+  // file is empty.
+  static std::unique_ptr<MappedFile> Open(const std::string& path);
+
+  MappedFile(const void* data, size_t size);
+  MappedFile(const MappedFile&) = delete;
+  MappedFile(MappedFile&&) = delete;
+  ~MappedFile();
+
+  const void* data() const { return data_; }
+  size_t size() const { return size_; }
+ private:
+  const void* data_;
+  size_t size_;
+};
+
+}  // namespace util
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_UTIL_MAPPED_FILE_H_
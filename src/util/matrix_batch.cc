@@ -0,0 +1,55 @@
+#include "util/matrix_batch.h"
+#include <glm/gtc/type_ptr.hpp>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define QUARKE_MATRIX_BATCH_SSE
+#endif
+
+namespace quarke {
+namespace util {
+
+#ifdef QUARKE_MATRIX_BATCH_SSE
+
+void MultiplyMatrices(const glm::mat4& lhs, const glm::mat4* rhs,
+                      glm::mat4* out, size_t count) {
+  // Matrices are column-major, so each column of the product is a linear
+  // combination of the columns of `lhs`, weighted by a column of `rhs[i]`.
+  const float* a = glm::value_ptr(lhs);
+  const __m128 a0 = _mm_loadu_ps(a);
+  const __m128 a1 = _mm_loadu_ps(a + 4);
+  const __m128 a2 = _mm_loadu_ps(a + 8);
+  const __m128 a3 = _mm_loadu_ps(a + 12);
+
+  for (size_t i = 0; i < count; i++) {
+    const float* b = glm::value_ptr(rhs[i]);
+    // Load all columns before storing any, in case `out` aliases `rhs`.
+    __m128 columns[4];
+    for (int c = 0; c < 4; c++) {
+      const __m128 bc = _mm_loadu_ps(b + c * 4);
+      __m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(0, 0, 0, 0)));
+      r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(1, 1, 1, 1))));
+      r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(2, 2, 2, 2))));
+      r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(bc, bc, _MM_SHUFFLE(3, 3, 3, 3))));
+      columns[c] = r;
+    }
+    float* o = glm::value_ptr(out[i]);
+    for (int c = 0; c < 4; c++) {
+      _mm_storeu_ps(o + c * 4, columns[c]);
+    }
+  }
+}
+
+#else
+
+void MultiplyMatrices(const glm::mat4& lhs, const glm::mat4* rhs,
+                      glm::mat4* out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = lhs * rhs[i];
+  }
+}
+
+#endif  // QUARKE_MATRIX_BATCH_SSE
+
+}  // namespace util
+}  // namespace quarke
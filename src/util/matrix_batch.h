@@ -0,0 +1,19 @@
+#ifndef QUARKE_SRC_UTIL_MATRIX_BATCH_H_
+#define QUARKE_SRC_UTIL_MATRIX_BATCH_H_
+
+#include <cstddef>
+#include <glm/glm.hpp>
+
+namespace quarke {
+namespace util {
+
+// Computes out[i] = lhs * rhs[i] for `count` matrices, as when transforming
+// an array of model matrices by a shared view-projection. Uses SSE where
+// available, falling back to scalar code. `out` may alias `rhs`.
+void MultiplyMatrices(const glm::mat4& lhs, const glm::mat4* rhs,
+                      glm::mat4* out, size_t count);
+
+}  // namespace util
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_UTIL_MATRIX_BATCH_H_
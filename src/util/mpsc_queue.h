@@ -0,0 +1,66 @@
+#ifndef QUARKE_SRC_UTIL_MPSC_QUEUE_H_
+#define QUARKE_SRC_UTIL_MPSC_QUEUE_H_
+
+#include <atomic>
+#include <utility>
+
+namespace quarke {
+namespace util {
+
+// An unbounded, lock-free, multiple-producer single-consumer FIFO queue, after
+// Dmitry Vyukov's intrusive MPSC node queue.
+// Push may be called from any thread; Pop must only ever be called from a
+// single consumer thread. T must be default constructible and movable.
+template <typename T>
+class MPSCQueue {
+ public:
+  MPSCQueue() : head_(new Node()), tail_(head_.load()) {}
+
+  ~MPSCQueue() {
+    T value;
+    while (Pop(value)) {}
+    delete tail_;
+  }
+
+  MPSCQueue(const MPSCQueue&) = delete;
+  MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+  void Push(T value) {
+    Node* node = new Node(std::move(value));
+    Node* prev = head_.exchange(node, std::memory_order_acq_rel);
+    // Between the exchange and this store, the consumer may briefly observe
+    // the queue as empty; the item becomes visible on a subsequent Pop.
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // Moves the oldest item into `out_value`. Returns false if the queue is
+  // empty.
+  bool Pop(T& out_value) {
+    Node* tail = tail_;
+    Node* next = tail->next.load(std::memory_order_acquire);
+    if (!next)
+      return false;
+    // `next` becomes the new stub node; its value is left moved-from.
+    out_value = std::move(next->value);
+    tail_ = next;
+    delete tail;
+    return true;
+  }
+
+ private:
+  struct Node {
+    Node() : next(nullptr) {}
+    explicit Node(T&& v) : value(std::move(v)), next(nullptr) {}
+
+    T value;
+    std::atomic<Node*> next;
+  };
+
+  std::atomic<Node*> head_; // most recently pushed node, touched by producers
+  Node* tail_; // stub node preceding the oldest item, touched by the consumer
+};
+
+}  // namespace util
+}  // namespace quarke
+
+#endif  // QUARKE_SRC_UTIL_MPSC_QUEUE_H_
@@ -129,6 +129,26 @@ bool LoadTGA(const char* path, Descriptor& out_descriptor) {
   return true;
 }
 
+bool WriteTGA(const char* path, const Descriptor& descriptor) {
+  std::ofstream file(path, std::ofstream::binary | std::ofstream::trunc);
+  if (!file) {
+    std::cerr << "[tga] Failed to open " << path << std::endl;
+    return false;
+  }
+
+  const bool rgba = descriptor.format == Descriptor::TGA_RGBA32;
+  Header header = {};
+  header.image_type = IMAGE_TYPE_UNCOMPRESSED_TRUE_COLOR;
+  header.width = descriptor.width;
+  header.height = descriptor.height;
+  header.depth = rgba ? 32 : 24;
+  header.image_descriptor = rgba ? 8 : 0; // alpha bits
+  file.write((const char*) &header, sizeof(header));
+  file.write(descriptor.data, descriptor.length);
+  file.close();
+  return !file.fail();
+}
+
 }  // namespace TGA
 }  // namespace util
 }  // namespace quarke
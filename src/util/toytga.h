@@ -28,6 +28,10 @@ struct Descriptor {
 // Only true-color TGAs are supported.
 bool LoadTGA(const char* path, Descriptor& out_descriptor);
 
+// Writes the BGR(A) pixels of `descriptor` to an uncompressed TGA file at the
+// given path, rows starting from the bottom.
+bool WriteTGA(const char* path, const Descriptor& descriptor);
+
 }  // namespace TGA
 
 }  // namespace util